@@ -0,0 +1,48 @@
+# Combine the CSV output of several perf-* builds into one table,
+# with a row for each benchmark configuration and a column of
+# throughput (in operations per second) for each lock type.  Repeated
+# runs of a configuration are averaged.  See "make compare".
+
+BEGIN {
+	FS = ","
+}
+
+$1 == "benchmark" {
+	next
+}
+
+{
+	key = $1 SUBSEP $4 SUBSEP $5 SUBSEP $6
+	if (!(key in seen)) {
+		seen[key] = 1
+		keys[nkeys++] = key
+	}
+
+	if (!($2 in lock_seen)) {
+		lock_seen[$2] = 1
+		locks[nlocks++] = $2
+	}
+
+	sum[key, $2] += $10
+	count[key, $2]++
+}
+
+END {
+	printf "%-12s %7s %5s %5s", "benchmark", "threads", "cs", "ncs"
+	for (l = 0; l < nlocks; l++)
+		printf " %18s", locks[l]
+	printf "\n"
+
+	for (k = 0; k < nkeys; k++) {
+		split(keys[k], f, SUBSEP)
+		printf "%-12s %7d %5d %5d", f[1], f[2], f[3], f[4]
+		for (l = 0; l < nlocks; l++) {
+			c = count[keys[k], locks[l]]
+			if (c)
+				printf " %18.0f", sum[keys[k], locks[l]] / c
+			else
+				printf " %18s", "-"
+		}
+		printf "\n"
+	}
+}
@@ -0,0 +1,378 @@
+/* A benchmark of the benefit of small locks when there are very many
+ * of them.
+ *
+ * Millions of small objects are allocated, each containing a lock and
+ * a payload, and threads lock, modify and unlock objects chosen at
+ * random.  This reports throughput, the memory used by the objects
+ * (as the growth in the resident set size), and last level cache and
+ * data TLB misses per operation (from perf_event_open, if the kernel
+ * allows it).
+ *
+ * See perf_mutex.h for how the lock type is selected.  Run with -h
+ * for the options.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf_mutex.h"
+
+#define MAX_THREADS_LIST 32
+
+static struct {
+	long objects;
+	size_t payload;
+	int threads[MAX_THREADS_LIST];
+	int threads_n;
+	long duration_ms;
+	int csv;
+} opts;
+
+/* Objects are a mutex_t followed by the payload, aligned as they
+   would be in a struct. */
+#define WORD_ROUND(n) \
+	(((n) + sizeof(unsigned long) - 1) / sizeof(unsigned long) \
+	 * sizeof(unsigned long))
+#define PAYLOAD_OFFSET WORD_ROUND(sizeof(mutex_t))
+
+static size_t object_size;
+static char *objects;
+
+static mutex_t *object_mutex(long i)
+{
+	return (mutex_t *)(objects + i * object_size);
+}
+
+static unsigned long *object_payload(long i)
+{
+	return (unsigned long *)(objects + i * object_size
+				   + PAYLOAD_OFFSET);
+}
+
+static long rss_bytes(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	long size, resident;
+
+	if (!f)
+		return -1;
+
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+
+	fclose(f);
+	return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Hardware counters.  These are opened with inherit set before the
+   threads are created, so they count every thread in the process. */
+
+struct counter {
+	const char *name;
+	unsigned int config;
+	int fd;
+};
+
+#define CACHE_READ_MISS(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+	 | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static struct counter counters[] = {
+	{ "llc_misses", CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL), -1 },
+	{ "dtlb_misses", CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB), -1 },
+	{ NULL, 0, -1 }
+};
+
+static void counters_open(void)
+{
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; counters[i].name; i++) {
+		memset(&attr, 0, sizeof attr);
+		attr.size = sizeof attr;
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = counters[i].config;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		/* If the counter is not available, it is reported as -1. */
+		counters[i].fd = syscall(__NR_perf_event_open, &attr, 0, -1,
+					 -1, 0);
+	}
+}
+
+static void counters_ioctl(int request)
+{
+	int i;
+
+	for (i = 0; counters[i].name; i++)
+		if (counters[i].fd >= 0)
+			assert(!ioctl(counters[i].fd, request, 0));
+}
+
+static long long counter_read(struct counter *c)
+{
+	long long val;
+
+	if (c->fd < 0 || read(c->fd, &val, sizeof val) != sizeof val)
+		return -1;
+
+	return val;
+}
+
+static void counters_close(void)
+{
+	int i;
+
+	for (i = 0; counters[i].name; i++) {
+		if (counters[i].fd >= 0)
+			close(counters[i].fd);
+
+		counters[i].fd = -1;
+	}
+}
+
+struct thread_info {
+	pthread_t thread;
+	int index;
+	unsigned long ops;
+};
+
+static pthread_barrier_t barrier;
+static volatile int stop;
+
+static void barrier_wait(void)
+{
+	int res = pthread_barrier_wait(&barrier);
+	assert(!res || res == PTHREAD_BARRIER_SERIAL_THREAD);
+}
+
+static unsigned long long xorshift(unsigned long long *state)
+{
+	unsigned long long x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void *density_thread(void *v_thread_info)
+{
+	struct thread_info *t = v_thread_info;
+	unsigned long long rand_state = 0x9e3779b97f4a7c15ULL * (t->index + 1);
+	size_t words = opts.payload / sizeof(unsigned long);
+	unsigned long ops = 0;
+	size_t j;
+
+	barrier_wait();
+
+	while (!stop) {
+		long i = xorshift(&rand_state) % opts.objects;
+		unsigned long *payload = object_payload(i);
+
+		assert(!mutex_lock(object_mutex(i)));
+		for (j = 0; j < words; j++)
+			payload[j]++;
+		assert(!mutex_unlock(object_mutex(i)));
+		ops++;
+	}
+
+	t->ops = ops;
+	return NULL;
+}
+
+static void run(int threads, long footprint)
+{
+	struct thread_info *infos = malloc(threads * sizeof *infos);
+	struct timespec duration;
+	long long start, end, misses[2];
+	unsigned long ops = 0;
+	double secs;
+	int i;
+
+	assert(infos);
+	stop = 0;
+	assert(!pthread_barrier_init(&barrier, NULL, threads + 1));
+	counters_open();
+
+	for (i = 0; i < threads; i++) {
+		infos[i].index = i;
+		infos[i].ops = 0;
+		assert(!pthread_create(&infos[i].thread, NULL, density_thread,
+				       &infos[i]));
+	}
+
+	barrier_wait();
+	counters_ioctl(PERF_EVENT_IOC_ENABLE);
+	start = now_nsecs();
+
+	duration.tv_sec = opts.duration_ms / 1000;
+	duration.tv_nsec = opts.duration_ms % 1000 * 1000000;
+	while (nanosleep(&duration, &duration))
+		;
+
+	stop = 1;
+
+	for (i = 0; i < threads; i++) {
+		assert(!pthread_join(infos[i].thread, NULL));
+		ops += infos[i].ops;
+	}
+
+	end = now_nsecs();
+	counters_ioctl(PERF_EVENT_IOC_DISABLE);
+
+	for (i = 0; i < 2; i++)
+		misses[i] = counter_read(&counters[i]);
+
+	counters_close();
+	assert(!pthread_barrier_destroy(&barrier));
+	free(infos);
+
+	secs = (end - start) / 1e9;
+
+	if (opts.csv)
+		printf("%s,%d,%ld,%d,%d,%.6f,%lu,%.0f,%ld,%.2f,%.3f,%.3f\n",
+		       PERF_NAME, (int)sizeof(mutex_t), opts.objects,
+		       (int)object_size, threads, secs, ops, ops / secs,
+		       footprint, (double)footprint / opts.objects,
+		       misses[0] < 0 ? -1.0 : (double)misses[0] / ops,
+		       misses[1] < 0 ? -1.0 : (double)misses[1] / ops);
+	else
+		printf("%-20s %7d %12.0f %10ld %8.2f %8.3f %8.3f\n",
+		       PERF_NAME, threads, ops / secs, footprint / 1024 / 1024,
+		       (double)footprint / opts.objects,
+		       misses[0] < 0 ? -1.0 : (double)misses[0] / ops,
+		       misses[1] < 0 ? -1.0 : (double)misses[1] / ops);
+
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m N       millions of objects (default 4)\n"
+		"  -s BYTES   payload size of each object (default %d)\n"
+		"  -t N,...   thread counts (default 1)\n"
+		"  -d MS      duration of each run (default %ld)\n"
+		"  -f FORMAT  output format: text or csv\n",
+		prog, (int)opts.payload, opts.duration_ms);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	long rss_before, footprint, i;
+	char *tok, *end;
+	int opt;
+
+	opts.objects = 4000000;
+	opts.payload = sizeof(unsigned long);
+	opts.threads[0] = 1;
+	opts.threads_n = 1;
+	opts.duration_ms = 1000;
+
+	while ((opt = getopt(argc, argv, "m:s:t:d:f:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			opts.objects = (long)(strtod(optarg, &end) * 1000000);
+			if (*end || opts.objects <= 0)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			opts.payload = atol(optarg);
+			break;
+
+		case 't':
+			opts.threads_n = 0;
+			for (tok = strtok(optarg, ","); tok;
+			     tok = strtok(NULL, ",")) {
+				int val = strtol(tok, &end, 0);
+
+				if (*end || val <= 0
+				    || opts.threads_n == MAX_THREADS_LIST)
+					usage(argv[0]);
+
+				opts.threads[opts.threads_n++] = val;
+			}
+
+			if (!opts.threads_n)
+				usage(argv[0]);
+			break;
+
+		case 'd':
+			opts.duration_ms = atol(optarg);
+			if (opts.duration_ms <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				opts.csv = 0;
+			else if (!strcmp(optarg, "csv"))
+				opts.csv = 1;
+			else
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc)
+		usage(argv[0]);
+
+	opts.payload = WORD_ROUND(opts.payload);
+	object_size = PAYLOAD_OFFSET + opts.payload;
+
+	rss_before = rss_bytes();
+	objects = malloc(opts.objects * object_size);
+	if (!objects) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(ENOMEM));
+		return 1;
+	}
+
+	for (i = 0; i < opts.objects; i++) {
+		unsigned long *payload = object_payload(i);
+		size_t j;
+
+		assert(!mutex_init(object_mutex(i)));
+		for (j = 0; j < opts.payload / sizeof(unsigned long); j++)
+			payload[j] = 0;
+	}
+
+	footprint = rss_bytes() - rss_before;
+
+	if (opts.csv)
+		printf("lock,lock_size,objects,object_size,threads,secs,ops,"
+		       "ops_per_sec,rss_bytes,bytes_per_object,"
+		       "llc_misses_per_op,dtlb_misses_per_op\n");
+	else
+		printf("%ld objects of %d bytes\n"
+		       "%-20s %7s %12s %10s %8s %8s %8s\n",
+		       opts.objects, (int)object_size, "lock", "threads",
+		       "ops/s", "rss_mb", "B/obj", "llc/op", "dtlb/op");
+
+	for (i = 0; i < opts.threads_n; i++)
+		run(opts.threads[i], footprint);
+
+	for (i = 0; i < opts.objects; i++)
+		assert(!mutex_destroy(object_mutex(i)));
+
+	free(objects);
+	return 0;
+}
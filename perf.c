@@ -1,91 +1,177 @@
-/* Simple performance tests to compare skinny mutexes, pthreads
- *  mutexes and pthrreads spinlocks.
+/* Performance tests to compare skinny mutexes, pthreads mutexes and
+ * pthreads spinlocks.
  *
- * Compile with SKINNY, PTHREADS or SPINLOCK defined for what you want
- * to measure.
+ * See perf_mutex.h for how the lock type is selected.  Run with -h
+ * for the options.  Each benchmark is run for each combination of
+ * the thread counts and critical section and non-critical section
+ * lengths given, and one line of results is produced for each run,
+ * as text, CSV or JSON.
  */
 
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
 
-#ifdef PERF_skinny
-#include "skinny_mutex.h"
-#else
-#include <pthread.h>
-#endif
+#include "perf_mutex.h"
 
-#if defined(PERF_pthreads)
+/* The number of latency samples kept for each thread.  Later samples
+   overwrite earlier ones.  Must be a power of two. */
+#define SAMPLES 65536
 
-typedef pthread_mutex_t mutex_t;
+#define CACHE_LINE 64
 
-static int mutex_init(mutex_t *mutex)
-{
-	return pthread_mutex_init(mutex, NULL);
-}
+#define MAX_LIST 32
 
-#define mutex_destroy pthread_mutex_destroy
-#define mutex_lock pthread_mutex_lock
-#define mutex_unlock pthread_mutex_unlock
+struct int_list {
+	int n;
+	int vals[MAX_LIST];
+};
 
-#elif defined(PERF_skinny)
+static struct {
+	struct int_list threads;
+	struct int_list cs;
+	struct int_list ncs;
+	long duration_ms;
+	long locks;
+	int repeats;
+	int pin;
+	enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON } format;
+	const char *benchmarks;
+} opts;
+
+/* The allowed CPUs, for pinning. */
+static int cpus[CPU_SETSIZE];
+static int cpu_count;
+
+struct run;
+
+struct bench_thread {
+	struct run *run;
+	int index;
+	long long *samples;
+	unsigned long nsamples;
+	unsigned long ops;
+	unsigned long failures;
+};
 
-typedef skinny_mutex_t mutex_t;
+struct run {
+	int threads;
+	int cs;
+	int ncs;
+	long locks;
+	void *data;
+	volatile int stop;
+	pthread_barrier_t barrier;
+	struct bench_thread *thread_infos;
+};
 
-#define mutex_init skinny_mutex_init
-#define mutex_destroy skinny_mutex_destroy
-#define mutex_lock skinny_mutex_lock
-#define mutex_unlock skinny_mutex_unlock
+struct bench {
+	const char *name;
+	int min_threads;
+	void (*setup)(struct run *run);
+	void *(*thread)(void *v_thread_info);
+	void (*teardown)(struct run *run);
+};
 
-#elif defined(PERF_spinlock)
+static void record(struct bench_thread *t, long long ns)
+{
+	t->samples[t->nsamples++ & (SAMPLES - 1)] = ns;
+}
 
-typedef pthread_spinlock_t mutex_t;
+/* Called by each benchmark thread when it is ready to start, and by
+   the main thread to start the clock. */
+static void run_begin(struct run *run)
+{
+	int res = pthread_barrier_wait(&run->barrier);
+	assert(!res || res == PTHREAD_BARRIER_SERIAL_THREAD);
+}
 
-static int mutex_init(mutex_t *mutex)
+static unsigned long total_ops(struct run *run)
 {
-	return pthread_spin_init(mutex, PTHREAD_PROCESS_PRIVATE);
+	unsigned long ops = 0;
+	int i;
+
+	for (i = 0; i < run->threads; i++)
+		ops += run->thread_infos[i].ops;
+
+	return ops;
 }
 
-#define mutex_destroy pthread_spin_destroy
-#define mutex_lock pthread_spin_lock
-#define mutex_unlock pthread_spin_unlock
+static void *alloc_aligned(size_t size)
+{
+	void *p;
+	assert(!posix_memalign(&p, CACHE_LINE, size));
+	return p;
+}
 
-#endif
+/* Each thread locks and unlocks its own mutex, so there is no
+ * contention.  Individual lock/unlock pairs are too quick to time, so
+ * the latency samples are the mean over batches.
+ */
 
-struct test_results {
-	int reps;
-	long long start;
-	long long stop;
-};
+#define UNCONTENDED_BATCH 1000
+#define UNCONTENDED_STRIDE \
+	((sizeof(mutex_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
 
-static long long now_usecs(void)
+static mutex_t *uncontended_mutex(struct run *run, int i)
 {
-	struct timeval tv;
-	assert(!gettimeofday(&tv, NULL));
-	return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+	return (mutex_t *)((char *)run->data + i * UNCONTENDED_STRIDE);
 }
 
-/* Simply acquiring and releasing a lock, without any contention. */
-static void lock_unlock(struct test_results *res)
+static void uncontended_setup(struct run *run)
 {
-	mutex_t mutex;
 	int i;
 
-	assert(!mutex_init(&mutex));
+	run->locks = run->threads;
+	run->data = alloc_aligned(run->threads * UNCONTENDED_STRIDE);
+	for (i = 0; i < run->threads; i++)
+		assert(!mutex_init(uncontended_mutex(run, i)));
+}
+
+static void *uncontended_thread(void *v_thread_info)
+{
+	struct bench_thread *t = v_thread_info;
+	struct run *run = t->run;
+	mutex_t *mutex = uncontended_mutex(run, t->index);
+	volatile unsigned long local = 0;
+	unsigned long ops = 0;
+	int i;
+
+	run_begin(run);
+
+	while (!run->stop) {
+		long long start = now_nsecs();
 
-	res->start = now_usecs();
+		for (i = UNCONTENDED_BATCH; i--;) {
+			assert(!mutex_lock(mutex));
+			work(&local, run->cs);
+			assert(!mutex_unlock(mutex));
+			work(&local, run->ncs);
+		}
 
-	for (i = res->reps; i--;) {
-		assert(!mutex_lock(&mutex));
-		assert(!mutex_unlock(&mutex));
+		record(t, (now_nsecs() - start) / UNCONTENDED_BATCH);
+		ops += UNCONTENDED_BATCH;
 	}
 
-	res->stop = now_usecs();
+	t->ops = ops;
+	return NULL;
+}
+
+static void uncontended_teardown(struct run *run)
+{
+	int i;
+
+	for (i = 0; i < run->threads; i++)
+		assert(!mutex_destroy(uncontended_mutex(run, i)));
 
-	assert(!mutex_destroy(&mutex));
+	free(run->data);
 }
 
 /* Robustly measuring the performance of contended locks is not as
@@ -111,119 +197,367 @@ static void lock_unlock(struct test_results *res)
  * every moment, only one thread is able to acquire two locks and so
  * make progress; in doing so, it releases a lock allowing another
  * thread to make progress and then promptly gets blocked.
+ *
+ * When a thread stops, it releases the one lock it holds, so the
+ * other threads can always make progress until they stop too.
  */
 
-#define CONTENTION_THREAD_COUNT 4
-#define CONTENTION_MUTEX_COUNT (CONTENTION_THREAD_COUNT + 1)
+static void ring_setup(struct run *run)
+{
+	mutex_t *mutexes;
+	int i;
 
-struct contention_info {
-	mutex_t mutexes[CONTENTION_MUTEX_COUNT];
+	run->locks = run->threads + 1;
+	mutexes = alloc_aligned(run->locks * sizeof(mutex_t));
+	run->data = (void *)mutexes;
+	for (i = 0; i < run->locks; i++)
+		assert(!mutex_init(&mutexes[i]));
+}
 
-	pthread_mutex_t ready_mutex;
-	pthread_cond_t ready_cond;
-	int ready_count;
+static void *ring_thread(void *v_thread_info)
+{
+	struct bench_thread *t = v_thread_info;
+	struct run *run = t->run;
+	mutex_t *mutexes = run->data;
+	volatile unsigned long local = 0;
+	unsigned long ops = 0;
+	int i = t->index;
 
-	int thread_reps;
-};
+	/* Lock our first mutex */
+	assert(!mutex_lock(&mutexes[i]));
 
-struct contention_thread_info {
-	struct contention_info *info;
-	pthread_mutex_t start_mutex;
-	int thread_index;
-	long long start;
-	long long stop;
-};
+	run_begin(run);
+
+	while (!run->stop) {
+		int next = (i + 1) % run->locks;
+		long long start = now_nsecs();
+		assert(!mutex_lock(&mutexes[next]));
+		record(t, now_nsecs() - start);
+		work(&local, run->cs);
+		assert(!mutex_unlock(&mutexes[i]));
+		i = next;
+		ops++;
+	}
+
+	assert(!mutex_unlock(&mutexes[i]));
+	t->ops = ops;
+	return NULL;
+}
 
-static void *contention_thread(void *v_thread_info)
+static void ring_teardown(struct run *run)
 {
-	struct contention_thread_info *thread_info = v_thread_info;
-	struct contention_info *info = thread_info->info;
-	int i = thread_info->thread_index;
-	int reps = info->thread_reps;
-	int j;
+	mutex_t *mutexes = run->data;
+	int i;
 
-	/* Lock our first mutex */
-	assert(!mutex_lock(&info->mutexes[i]));
+	for (i = 0; i < run->locks; i++)
+		assert(!mutex_destroy(&mutexes[i]));
+
+	free(run->data);
+}
+
+/* The ring arrangement above hides unfairness.  So we also measure
+ * the latency of acquiring a single lock that all the threads acquire
+ * and release repeatedly, doing some work while holding it and some
+ * work between acquisitions.  The interesting figures are the tail
+ * latencies, which show whether some threads are starved while
+ * others monopolize the lock.
+ *
+ * The trylock benchmark is the same, except that threads acquire the
+ * lock by retrying mutex_trylock, and the failed attempts are
+ * counted.
+ */
 
-	/* Indicate that we are ready for the test. */
-	assert(!pthread_mutex_lock(&info->ready_mutex));
-	if (++info->ready_count == CONTENTION_THREAD_COUNT)
-		assert(!pthread_cond_signal(&info->ready_cond));
-	assert(!pthread_mutex_unlock(&info->ready_mutex));
+struct shared_info {
+	mutex_t mutex;
+	unsigned long count;
+	char pad[CACHE_LINE];
+	volatile unsigned long shared;
+};
 
-	/* Line up to start */
-	assert(!pthread_mutex_lock(&thread_info->start_mutex));
-	assert(!pthread_mutex_unlock(&thread_info->start_mutex));
+static void shared_setup(struct run *run)
+{
+	struct shared_info *info = alloc_aligned(sizeof *info);
 
-	thread_info->start = now_usecs();
+	run->locks = 1;
+	run->data = info;
+	assert(!mutex_init(&info->mutex));
+	info->count = 0;
+	info->shared = 0;
+}
 
-	for (j = 1; j < reps; j++) {
-		int next = (i + 1) % CONTENTION_MUTEX_COUNT;
-		assert(!mutex_lock(&info->mutexes[next]));
-		assert(!mutex_unlock(&info->mutexes[i]));
-		i = next;
+static void *shared_thread(void *v_thread_info)
+{
+	struct bench_thread *t = v_thread_info;
+	struct run *run = t->run;
+	struct shared_info *info = run->data;
+	volatile unsigned long local = 0;
+	unsigned long ops = 0;
+
+	run_begin(run);
+
+	while (!run->stop) {
+		long long start = now_nsecs();
+		assert(!mutex_lock(&info->mutex));
+		record(t, now_nsecs() - start);
+		info->count++;
+		work(&info->shared, run->cs);
+		assert(!mutex_unlock(&info->mutex));
+		work(&local, run->ncs);
+		ops++;
 	}
 
-	thread_info->stop = now_usecs();
+	t->ops = ops;
+	return NULL;
+}
+
+static void *trylock_thread(void *v_thread_info)
+{
+	struct bench_thread *t = v_thread_info;
+	struct run *run = t->run;
+	struct shared_info *info = run->data;
+	volatile unsigned long local = 0;
+	unsigned long ops = 0, failures = 0;
+
+	run_begin(run);
+
+	while (!run->stop) {
+		long long start = now_nsecs();
+		int res;
+
+		while ((res = mutex_trylock(&info->mutex))) {
+			assert(res == EBUSY);
+			failures++;
+			if (run->stop)
+				goto out;
+		}
+
+		record(t, now_nsecs() - start);
+		info->count++;
+		work(&info->shared, run->cs);
+		assert(!mutex_unlock(&info->mutex));
+		work(&local, run->ncs);
+		ops++;
+	}
 
-	assert(!mutex_unlock(&info->mutexes[i]));
+ out:
+	t->ops = ops;
+	t->failures = failures;
 	return NULL;
 }
 
-static void contention(struct test_results *res)
+/* The shared benchmark again, but with the critical section run by
+ * mutex_run, so that skinny mutexes can combine them. */
+
+static void run_critical_section(void *v_run)
 {
-	struct contention_info info;
-	struct contention_thread_info thread_infos[CONTENTION_THREAD_COUNT];
-	pthread_t threads[CONTENTION_THREAD_COUNT];
-	int i;
+	struct run *run = v_run;
+	struct shared_info *info = run->data;
 
-	for (i = 0; i < CONTENTION_MUTEX_COUNT; i++)
-		assert(!mutex_init(&info.mutexes[i]));
-
-	assert(!pthread_mutex_init(&info.ready_mutex, NULL));
-	assert(!pthread_cond_init(&info.ready_cond, NULL));
-	info.ready_count = 0;
-	info.thread_reps = res->reps / CONTENTION_THREAD_COUNT;
-
-	for (i = 0; i < CONTENTION_THREAD_COUNT; i++) {
-		thread_infos[i].info = &info;
-		thread_infos[i].thread_index = i;
-		assert(!pthread_mutex_init(&thread_infos[i].start_mutex, NULL));
-		assert(!pthread_mutex_lock(&thread_infos[i].start_mutex));
-		assert(!pthread_create(&threads[i], NULL,
-				       contention_thread, &thread_infos[i]));
+	info->count++;
+	work(&info->shared, run->cs);
+}
+
+static void *run_thread(void *v_thread_info)
+{
+	struct bench_thread *t = v_thread_info;
+	struct run *run = t->run;
+	volatile unsigned long local = 0;
+	unsigned long ops = 0;
+
+	run_begin(run);
+
+	while (!run->stop) {
+		long long start = now_nsecs();
+		assert(!mutex_run(&((struct shared_info *)run->data)->mutex,
+				  run_critical_section, run));
+		record(t, now_nsecs() - start);
+		work(&local, run->ncs);
+		ops++;
 	}
 
-	assert(!pthread_mutex_lock(&info.ready_mutex));
-	while (info.ready_count < CONTENTION_THREAD_COUNT)
-		assert(!pthread_cond_wait(&info.ready_cond,
-					  &info.ready_mutex));
-	assert(!pthread_mutex_unlock(&info.ready_mutex));
+	t->ops = ops;
+	return NULL;
+}
+
+static void shared_teardown(struct run *run)
+{
+	struct shared_info *info = run->data;
+
+	assert(info->count == total_ops(run));
+	assert(!mutex_destroy(&info->mutex));
+	free(info);
+}
+
+/* Many locks, each protecting its own payload, and accessed at
+ * random.  With enough locks (see the -l option), the working set is
+ * larger than the last level cache, and the size of the lock
+ * determines how many cache misses each access incurs.
+ */
+
+struct many_entry {
+	mutex_t mutex;
+	unsigned long payload;
+};
 
-	for (i = 0; i < CONTENTION_THREAD_COUNT; i++)
-		assert(!pthread_mutex_unlock(&thread_infos[i].start_mutex));
+static void many_setup(struct run *run)
+{
+	struct many_entry *entries;
+	long i;
+
+	run->locks = opts.locks;
+	run->data = entries = alloc_aligned(run->locks * sizeof *entries);
+	for (i = 0; i < run->locks; i++) {
+		assert(!mutex_init(&entries[i].mutex));
+		entries[i].payload = 0;
+	}
+}
+
+static unsigned long long xorshift(unsigned long long *state)
+{
+	unsigned long long x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
 
-	for (i = 0; i < CONTENTION_THREAD_COUNT; i++) {
-		assert(!pthread_join(threads[i], NULL));
-		assert(!pthread_mutex_destroy(&thread_infos[i].start_mutex));
+static void *many_thread(void *v_thread_info)
+{
+	struct bench_thread *t = v_thread_info;
+	struct run *run = t->run;
+	struct many_entry *entries = run->data;
+	unsigned long long rand_state = 0x9e3779b97f4a7c15ULL * (t->index + 1);
+	volatile unsigned long local = 0;
+	unsigned long ops = 0;
+
+	run_begin(run);
+
+	while (!run->stop) {
+		struct many_entry *e
+			= &entries[xorshift(&rand_state) % run->locks];
+		long long start = now_nsecs();
+		assert(!mutex_lock(&e->mutex));
+		record(t, now_nsecs() - start);
+		e->payload++;
+		work(&local, run->cs);
+		assert(!mutex_unlock(&e->mutex));
+		work(&local, run->ncs);
+		ops++;
 	}
 
-	for (i = 0; i < CONTENTION_MUTEX_COUNT; i++)
-		assert(!mutex_destroy(&info.mutexes[i]));
+	t->ops = ops;
+	return NULL;
+}
 
-	assert(!pthread_mutex_destroy(&info.ready_mutex));
-	assert(!pthread_cond_destroy(&info.ready_cond));
+static void many_teardown(struct run *run)
+{
+	struct many_entry *entries = run->data;
+	unsigned long sum = 0;
+	long i;
 
-	res->start = thread_infos[0].start;
-	res->stop = thread_infos[0].stop;
-	for (i = 1; i < CONTENTION_THREAD_COUNT; i++) {
-		if (thread_infos[i].start < res->start)
-			res->start = thread_infos[i].start;
-		if (thread_infos[i].stop > res->stop)
-			res->stop = thread_infos[i].stop;
+	for (i = 0; i < run->locks; i++) {
+		assert(!mutex_destroy(&entries[i].mutex));
+		sum += entries[i].payload;
 	}
+
+	assert(sum == total_ops(run));
+	free(entries);
 }
 
+#ifdef PERF_HAVE_COND
+
+/* A token is passed around the threads in turn, using a condition
+ * variable, so with two threads this is ping-pong.  The latency
+ * samples are the time from a thread passing the token to the next
+ * thread waking up with it.
+ */
+
+struct condvar_info {
+	mutex_t mutex;
+	cond_t cond;
+	int turn;
+	long long passed;
+};
+
+static void condvar_setup(struct run *run)
+{
+	struct condvar_info *info = alloc_aligned(sizeof *info);
+
+	run->locks = 1;
+	run->data = info;
+	assert(!mutex_init(&info->mutex));
+	assert(!cond_init(&info->cond));
+	info->turn = 0;
+	info->passed = 0;
+}
+
+static void *condvar_thread(void *v_thread_info)
+{
+	struct bench_thread *t = v_thread_info;
+	struct run *run = t->run;
+	struct condvar_info *info = run->data;
+	volatile unsigned long local = 0;
+	unsigned long ops = 0;
+
+	run_begin(run);
+
+	assert(!mutex_lock(&info->mutex));
+
+	for (;;) {
+		/* A negative turn means that the benchmark is over. */
+		while (info->turn != t->index && info->turn >= 0)
+			assert(!cond_wait(&info->cond, &info->mutex));
+
+		if (info->turn < 0)
+			break;
+
+		if (info->passed)
+			record(t, now_nsecs() - info->passed);
+
+		work(&local, run->cs);
+		ops++;
+
+		info->turn = run->stop ? -1 : (t->index + 1) % run->threads;
+		info->passed = now_nsecs();
+		assert(!cond_broadcast(&info->cond));
+
+		if (run->ncs) {
+			assert(!mutex_unlock(&info->mutex));
+			work(&local, run->ncs);
+			assert(!mutex_lock(&info->mutex));
+		}
+	}
+
+	assert(!mutex_unlock(&info->mutex));
+	t->ops = ops;
+	return NULL;
+}
+
+static void condvar_teardown(struct run *run)
+{
+	struct condvar_info *info = run->data;
+
+	assert(!cond_destroy(&info->cond));
+	assert(!mutex_destroy(&info->mutex));
+	free(info);
+}
+
+#endif
+
+static const struct bench benches[] = {
+	{ "uncontended", 1, uncontended_setup, uncontended_thread,
+	  uncontended_teardown },
+	{ "ring", 1, ring_setup, ring_thread, ring_teardown },
+	{ "shared", 1, shared_setup, shared_thread, shared_teardown },
+	{ "trylock", 1, shared_setup, trylock_thread, shared_teardown },
+	{ "run", 1, shared_setup, run_thread, shared_teardown },
+	{ "many", 1, many_setup, many_thread, many_teardown },
+#ifdef PERF_HAVE_COND
+	{ "condvar", 2, condvar_setup, condvar_thread, condvar_teardown },
+#endif
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
 static int cmp_long_long(const void *ap, const void *bp)
 {
 	long long a = *(long long *)ap;
@@ -237,36 +571,360 @@ static int cmp_long_long(const void *ap, const void *bp)
 		return 0;
 }
 
-#define SETS 10
+struct results {
+	double secs;
+	unsigned long ops;
+	unsigned long failures;
+	long long p50, p99, p999, max;
+};
 
-static void measure(void (*test)(struct test_results *res),
-		    const char *name, int reps)
+static void print_header(void)
 {
-	struct test_results res;
-	long long times[SETS];
-	int i;
+	switch (opts.format) {
+	case FORMAT_TEXT:
+		printf("%-12s %-20s %7s %5s %5s %8s %12s %8s %8s %8s %8s"
+		       " %10s %10s\n",
+		       "benchmark", "lock", "threads", "cs", "ncs", "locks",
+		       "ops/s", "ns/op", "p50", "p99", "p99.9", "max",
+		       "failures");
+		break;
+
+	case FORMAT_CSV:
+		printf("benchmark,lock,lock_size,threads,cs,ncs,locks,secs,"
+		       "ops,ops_per_sec,ns_per_op,p50_ns,p99_ns,p999_ns,"
+		       "max_ns,failures\n");
+		break;
+
+	case FORMAT_JSON:
+		printf("[");
+		break;
+	}
+}
+
+static void print_results(const struct bench *bench, struct run *run,
+			  struct results *res)
+{
+	static int first = 1;
+	double ops_per_sec = res->ops / res->secs;
+	double ns_per_op = res->secs * 1e9 / res->ops;
+
+	switch (opts.format) {
+	case FORMAT_TEXT:
+		printf("%-12s %-20s %7d %5d %5d %8ld %12.0f %8.1f %8lld %8lld"
+		       " %8lld %10lld %10lu\n",
+		       bench->name, PERF_NAME, run->threads, run->cs,
+		       run->ncs, run->locks, ops_per_sec, ns_per_op,
+		       res->p50, res->p99, res->p999, res->max,
+		       res->failures);
+		break;
+
+	case FORMAT_CSV:
+		printf("%s,%s,%d,%d,%d,%d,%ld,%.6f,%lu,%.0f,%.2f,"
+		       "%lld,%lld,%lld,%lld,%lu\n",
+		       bench->name, PERF_NAME, (int)sizeof(mutex_t),
+		       run->threads, run->cs, run->ncs, run->locks,
+		       res->secs, res->ops, ops_per_sec, ns_per_op,
+		       res->p50, res->p99, res->p999, res->max,
+		       res->failures);
+		break;
+
+	case FORMAT_JSON:
+		printf("%s\n  {\"benchmark\": \"%s\", \"lock\": \"%s\", "
+		       "\"lock_size\": %d, \"threads\": %d, \"cs\": %d, "
+		       "\"ncs\": %d, \"locks\": %ld, \"secs\": %.6f, "
+		       "\"ops\": %lu, \"ops_per_sec\": %.0f, "
+		       "\"ns_per_op\": %.2f, \"p50_ns\": %lld, "
+		       "\"p99_ns\": %lld, \"p999_ns\": %lld, "
+		       "\"max_ns\": %lld, \"failures\": %lu}",
+		       first ? "" : ",", bench->name, PERF_NAME,
+		       (int)sizeof(mutex_t), run->threads, run->cs, run->ncs,
+		       run->locks, res->secs, res->ops, ops_per_sec,
+		       ns_per_op, res->p50, res->p99, res->p999, res->max,
+		       res->failures);
+		break;
+	}
 
-	printf("Measuring %s: ", name);
+	first = 0;
 	fflush(stdout);
+}
+
+static void print_footer(void)
+{
+	if (opts.format == FORMAT_JSON)
+		printf("\n]\n");
+}
+
+static void run_bench(const struct bench *bench, int threads, int cs,
+		      int ncs)
+{
+	struct run run;
+	struct results res;
+	pthread_t *thread_ids = malloc(threads * sizeof *thread_ids);
+	pthread_attr_t attr;
+	struct timespec duration;
+	long long start, stop, *all;
+	unsigned long n = 0;
+	int i;
+
+	assert(thread_ids);
+	run.threads = threads;
+	run.cs = cs;
+	run.ncs = ncs;
+	run.stop = 0;
+	run.thread_infos = malloc(threads * sizeof *run.thread_infos);
+	assert(run.thread_infos);
+	assert(!pthread_barrier_init(&run.barrier, NULL, threads + 1));
+	bench->setup(&run);
+
+	for (i = 0; i < threads; i++) {
+		struct bench_thread *t = &run.thread_infos[i];
+
+		t->run = &run;
+		t->index = i;
+		t->samples = malloc(SAMPLES * sizeof *t->samples);
+		assert(t->samples);
+		t->nsamples = 0;
+		t->ops = 0;
+		t->failures = 0;
+
+		assert(!pthread_attr_init(&attr));
+		if (opts.pin) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[i % cpu_count], &set);
+			assert(!pthread_attr_setaffinity_np(&attr, sizeof set,
+							    &set));
+		}
+
+		assert(!pthread_create(&thread_ids[i], &attr, bench->thread,
+				       t));
+		assert(!pthread_attr_destroy(&attr));
+	}
+
+	run_begin(&run);
+	start = now_nsecs();
+
+	duration.tv_sec = opts.duration_ms / 1000;
+	duration.tv_nsec = opts.duration_ms % 1000 * 1000000;
+	while (nanosleep(&duration, &duration))
+		;
+
+	run.stop = 1;
 
-	res.reps = reps;
+	for (i = 0; i < threads; i++)
+		assert(!pthread_join(thread_ids[i], NULL));
 
-	for (i = 0; i < SETS; i++) {
-		test(&res);
-		times[i] = res.stop - res.start;
+	stop = now_nsecs();
+	bench->teardown(&run);
+
+	res.secs = (stop - start) / 1e9;
+	res.ops = 0;
+	res.failures = 0;
+
+	for (i = 0; i < threads; i++) {
+		struct bench_thread *t = &run.thread_infos[i];
+		res.ops += t->ops;
+		res.failures += t->failures;
+		n += t->nsamples < SAMPLES ? t->nsamples : SAMPLES;
+	}
+
+	all = malloc((n ? n : 1) * sizeof *all);
+	assert(all);
+	n = 0;
+	for (i = 0; i < threads; i++) {
+		struct bench_thread *t = &run.thread_infos[i];
+		unsigned long k = t->nsamples < SAMPLES ? t->nsamples : SAMPLES;
+		memcpy(all + n, t->samples, k * sizeof *all);
+		n += k;
+		free(t->samples);
 	}
 
-	qsort(times, SETS, sizeof(long long), cmp_long_long);
-	printf("best %dns, 50%%ile %dns\n", (int)(times[0] * 1000 / reps),
-	       (int)(times[SETS / 2] * 1000 / reps));
+	if (n) {
+		qsort(all, n, sizeof *all, cmp_long_long);
+		res.p50 = all[(n - 1) * 50 / 100];
+		res.p99 = all[(n - 1) * 99 / 100];
+		res.p999 = all[(n - 1) * 999 / 1000];
+		res.max = all[n - 1];
+	}
+	else {
+		res.p50 = res.p99 = res.p999 = res.max = 0;
+	}
+
+	if (res.ops)
+		print_results(bench, &run, &res);
+
+	free(all);
+	assert(!pthread_barrier_destroy(&run.barrier));
+	free(run.thread_infos);
+	free(thread_ids);
 }
 
-int main(void)
+static void usage(const char *prog)
 {
-	measure(lock_unlock, "Locking and unlocking without contention",
-		10000000);
-	measure(contention, "Locking and unlocking with contention",
-		100000);
+	int i;
+
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -b BENCH,...  benchmarks to run (default all):",
+		prog);
+	for (i = 0; benches[i].name; i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr,
+		"\n"
+		"  -t N,...      thread counts (default powers of two up to\n"
+		"                the number of CPUs, and at least 4)\n"
+		"  -c N,...      critical section lengths (default 0)\n"
+		"  -n N,...      non-critical section lengths (default 0)\n"
+		"  -l N          locks for the many benchmark (default %ld)\n"
+		"  -d MS         duration of each run (default %ld)\n"
+		"  -r N          repeat each run N times (default 1)\n"
+		"  -p            pin threads to CPUs\n"
+		"  -f FORMAT     output format: text, csv or json\n",
+		opts.locks, opts.duration_ms);
+	exit(1);
+}
+
+static void parse_list(struct int_list *list, char *arg, const char *prog)
+{
+	char *tok;
+
+	list->n = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		char *end;
+		long val = strtol(tok, &end, 0);
+
+		if (*end || val < 0 || list->n == MAX_LIST)
+			usage(prog);
+
+		list->vals[list->n++] = val;
+	}
+
+	if (!list->n)
+		usage(prog);
+}
+
+static int selected(const char *name)
+{
+	const char *p = opts.benchmarks;
+	size_t len = strlen(name);
+
+	if (!p)
+		return 1;
+
+	while ((p = strstr(p, name))) {
+		if ((p == opts.benchmarks || p[-1] == ',')
+		    && (p[len] == ',' || !p[len]))
+			return 1;
+
+		p += len;
+	}
+
 	return 0;
 }
 
+int main(int argc, char **argv)
+{
+	cpu_set_t set;
+	int i, t, c, n, r, opt;
+
+	assert(!sched_getaffinity(0, sizeof set, &set));
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &set))
+			cpus[cpu_count++] = i;
+
+	opts.threads.n = 0;
+	for (i = 1; i <= cpu_count || i <= 4; i *= 2)
+		opts.threads.vals[opts.threads.n++] = i;
+
+	opts.cs.n = opts.ncs.n = 1;
+	opts.cs.vals[0] = opts.ncs.vals[0] = 0;
+	opts.duration_ms = 200;
+	opts.locks = 1 << 20;
+	opts.repeats = 1;
+
+	while ((opt = getopt(argc, argv, "b:t:c:n:l:d:r:pf:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			opts.benchmarks = optarg;
+			break;
+
+		case 't':
+			parse_list(&opts.threads, optarg, argv[0]);
+			break;
+
+		case 'c':
+			parse_list(&opts.cs, optarg, argv[0]);
+			break;
+
+		case 'n':
+			parse_list(&opts.ncs, optarg, argv[0]);
+			break;
+
+		case 'l':
+			opts.locks = atol(optarg);
+			if (opts.locks <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'd':
+			opts.duration_ms = atol(optarg);
+			if (opts.duration_ms <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'r':
+			opts.repeats = atoi(optarg);
+			if (opts.repeats <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'p':
+			opts.pin = 1;
+			break;
+
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				opts.format = FORMAT_TEXT;
+			else if (!strcmp(optarg, "csv"))
+				opts.format = FORMAT_CSV;
+			else if (!strcmp(optarg, "json"))
+				opts.format = FORMAT_JSON;
+			else
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc)
+		usage(argv[0]);
+
+	for (t = 0; t < opts.threads.n; t++)
+		if (!opts.threads.vals[t])
+			usage(argv[0]);
+
+	print_header();
+
+	for (i = 0; benches[i].name; i++) {
+		if (!selected(benches[i].name))
+			continue;
+
+		for (t = 0; t < opts.threads.n; t++) {
+			if (opts.threads.vals[t] < benches[i].min_threads)
+				continue;
+
+			for (c = 0; c < opts.cs.n; c++)
+				for (n = 0; n < opts.ncs.n; n++)
+					for (r = 0; r < opts.repeats; r++)
+						run_bench(&benches[i],
+							  opts.threads.vals[t],
+							  opts.cs.vals[c],
+							  opts.ncs.vals[n]);
+		}
+	}
+
+	print_footer();
+	return 0;
+}
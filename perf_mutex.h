@@ -0,0 +1,121 @@
+/* The lock types compared by the benchmarks.
+ *
+ * Compile with PERF_skinny, PERF_pthreads or PERF_spinlock defined
+ * for what you want to measure, and PERF_NAME defined to a string
+ * naming the build in the results.
+ */
+
+#ifndef PERF_MUTEX_H
+#define PERF_MUTEX_H
+
+#include <assert.h>
+#include <time.h>
+
+#ifdef PERF_skinny
+#include "skinny_mutex.h"
+#else
+#include <pthread.h>
+#endif
+
+#if defined(PERF_pthreads)
+
+typedef pthread_mutex_t mutex_t;
+
+static __inline__ int mutex_init(mutex_t *mutex)
+{
+	return pthread_mutex_init(mutex, NULL);
+}
+
+#define mutex_destroy pthread_mutex_destroy
+#define mutex_lock pthread_mutex_lock
+#define mutex_trylock pthread_mutex_trylock
+#define mutex_unlock pthread_mutex_unlock
+
+#define PERF_HAVE_COND
+
+typedef pthread_cond_t cond_t;
+
+static __inline__ int cond_init(cond_t *cond)
+{
+	return pthread_cond_init(cond, NULL);
+}
+
+#define cond_destroy pthread_cond_destroy
+#define cond_wait pthread_cond_wait
+#define cond_broadcast pthread_cond_broadcast
+
+#elif defined(PERF_skinny)
+
+typedef skinny_mutex_t mutex_t;
+
+#define mutex_init skinny_mutex_init
+#define mutex_destroy skinny_mutex_destroy
+#define mutex_lock skinny_mutex_lock
+#define mutex_trylock skinny_mutex_trylock
+#define mutex_unlock skinny_mutex_unlock
+
+#define PERF_HAVE_COND
+
+typedef skinny_cond_t cond_t;
+
+#define cond_init skinny_cond_init
+#define cond_destroy skinny_cond_destroy
+#define cond_wait skinny_cond_wait
+#define cond_broadcast skinny_cond_broadcast
+
+#elif defined(PERF_spinlock)
+
+typedef pthread_spinlock_t mutex_t;
+
+static __inline__ int mutex_init(mutex_t *mutex)
+{
+	return pthread_spin_init(mutex, PTHREAD_PROCESS_PRIVATE);
+}
+
+#define mutex_destroy pthread_spin_destroy
+#define mutex_lock pthread_spin_lock
+#define mutex_trylock pthread_spin_trylock
+#define mutex_unlock pthread_spin_unlock
+
+/* Spinlocks cannot be used with condition variables, so PERF_HAVE_COND
+   is not defined. */
+
+#endif
+
+/* Running a closure while holding the lock.  Skinny mutexes can
+   combine these under contention; for the others this is just
+   locking and unlocking around the call. */
+#ifdef PERF_skinny
+#define mutex_run skinny_mutex_run
+#else
+static __inline__ int mutex_run(mutex_t *mutex, void (*fn)(void *), void *arg)
+{
+	int res = mutex_lock(mutex);
+	if (res)
+		return res;
+
+	fn(arg);
+	return mutex_unlock(mutex);
+}
+#endif
+
+#ifndef PERF_NAME
+#define PERF_NAME "unknown"
+#endif
+
+static __inline__ long long now_nsecs(void)
+{
+	struct timespec ts;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Busy work, standing in for what a real program does inside and
+   outside its critical sections. */
+static __inline__ void work(volatile unsigned long *p, int n)
+{
+	while (n--)
+		(*p)++;
+}
+
+#endif /* PERF_MUTEX_H */
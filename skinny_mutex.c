@@ -3,26 +3,206 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
+
+#ifdef SKINNY_MUTEX_FUTEX
+#ifndef __linux__
+#error "SKINNY_MUTEX_FUTEX is only supported on Linux"
+#endif
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#if defined(SKINNY_MUTEX_FUTEX) && defined(SKINNY_MUTEX_PARKING_LOT)
+#error "SKINNY_MUTEX_FUTEX and SKINNY_MUTEX_PARKING_LOT are exclusive"
+#endif
+
+#ifdef SKINNY_MUTEX_NUMA
+#ifndef __linux__
+#error "SKINNY_MUTEX_NUMA is only supported on Linux"
+#endif
+#if defined(SKINNY_MUTEX_FUTEX) || defined(SKINNY_MUTEX_PARKING_LOT)
+#error "SKINNY_MUTEX_NUMA requires the fat_mutex backend"
+#endif
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef SKINNY_MUTEX_NUMA_NODES
+#define SKINNY_MUTEX_NUMA_NODES 4
+#endif
+
+#ifndef SKINNY_MUTEX_NUMA_BATCH
+#define SKINNY_MUTEX_NUMA_BATCH 64
+#endif
+#endif
+
+/* The futex and parking lot backends use the same protocol on the
+ * skinny_mutex word, and differ only in how threads block. */
+#if defined(SKINNY_MUTEX_FUTEX) || defined(SKINNY_MUTEX_PARKING_LOT)
+#define SKINNY_MUTEX_WORD_BACKEND
+#endif
+
+/* In the fat_mutex backend, the word of a contended skinny_mutex
+ * points to the fat_mutex, so it cannot simply be overwritten. */
+#if defined(SKINNY_MUTEX_XCHG_UNLOCK) && !defined(SKINNY_MUTEX_WORD_BACKEND)
+#error "SKINNY_MUTEX_XCHG_UNLOCK requires SKINNY_MUTEX_FUTEX or SKINNY_MUTEX_PARKING_LOT"
+#endif
+
+/* Priority inheritance is done by the kernel's PI futexes, which
+ * need the holder's thread ID in the word, so the inline unlock has
+ * to compare it rather than blindly exchanging.  The futex takes up
+ * half of the word, and we need some of the other half. */
+#ifdef SKINNY_MUTEX_PI
+#ifndef SKINNY_MUTEX_FUTEX
+#error "SKINNY_MUTEX_PI requires SKINNY_MUTEX_FUTEX"
+#endif
+#ifdef SKINNY_MUTEX_XCHG_UNLOCK
+#error "SKINNY_MUTEX_PI and SKINNY_MUTEX_XCHG_UNLOCK are exclusive"
+#endif
+#if UINTPTR_MAX <= 0xffffffff
+#error "SKINNY_MUTEX_PI requires 64-bit pointers"
+#endif
+#endif
+
+/* Robust mutexes need the holder's thread ID in the word, to find
+ * out whether it still exists. */
+#if defined(SKINNY_MUTEX_ROBUST) && !defined(SKINNY_MUTEX_PI)
+#error "SKINNY_MUTEX_ROBUST requires SKINNY_MUTEX_PI"
+#endif
+#ifdef SKINNY_MUTEX_ROBUST
+#include <sched.h>
+#include <signal.h>
+#endif
+
+/* Process-shared mutexes can't point to anything, and blocked
+ * threads have to be found via the word from other processes, which
+ * only the kernel can do. */
+#if defined(SKINNY_MUTEX_PSHARED) && !defined(SKINNY_MUTEX_FUTEX)
+#error "SKINNY_MUTEX_PSHARED requires SKINNY_MUTEX_FUTEX"
+#endif
+
+/* An elided mutex leaves the word untouched, which the PI and
+ * XCHG_UNLOCK protocols can't tell apart from the word's other
+ * values. */
+#if defined(SKINNY_MUTEX_ELISION) && defined(SKINNY_MUTEX_PI)
+#error "SKINNY_MUTEX_ELISION and SKINNY_MUTEX_PI are exclusive"
+#endif
+
+#if defined(SKINNY_MUTEX_ELISION) && defined(SKINNY_MUTEX_XCHG_UNLOCK)
+#error "SKINNY_MUTEX_ELISION and SKINNY_MUTEX_XCHG_UNLOCK are exclusive"
+#endif
 
 #include "skinny_mutex.h"
 
-/* The alternative definition of cas can be used to induce random
- * failures in CAS operations.  This is only useful in situations
- * which can recover from false negatives.  So in the cases where a
- * failed CAS is significant, we use strict_cas. */
+/* Check the result of a call that should not fail.  Unlike
+ * assert(!call), this still makes the call when NDEBUG is defined. */
+static __inline__ void check(int res)
+{
+	assert(!res);
+	(void)res;
+}
+
+/* USDT probes, for tracing with e.g. bpftrace or perf.  These are
+ * available when sys/sdt.h is present, unless SKINNY_MUTEX_NO_USDT
+ * is defined.  Probes only appear in the slow paths.  Each probe
+ * takes the address of the skinny_mutex and the fat_mutex (which is
+ * NULL where there isn't one). */
+
+#if !defined(SKINNY_MUTEX_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SKINNY_MUTEX_USDT
+#endif
+#endif
+
+#ifdef SKINNY_MUTEX_USDT
+#define probe(name, skinny, fat) DTRACE_PROBE2(skinny_mutex, name, skinny, fat)
+#else
+#define probe(name, skinny, fat) do { } while (0)
+#endif
+
+/* With SKINNY_MUTEX_FAULTS, cas can be made to fail at random, and
+ * threads to yield the CPU at random before atomic operations, to
+ * shake out races (see skinny_mutex_set_faults and stress.c).  A
+ * spurious CAS failure is only tolerable in situations which can
+ * recover from false negatives.  So in the cases where a failed CAS
+ * is significant, we use strict_cas. */
 
-#if 1
-#define cas(p, a, b) __sync_bool_compare_and_swap(p, a, b)
+#ifdef SKINNY_MUTEX_ATOMIC_BUILTINS
+#define raw_cas(p, a, b) __extension__ ({				\
+	__typeof__(*(p)) expected_ = (a);				\
+	__atomic_compare_exchange_n(p, &expected_, b, 0,		\
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); })
 #else
-#define cas(p, a, b) ((rand() & 1) ? __sync_bool_compare_and_swap(p, a, b) : 0)
+#define raw_cas(p, a, b) __sync_bool_compare_and_swap(p, a, b)
 #endif
 
-#define strict_cas(p, a, b) __sync_bool_compare_and_swap(p, a, b)
+#ifndef SKINNY_MUTEX_FAULTS
+#define strict_cas(p, a, b) raw_cas(p, a, b)
+#define cas(p, a, b) raw_cas(p, a, b)
+
+int skinny_mutex_set_faults(unsigned int cas_failures, unsigned int yields)
+{
+	(void)cas_failures;
+	(void)yields;
+	return ENOSYS;
+}
+#else
+#include <sched.h>
+
+/* Rates per million operations. */
+static unsigned int fault_cas_rate;
+static unsigned int fault_yield_rate;
+static __thread uint32_t fault_seed;
+
+/* Decide whether to inject a fault, with a per-thread xorshift
+   generator, so that threads don't contend over rand(). */
+static int fault(unsigned int rate)
+{
+	uint32_t x;
+
+	if (!rate)
+		return 0;
+
+	x = fault_seed;
+	if (!x)
+		x = (uint32_t)(uintptr_t)&fault_seed | 1;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	fault_seed = x;
+	return x % 1000000 < rate;
+}
+
+static void fault_point(void)
+{
+	if (fault(fault_yield_rate))
+		sched_yield();
+}
+
+#define strict_cas(p, a, b) (fault_point(), raw_cas(p, a, b))
+#define cas(p, a, b) (fault_point(), !fault(fault_cas_rate) && raw_cas(p, a, b))
+
+int skinny_mutex_set_faults(unsigned int cas_failures, unsigned int yields)
+{
+	if (cas_failures > 1000000 || yields > 1000000)
+		return EINVAL;
+
+	fault_cas_rate = cas_failures;
+	fault_yield_rate = yields;
+	return 0;
+}
+#endif
 
 /* Atomically exchange the value of a pointer in memory.
  *
- * This is absent from GCC's builtin atomics, but we can simulate it
+ * This is absent from GCC's __sync builtins, but we can simulate it
  * with CAS.
  */
 static void *atomic_xchg(void **ptr, void *new)
@@ -33,6 +213,8 @@ static void *atomic_xchg(void **ptr, void *new)
 		      : "+r" (old), "+m" (*ptr)
 		      : : "memory", "cc");
 	return old;
+#elif defined(SKINNY_MUTEX_ATOMIC_BUILTINS)
+	return __atomic_exchange_n(ptr, new, __ATOMIC_SEQ_CST);
 #else
 	void *old;
 	do
@@ -60,6 +242,8 @@ static int atomic_sub_and_test(uint8_t *ptr, uint8_t x)
 			  : "+m" (*ptr), "=qm" (res)
 			  : "ir" (x) : "memory");
 	return res;
+#elif defined(SKINNY_MUTEX_ATOMIC_BUILTINS)
+	return __atomic_sub_fetch(ptr, x, __ATOMIC_SEQ_CST);
 #else
 	return __sync_sub_and_fetch(ptr, x);
 #endif
@@ -86,17 +270,430 @@ static int recover(int res1, int res2)
 	abort();
 }
 
+/*
+ * Adaptive spinning.
+ *
+ * If a skinny_mutex is only held for short periods, a thread that
+ * finds it held is likely to be able to acquire it soon.  So before
+ * going to the trouble of blocking, skinny_mutex_lock_slow spins for
+ * a while, watching for the mutex to be released.
+ *
+ * The amount of spinning is adapted to how long the mutex has
+ * recently been held for.  We can't keep that estimate with each
+ * mutex (there's no room for it), so instead it is kept for each call
+ * site of skinny_mutex_lock (identified by its return address), in a
+ * small hash table.  Collisions just mean that call sites share an
+ * estimate.
+ *
+ * The maximum amount of spinning is SKINNY_MUTEX_SPIN_LIMIT, and can
+ * be changed with skinny_mutex_set_spin_limit.  Zero disables
+ * spinning.
+ *
+ * With SKINNY_MUTEX_PI, skinny_mutex_lock_slow doesn't spin: a
+ * high-priority thread spinning on a mutex held by a preempted
+ * low-priority thread is the inversion we are trying to avoid.
+ */
+
+#ifndef SKINNY_MUTEX_SPIN_LIMIT
+#define SKINNY_MUTEX_SPIN_LIMIT 100
+#endif
+
+#define SPIN_MIN 10
+#define SPIN_SITES 256
+
+static unsigned int spin_limit = SKINNY_MUTEX_SPIN_LIMIT;
+
+#ifndef SKINNY_MUTEX_PI
+static unsigned short spin_estimates[SPIN_SITES];
+#endif
+
+static void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ volatile ("pause" : : : "memory");
+#elif defined(__aarch64__)
+	__asm__ volatile ("yield" : : : "memory");
+#else
+	__asm__ volatile ("" : : : "memory");
+#endif
+}
+
+/* The hash for the side tables indexed by address.  It is in the
+   header because the inline bit lock code needs it too. */
+#define hash_ptr skinny_bitlock_hash_
+
+#ifndef SKINNY_MUTEX_PI
+
+/* The largest value of a skinny_mutex held by a thread that will
+ * release it by setting it to 0.  That is 1 in the fat_mutex
+ * backend, where 2 is COND_RELEASED, and in the word backends also 2
+ * (CONTENDED).  See below for both. */
+#ifdef SKINNY_MUTEX_WORD_BACKEND
+#define SPIN_HELD_MAX 2
+#else
+#define SPIN_HELD_MAX 1
+#endif
+
+/* Spin waiting for a held skinny_mutex to be released, and try to
+ * acquire it, setting it to "acquired".  We only spin while the
+ * mutex contains a value from 1 to SPIN_HELD_MAX.
+ *
+ * Returns non-zero if the mutex was acquired. */
+static int spin_acquire(skinny_mutex_t *skinny, const void *site,
+			void *acquired)
+{
+	unsigned short *estimate = &spin_estimates[hash_ptr(site)
+						   % SPIN_SITES];
+	unsigned int max = *estimate * 2 + SPIN_MIN;
+	unsigned int spins, i, backoff = 1;
+
+	if (max > spin_limit)
+		max = spin_limit;
+
+	for (spins = 0; spins < max; spins++) {
+		void *val = skinny->val;
+
+		if (!val) {
+			if (cas(&skinny->val, val, acquired)) {
+				*estimate += ((int)spins - *estimate) / 8;
+				return 1;
+			}
+
+			/* Another thread got there first, so back off. */
+			for (i = 0; i < backoff; i++)
+				cpu_relax();
+
+			spins += backoff;
+			backoff *= 2;
+		}
+		else if ((uintptr_t)val - 1 >= SPIN_HELD_MAX) {
+			/* The mutex won't be released directly. */
+			return 0;
+		}
+
+		cpu_relax();
+	}
+
+	*estimate += ((int)max - *estimate) / 8;
+	return 0;
+}
+
+#endif
+
+unsigned int skinny_mutex_set_spin_limit(unsigned int limit)
+{
+	unsigned int old = spin_limit;
+	spin_limit = limit;
+	return old;
+}
+
+/*
+ * Lock elision.
+ *
+ * With SKINNY_MUTEX_ELISION, skinny_mutex_lock starts a hardware
+ * transaction, and if the mutex is free, returns without writing to
+ * it.  The word is in the transaction's read set, so if another
+ * thread acquires the mutex for real, the transaction aborts, and
+ * execution resumes in skinny_mutex_lock_elide_ as if xbegin had
+ * just returned an abort status.  Threads whose critical sections
+ * touch different data can therefore run them in parallel.  After
+ * SKINNY_MUTEX_ELISION_RETRIES transient aborts, or any abort that
+ * the CPU says will not succeed on retry, we fall back to acquiring
+ * the mutex normally.
+ *
+ * Each abort that makes us fall back also counts against the mutex
+ * (or rather, its bucket in a small hash table, as there is no room
+ * in the mutex), and doubles the number of subsequent acquisitions
+ * of mutexes in that bucket that skip elision, up to
+ * ELISION_SKIP_MAX.  So elision is all but disabled on mutexes whose
+ * critical sections keep aborting, and a successful transaction
+ * resets the count.
+ *
+ * Only Intel's RTM is supported, detected with cpuid at run time, so
+ * the same binary runs on CPUs without it (or where it has been
+ * disabled by microcode).  Elsewhere, elision is never enabled.
+ *
+ * Functions that require the mutex to be held really held, such as
+ * the condition variable waits, can't work on an elided mutex, and
+ * abort the transaction to retry with the mutex acquired.
+ */
+
+#ifdef SKINNY_MUTEX_ELISION
+
+#ifndef SKINNY_MUTEX_ELISION_RETRIES
+#define SKINNY_MUTEX_ELISION_RETRIES 3
+#endif
+
+#define ELISION_BUCKETS 256
+#define ELISION_SKIP_MAX 10
+
+/* Cleared when elision is disabled, or found to be unsupported. */
+int skinny_mutex_elision_ = 1;
+
+/* -1 until we have looked at the CPU. */
+static int elision_cpu = -1;
+
+static struct {
+	unsigned short skip;
+	unsigned char failures;
+} elision_buckets[ELISION_BUCKETS];
+
+#if defined(__i386__) || defined(__x86_64__)
+
+#include <cpuid.h>
+
+#define XBEGIN_STARTED (~0U)
+#define XABORT_EXPLICIT (1U << 0)
+#define XABORT_RETRY (1U << 1)
+#define XABORT_CODE(status) (((status) >> 24) & 0xff)
+
+/* Our explicit abort code when the mutex turns out to be held. */
+#define XABORT_HELD 0xff
+
+/* The RTM instructions, encoded by hand so that neither the compiler
+   nor the assembler needs to know about them. */
+
+static __inline__ unsigned int xbegin(void)
+{
+	unsigned int status = XBEGIN_STARTED;
+
+	__asm__ volatile (".byte 0xc7, 0xf8; .long 0"
+			  : "+a" (status) : : "memory");
+	return status;
+}
+
+static __inline__ void xend(void)
+{
+	__asm__ volatile (".byte 0x0f, 0x01, 0xd5" : : : "memory");
+}
+
+#define xabort(code) \
+	__asm__ volatile (".byte 0xc6, 0xf8, %P0" : : "i" (code) : "memory")
+
+static __inline__ int xtest(void)
+{
+	unsigned char in;
+
+	__asm__ volatile (".byte 0x0f, 0x01, 0xd6; setnz %0"
+			  : "=q" (in) : : "memory");
+	return in;
+}
+
+/* Does the CPU support RTM, and not just abort every transaction? */
+static int elision_supported(void)
+{
+	unsigned int a, b, c, d;
+
+	if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		return 0;
+
+	return (b >> 11) & 1 && !((d >> 11) & 1);
+}
+
+#else
+
+#define XBEGIN_STARTED (~0U)
+#define XABORT_EXPLICIT 0
+#define XABORT_RETRY 0
+#define XABORT_CODE(status) 0
+#define XABORT_HELD 0
+
+static unsigned int xbegin(void)
+{
+	return 0;
+}
+
+static void xend(void)
+{
+}
+
+#define xabort(code) do { } while (0)
+
+static int xtest(void)
+{
+	return 0;
+}
+
+static int elision_supported(void)
+{
+	return 0;
+}
+
+#endif
+
+static int elision_check_cpu(void)
+{
+	if (elision_cpu < 0)
+		elision_cpu = elision_supported();
+
+	return elision_cpu;
+}
+
+int skinny_mutex_set_elision(int enable)
+{
+	int old = skinny_mutex_elision_ && elision_check_cpu();
+
+	skinny_mutex_elision_ = enable && elision_check_cpu();
+	return old;
+}
+
+int skinny_mutex_lock_elide_(skinny_mutex_t *skinny)
+{
+	unsigned int bucket = hash_ptr(skinny) % ELISION_BUCKETS;
+	unsigned int status, failures, retries = 0;
+
+	if (!elision_check_cpu()) {
+		skinny_mutex_elision_ = 0;
+		return 0;
+	}
+
+	/* This is racy, but it's only a heuristic. */
+	if (elision_buckets[bucket].skip) {
+		elision_buckets[bucket].skip--;
+		return 0;
+	}
+
+	for (;;) {
+		status = xbegin();
+		if (status == XBEGIN_STARTED) {
+			if (!skinny->val)
+				return 1;
+
+			xabort(XABORT_HELD);
+		}
+
+		if (!(status & XABORT_RETRY)
+		    || ++retries > SKINNY_MUTEX_ELISION_RETRIES)
+			break;
+
+		cpu_relax();
+	}
+
+	/* Finding the mutex held says nothing about whether its
+	   critical sections can be elided, so it doesn't count. */
+	if ((status & XABORT_EXPLICIT) && XABORT_CODE(status) == XABORT_HELD)
+		return 0;
+
+	failures = elision_buckets[bucket].failures;
+	if (failures < ELISION_SKIP_MAX)
+		elision_buckets[bucket].failures = ++failures;
+
+	elision_buckets[bucket].skip = 1U << failures;
+	return 0;
+}
+
+int skinny_mutex_unlock_elided_(skinny_mutex_t *skinny)
+{
+	unsigned int bucket;
+
+	/* The inline unlock comes here whenever the word is 0,
+	   including when the mutex isn't held at all, and xtest is not
+	   available without RTM. */
+	if (!elision_check_cpu() || !xtest())
+		return skinny_mutex_unlock_slow(skinny);
+
+	xend();
+
+	/* Writing the bucket inside a transaction would make it
+	   conflict with others, so it is reset afterwards, and only if
+	   necessary. */
+	bucket = hash_ptr(skinny) % ELISION_BUCKETS;
+	if (elision_buckets[bucket].failures)
+		elision_buckets[bucket].failures = 0;
+
+	return 0;
+}
+
+/* Abort the transaction if the calling thread only holds the mutex
+ * through elision. */
+static void elision_abort(skinny_mutex_t *skinny)
+{
+	if (!skinny->val && elision_cpu > 0 && xtest())
+		xabort(0);
+}
+
+#else
+
+static void elision_abort(skinny_mutex_t *skinny)
+{
+	(void)skinny;
+}
+
+int skinny_mutex_set_elision(int enable)
+{
+	(void)enable;
+	return 0;
+}
+
+#endif
+
+/* How long a thread can wait for a contended skinny_mutex before
+ * releasing threads hand the mutex directly to it, rather than
+ * letting it compete with threads that have just arrived.  Zero
+ * means that the mutex is always handed off to the oldest waiter.
+ */
+
+#ifndef SKINNY_MUTEX_STARVATION_USECS
+#ifdef SKINNY_MUTEX_FAIR
+#define SKINNY_MUTEX_STARVATION_USECS 0
+#else
+#define SKINNY_MUTEX_STARVATION_USECS 1000
+#endif
+#endif
+
+static unsigned long starvation_usecs = SKINNY_MUTEX_STARVATION_USECS;
+
+unsigned long skinny_mutex_set_starvation_threshold(unsigned long usecs)
+{
+	unsigned long old = starvation_usecs;
+	starvation_usecs = usecs;
+	return old;
+}
+
+/* Without SKINNY_MUTEX_NUMA, there are no nodes to choose between;
+   see "NUMA cohorting" below for the real thing. */
+#ifndef SKINNY_MUTEX_NUMA
+int skinny_mutex_set_numa_node(int node)
+{
+	(void)node;
+	return ENOSYS;
+}
+#endif
+
+/* The value of a skinny_mutex released by skinny_mutex_cond_timedwait
+ * when the waiting thread might not yet be blocked on the condition
+ * variable (see "Condition variables" below), which depends on the
+ * backend. */
+#if defined(SKINNY_MUTEX_PI)
+#define COND_RELEASED ((void *)((uintptr_t)1 << 32))
+#elif defined(SKINNY_MUTEX_WORD_BACKEND)
+#define COND_RELEASED ((void *)3)
+#else
+#define COND_RELEASED ((void *)2)
+#endif
+
 /* The common header for the fat_mutex and peg structs */
 struct common {
 	uint8_t peg;
 };
 
+/* Does a value obtained from a skinny_mutex point to a peg or
+ * fat_mutex?  Pegs and fat_mutexes are at least 4-byte aligned, so the
+ * other values stored in skinny_mutexes and related types can use the
+ * low-order bits. */
+static int word_is_pointer(const void *p)
+{
+	return p && !((uintptr_t)p & 3);
+}
+
 /*
  * A skinny_mutex_t contains a pointer-sized word.  The non-contended
  * cases is simple: If the mutex is not held, it contains 0.  If the
  * mutex is held but not contended, it contains 1.  A compare-and-swap
  * is used to acquire an unheld skinny_mutex, or to release it when
- * held.
+ * held.  It contains 2 (COND_RELEASED) when it is not held, but was
+ * released by skinny_mutex_cond_timedwait (see "Condition variables"
+ * below).
  *
  * When a lock becomes contended - when a thread tries to lock a
  * skinny_mutex that is already held - we fall back to standard
@@ -107,12 +704,26 @@ struct common {
  * a flag to indicate whether the skinny_mutex is held or not).
  */
 
+/* A FIFO queue of threads waiting on a fat_mutex. */
+struct fat_waiter_queue {
+	struct fat_waiter *head;
+	struct fat_waiter **tail;
+};
+
 struct fat_mutex {
 	struct common common;
 
 	/* Is the lock held? */
 	uint8_t held;
 
+	/* Was the lock last released by skinny_mutex_cond_timedwait,
+	   so that the next thread to acquire it has to pass the side
+	   mutex (see fat_mutex_acquired)? */
+	uint8_t cond_released;
+
+	/* The pool the fat_mutex came from (see below). */
+	uint8_t pool;
+
 	/* How many threads are waiting to acquire the associated
 	 * skinny_mutex. */
 	long waiters;
@@ -143,8 +754,40 @@ struct fat_mutex {
 	pthread_mutex_t mutex;
 
 	/* Conv var signalled when the mutex is released and there are
-	   waiters. */
+	   waiters.  Threads waiting for a skinny_mutex wait on their
+	   own cond vars in the queue instead. */
 	pthread_cond_t held_cond;
+
+	/* Threads waiting to acquire the associated skinny_mutex,
+	   oldest first (see fat_mutex_lock). */
+	struct fat_waiter_queue queue;
+
+	/* Threads waiting on skinny_conds associated with the
+	   skinny_mutex (see skinny_cond_timedwait). */
+	struct fat_waiter_queue cond_queue;
+
+	/* Threads waiting for the holder to run their closures (see
+	   skinny_mutex_run). */
+	struct fat_waiter_queue run_queue;
+
+	/* Nodes waiting to be handed the mutex, oldest first (see
+	   skinny_mutex_lock_async). */
+	struct skinny_mutex_async *async_head;
+	struct skinny_mutex_async **async_tail;
+
+#ifdef SKINNY_MUTEX_NUMA
+	/* The threads in queue, split by NUMA node, and the number of
+	   consecutive handoffs within a node (see numa_successor). */
+	struct fat_waiter_queue node_queues[SKINNY_MUTEX_NUMA_NODES];
+	unsigned int node_batch;
+#endif
+
+#ifdef SKINNY_MUTEX_STATS
+	/* Where and when the holding thread acquired the mutex, if it
+	   was acquired with the fat_mutex present. */
+	struct skinny_mutex_stats *held_stats;
+	long long held_since;
+#endif
 };
 
 /*
@@ -232,449 +875,4587 @@ struct peg {
 	struct common *next;
 };
 
+/* A fat_mutex extended with the state of a reader-writer lock (see
+ * the reader-writer lock section below). */
+struct fat_rwlock {
+	struct fat_mutex fat;
 
-/* Given a skinny_mutex containing a pointer, find the associated
- * fat_mutex and lock its mutex.
- *
- * "skinny" points to the skinny_mutex.
+	/* How many threads hold the read lock. */
+	long readers;
+
+	/* How many threads are waiting to acquire the read lock. */
+	long read_waiters;
+
+	/* Incremented when waiting readers are admitted, that is, moved
+	   from read_waiters to readers. */
+	unsigned long read_gen;
+
+	/* Cond var signalled when waiting readers are admitted. */
+	pthread_cond_t read_cond;
+};
+
+/*
+ * Pegs and fat_mutexes (including fat_rwlocks) are allocated and freed
+ * frequently while a skinny_mutex is contended, and we don't want the locks inside
+ * malloc to become a second point of contention.  So they are
+ * allocated from pools.
  *
- * "p" is the pointer previously obtained from the skinny_mutex.
+ * As in Bonwick's slab allocator, each thread caches free objects in
+ * a couple of magazines, so most allocations and frees only touch
+ * thread-local state.  When both of a thread's magazines are empty
+ * (or full), it exchanges a magazine with the depot.  The depot is a
+ * small global array of slots holding magazines.  A slot is emptied
+ * with atomic_xchg and filled with CAS, so the depot is lock-free,
+ * and not susceptible to the ABA problem.
  *
- * "fatp" is used to return the pointer to the locked fat_mutex.
+ * Free fat_mutexes retain their initialized pthreads mutex and
+ * condition variable, which are only destroyed when the fat_mutex
+ * leaves the pool to be freed.
  *
- * Returns 0 on success, a positive error code, or <0 if the
- * skinny_mutex was found to no longer contain a pointer.
+ * Defining SKINNY_MUTEX_NO_POOL bypasses the caching, so that every
+ * allocation goes to malloc (which is useful with memory debugging
+ * tools).  The statistics are still maintained.
  */
-static int fat_mutex_peg(skinny_mutex_t *skinny, struct common *p,
-			 struct fat_mutex **fatp)
+
+#define MAGAZINE_SIZE 16
+#define DEPOT_SIZE 16
+#define POOL_COUNT 3
+
+struct magazine {
+	int count;
+	void *objs[MAGAZINE_SIZE];
+};
+
+/* The type of object in a pool. */
+struct pool_class {
+	size_t size;
+
+	/* Prepare an object obtained from malloc, and tear it down
+	   before it is freed.  Either can be NULL. */
+	int (*init)(void *obj);
+	int (*destroy)(void *obj);
+};
+
+struct depot {
+	/* Magazines containing free objects */
+	struct magazine *full[DEPOT_SIZE];
+
+	/* Magazines containing no objects */
+	struct magazine *empty[DEPOT_SIZE];
+
+	/* Statistics accumulated by threads that have exited. */
+	struct skinny_mutex_pool_stats retired;
+};
+
+struct pool_cache {
+	struct magazine *loaded;
+	struct magazine *previous;
+	struct skinny_mutex_pool_stats stats;
+};
+
+struct thread_pools {
+	struct pool_cache caches[POOL_COUNT];
+	int registered;
+
+	/* Links in the registry of threads, so that their statistics
+	 * can be gathered. */
+	struct thread_pools *next;
+	struct thread_pools **prevp;
+};
+
+static int fat_mutex_init(void *v_fat);
+static int fat_mutex_destroy(void *v_fat);
+static int fat_rwlock_init(void *v_rw);
+static int fat_rwlock_destroy(void *v_rw);
+
+static const struct pool_class pool_classes[POOL_COUNT] = {
+	{ sizeof(struct peg), NULL, NULL },
+	{ sizeof(struct fat_mutex), fat_mutex_init, fat_mutex_destroy },
+	{ sizeof(struct fat_rwlock), fat_rwlock_init, fat_rwlock_destroy }
+};
+
+static struct depot depots[POOL_COUNT];
+
+static __thread struct thread_pools thread_pools;
+static struct thread_pools *pool_registry;
+static pthread_mutex_t pool_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+/* The statistics in a pool_cache are only updated by the owning
+ * thread, but skinny_mutex_pool_stats reads them from other threads,
+ * so both sides use relaxed atomics. */
+static void stat_inc(unsigned long *p)
+{
+#ifdef __ATOMIC_RELAXED
+	__atomic_fetch_add(p, 1, __ATOMIC_RELAXED);
+#else
+	__sync_fetch_and_add(p, 1);
+#endif
+}
+
+static unsigned long stat_read(unsigned long *p)
+{
+#ifdef __ATOMIC_RELAXED
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+#else
+	return *(volatile unsigned long *)p;
+#endif
+}
+
+#ifndef SKINNY_MUTEX_NO_POOL
+static struct magazine *depot_get(struct magazine **slots)
+{
+	int i;
+
+	for (i = 0; i < DEPOT_SIZE; i++) {
+		if (slots[i]) {
+			struct magazine *mag
+				= atomic_xchg((void **)&slots[i], NULL);
+			if (mag)
+				return mag;
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+static int depot_put(struct magazine **slots, struct magazine *mag)
+{
+	int i;
+
+	for (i = 0; i < DEPOT_SIZE; i++)
+		if (!slots[i] && cas(&slots[i], NULL, mag))
+			return 1;
+
+	return 0;
+}
+
+/* Get an object from malloc. */
+static int obj_acquire(int pool, struct pool_cache *c, void **objp)
 {
+	const struct pool_class *class = &pool_classes[pool];
 	int res;
-	unsigned int peg_refcount_decr;
-	struct fat_mutex *fat;
-	struct peg *peg = malloc(sizeof *peg);
-	if (!peg)
+	void *obj = malloc(class->size);
+	if (!obj)
 		return ENOMEM;
 
-	/* Install our peg.  The initial ref count is two: One for the
-	 * reference from this thread, and one that will be from the
-	 * skinny_mutex. */
-	peg->common.peg = 1;
-	peg->refcount = 2;
-	peg->next = p;
+	if (class->init) {
+		res = class->init(obj);
+		if (res) {
+			free(obj);
+			return res;
+		}
+	}
 
-	while (!cas(&skinny->val, p, peg)) {
-		/* The value in the skinny_mutex has changed from what
-		   we saw earlier. */
+	stat_inc(&c->stats.mallocs);
+	stat_inc(&c->stats.allocs);
+	*objp = obj;
+	return 0;
+}
 
-		p = skinny->val;
-		if ((uintptr_t)p <= 1) {
-			/* There is no longer a fat_mutex to peg, so
-			   backtrack. */
-			free(peg);
-			return -1;
+/* Give an object back to free. */
+static int obj_release(int pool, struct pool_cache *c, void *obj)
+{
+	const struct pool_class *class = &pool_classes[pool];
+	int res = 0;
+
+	if (class->destroy)
+		res = class->destroy(obj);
+
+	free(obj);
+	stat_inc(&c->stats.releases);
+	return res;
+}
+
+static int magazine_drain(int pool, struct pool_cache *c,
+			  struct magazine *mag)
+{
+	int res = 0;
+
+	while (mag->count)
+		res = recover(res, obj_release(pool, c,
+					       mag->objs[--mag->count]));
+
+	return res;
+}
+
+static void pool_thread_exit(void *v_tp)
+{
+	struct thread_pools *tp = v_tp;
+	int i;
+
+	for (i = 0; i < POOL_COUNT; i++) {
+		struct pool_cache *c = &tp->caches[i];
+		struct magazine *mags[2];
+		int j;
+
+		mags[0] = c->loaded;
+		mags[1] = c->previous;
+		c->loaded = c->previous = NULL;
+
+		for (j = 0; j < 2; j++) {
+			struct magazine *mag = mags[j];
+			if (!mag)
+				continue;
+
+			if (mag->count) {
+				if (depot_put(depots[i].full, mag)) {
+					stat_inc(&c->stats.depot_puts);
+					continue;
+				}
+
+				magazine_drain(i, c, mag);
+			}
+
+			if (!depot_put(depots[i].empty, mag))
+				free(mag);
 		}
+	}
 
-		/* There is a new fat_mutex, so try again to install
-		   our peg. */
-		peg->next = p;
+	check(pthread_mutex_lock(&pool_registry_mutex));
+
+	for (i = 0; i < POOL_COUNT; i++) {
+		struct skinny_mutex_pool_stats *r = &depots[i].retired;
+		struct skinny_mutex_pool_stats *s = &tp->caches[i].stats;
+
+		r->allocs += s->allocs;
+		r->frees += s->frees;
+		r->mallocs += s->mallocs;
+		r->releases += s->releases;
+		r->depot_gets += s->depot_gets;
+		r->depot_puts += s->depot_puts;
+		memset(s, 0, sizeof *s);
 	}
 
-	/* Our peg is now installed.  Now we know the rest of the
-	 * chain won't disappear under us, so we can walk it to find
-	 * the fat_mutex and lock it. */
-	while (p->peg)
-		p = ((struct peg *)p)->next;
+	if (tp->next)
+		tp->next->prevp = tp->prevp;
+	*tp->prevp = tp->next;
 
-	*fatp = fat = (struct fat_mutex *)p;
-	res = pthread_mutex_lock(&fat->mutex);
+	check(pthread_mutex_unlock(&pool_registry_mutex));
 
-	/* The fat_mutex is locked, and we know it won't go away while
-	 * we hold its lock.  So we can release our peg.
-	 *
-	 * To do this, we set the skinny_mutex to point to the
-	 * fat_mutex, turning the primary chain into a secondary
-	 * chain.  Note that we don't know whether this thread's peg
-	 * is still on the primary chain when we do this.  Handling
-	 * the various cases correctly hinges on the refcounts.  By
-	 * the end of this function, the fat_mutex refcount can be
-	 * incremented, decremented, or returned to its original
-	 * value. */
-	p = atomic_xchg(&skinny->val, fat);
+	/* If this thread uses skinny_mutexes from another thread-specific
+	 * data destructor, it will register again. */
+	tp->registered = 0;
+}
 
-	/* By setting the skinny_mutex to point to the fat_mutex, we
-	 * have theoretically created a new reference to it.  This
-	 * might be a real reference (e.g. from a new secondary chain)
-	 * or not.  If not, we'll decrement the fat_mutex refcount
-	 * below. */
-	fat->refcount++;
+static void pool_key_create(void)
+{
+	check(pthread_key_create(&pool_key, pool_thread_exit));
+}
 
-	/* In this loop, we walk the peg chain starting with the old
-	 * value of skinny_mutex. */
-	for (;;) {
-		struct peg *chain_peg;
+static struct pool_cache *pool_cache_get(int pool)
+{
+	struct thread_pools *tp = &thread_pools;
 
-		peg_refcount_decr = 2;
-		if (p == &peg->common)
-			/* We have reached our peg, so fall through to
-			 * the loop below. */
-			break;
+	if (__builtin_expect(!tp->registered, 0)) {
+		check(pthread_once(&pool_key_once, pool_key_create));
+		check(pthread_setspecific(pool_key, tp));
 
-		peg_refcount_decr = 1;
-		if (p == &fat->common) {
-			/* We have reached the fat_mutex at the end of
-			   the chain, eliminating a reference to it. */
-			fat->refcount--;
-			break;
+		check(pthread_mutex_lock(&pool_registry_mutex));
+		tp->next = pool_registry;
+		if (tp->next)
+			tp->next->prevp = &tp->next;
+		tp->prevp = &pool_registry;
+		pool_registry = tp;
+		check(pthread_mutex_unlock(&pool_registry_mutex));
+
+		tp->registered = 1;
+	}
+
+	return &tp->caches[pool];
+}
+
+static int pool_alloc(int pool, void **objp)
+{
+	struct pool_cache *c = pool_cache_get(pool);
+#ifdef SKINNY_MUTEX_NO_POOL
+	return obj_acquire(pool, c, objp);
+#else
+	struct magazine *mag = c->loaded;
+
+	if (!mag || !mag->count) {
+		if (c->previous && c->previous->count) {
+			c->loaded = c->previous;
+			c->previous = mag;
 		}
+		else {
+			mag = depot_get(depots[pool].full);
+			if (!mag)
+				return obj_acquire(pool, c, objp);
 
-		/* Decrement the ref count of the peg, and see whether
-		 * we can free it yet. */
-		chain_peg = (struct peg *)p;
-		if (atomic_sub_and_test(&chain_peg->refcount, 1))
-			/* We can't free this peg yet, so leave a
-			 * secondary chain in place. */
-			break;
+			stat_inc(&c->stats.depot_gets);
 
-		/* Free the peg, and proceed to the next peg in the
-		 * chain. */
-		p = chain_peg->next;
-		free(chain_peg);
+			/* Both of our magazines are empty, so we only
+			 * need to keep one of them. */
+			if (c->previous
+			    && !depot_put(depots[pool].empty, c->previous))
+				free(c->previous);
+
+			c->previous = c->loaded;
+			c->loaded = mag;
+		}
 	}
 
-	for (;;) {
-		if (atomic_sub_and_test(&peg->refcount, peg_refcount_decr))
-			/* We can't free this peg yet, so leave a
-			 * secondary chain in place. */
-			break;
+	stat_inc(&c->stats.allocs);
+	mag = c->loaded;
+	*objp = mag->objs[--mag->count];
+	return 0;
+#endif
+}
 
-		/* No references to the peg remain, so free it. */
-		p = peg->next;
-		free(peg);
+static int pool_free(int pool, void *obj)
+{
+	struct pool_cache *c = pool_cache_get(pool);
+#ifdef SKINNY_MUTEX_NO_POOL
+	stat_inc(&c->stats.frees);
+	return obj_release(pool, c, obj);
+#else
+	struct magazine *mag = c->loaded;
+	int res = 0;
 
-		if (p == &fat->common) {
-			/* We have reached the fat_mutex at the end of
-			   the chain, eliminating a reference to it. */
-			fat->refcount--;
+	stat_inc(&c->stats.frees);
+
+	if (!mag || mag->count == MAGAZINE_SIZE) {
+		if (c->previous && c->previous->count < MAGAZINE_SIZE) {
+			c->loaded = c->previous;
+			c->previous = mag;
+		}
+		else {
+			/* Both of our magazines are full (or absent), so
+			 * pass one to the depot and replace it with an
+			 * empty one. */
+			mag = c->previous;
+			if (mag && depot_put(depots[pool].full, mag)) {
+				stat_inc(&c->stats.depot_puts);
+				mag = NULL;
+			}
+
+			if (mag) {
+				/* The depot is full, so we reuse the
+				 * magazine after draining it. */
+				res = magazine_drain(pool, c, mag);
+			}
+			else {
+				mag = depot_get(depots[pool].empty);
+				if (!mag) {
+					mag = malloc(sizeof *mag);
+					if (!mag)
+						return obj_release(pool, c,
+								   obj);
+
+					mag->count = 0;
+				}
+			}
+
+			c->previous = c->loaded;
+			c->loaded = mag;
+		}
+	}
+
+	mag = c->loaded;
+	mag->objs[mag->count++] = obj;
+	return res;
+#endif
+}
+
+int skinny_mutex_pool_stats(int pool, struct skinny_mutex_pool_stats *stats)
+{
+	struct thread_pools *tp;
+	int res;
+
+	if (pool < 0 || pool >= POOL_COUNT)
+		return EINVAL;
+
+	res = pthread_mutex_lock(&pool_registry_mutex);
+	if (res)
+		return res;
+
+	*stats = depots[pool].retired;
+	for (tp = pool_registry; tp; tp = tp->next) {
+		struct skinny_mutex_pool_stats *s = &tp->caches[pool].stats;
+
+		stats->allocs += stat_read(&s->allocs);
+		stats->frees += stat_read(&s->frees);
+		stats->mallocs += stat_read(&s->mallocs);
+		stats->releases += stat_read(&s->releases);
+		stats->depot_gets += stat_read(&s->depot_gets);
+		stats->depot_puts += stat_read(&s->depot_puts);
+	}
+
+	return pthread_mutex_unlock(&pool_registry_mutex);
+}
+
+static int fat_mutex_init(void *v_fat)
+{
+	struct fat_mutex *fat = v_fat;
+	int res = pthread_mutex_init(&fat->mutex, NULL);
+	if (res)
+		return res;
+
+	res = pthread_cond_init(&fat->held_cond, NULL);
+	if (res)
+		pthread_mutex_destroy(&fat->mutex);
+
+	return res;
+}
+
+static int fat_mutex_destroy(void *v_fat)
+{
+	struct fat_mutex *fat = v_fat;
+	int res = pthread_mutex_destroy(&fat->mutex);
+	if (res)
+		return res;
+
+	return pthread_cond_destroy(&fat->held_cond);
+}
+
+
+/*
+ * Statistics.
+ *
+ * When SKINNY_MUTEX_STATS is defined, the slow paths record events
+ * in a fixed table of struct skinny_mutex_stats, indexed by a hash
+ * of a key.  The key is the name given to the skinny_mutex with
+ * skinny_mutex_stats_name if there is one, and otherwise the call
+ * site of the out-of-line function (which, because the fast paths
+ * are inline, is the call site of skinny_mutex_lock etc.).  The
+ * fast paths are unchanged, so only acquisitions that miss the fast
+ * path are counted.
+ *
+ * The functions that record events can find deep inside the slow
+ * paths, so the current skinny_mutex and call site are stashed in
+ * thread-local variables on entry to the slow paths.
+ *
+ * Hold times are only available when the mutex was acquired with an
+ * associated fat_mutex.
+ */
+
+#ifdef SKINNY_MUTEX_STATS
+
+#ifndef SKINNY_MUTEX_STATS_SITES
+#define SKINNY_MUTEX_STATS_SITES 256
+#endif
+
+#define STATS_NAMES 256
+
+struct stats_entry {
+	const void *key;
+	struct skinny_mutex_stats stats;
+};
+
+/* The final entry collects events once the table is full. */
+static struct stats_entry stats_entries[SKINNY_MUTEX_STATS_SITES + 1];
+
+static struct {
+	skinny_mutex_t *mutex;
+	const char *name;
+} stats_names[STATS_NAMES];
+
+static pthread_mutex_t stats_names_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread skinny_mutex_t *stats_mutex;
+static __thread const void *stats_site;
+
+static void stats_enter(skinny_mutex_t *skinny, const void *site)
+{
+	stats_mutex = skinny;
+	stats_site = site;
+}
+
+static long long stats_now(void)
+{
+	struct timespec ts;
+
+	check(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const char *stats_lookup_name(skinny_mutex_t *skinny)
+{
+	unsigned int i, h = hash_ptr(skinny);
+
+	for (i = 0; i < STATS_NAMES; i++) {
+		unsigned int j = (h + i) % STATS_NAMES;
+		skinny_mutex_t *m = stats_names[j].mutex;
+
+		if (m == skinny)
+			return stats_names[j].name;
+
+		if (!m)
+			break;
+	}
+
+	return NULL;
+}
+
+int skinny_mutex_stats_name(skinny_mutex_t *skinny, const char *name)
+{
+	unsigned int i, h = hash_ptr(skinny);
+	int res = pthread_mutex_lock(&stats_names_mutex);
+	if (res)
+		return res;
+
+	res = ENOMEM;
+	for (i = 0; i < STATS_NAMES; i++) {
+		unsigned int j = (h + i) % STATS_NAMES;
+		skinny_mutex_t *m = stats_names[j].mutex;
+
+		if (m == skinny || !m) {
+			/* Entries are never removed, so a removed name
+			   just leaves the mutex with a null name. */
+			stats_names[j].name = name;
+			__sync_synchronize();
+			stats_names[j].mutex = skinny;
+			res = 0;
+			break;
+		}
+	}
+
+	return recover(res, pthread_mutex_unlock(&stats_names_mutex));
+}
+
+/* Find the entry for the current skinny_mutex and call site. */
+static struct skinny_mutex_stats *stats_get(void)
+{
+	const char *name = stats_lookup_name(stats_mutex);
+	const void *key = name ? (const void *)name : stats_site;
+	unsigned int i, h = hash_ptr(key);
+
+	for (i = 0; i < SKINNY_MUTEX_STATS_SITES; i++) {
+		struct stats_entry *e
+			= &stats_entries[(h + i) % SKINNY_MUTEX_STATS_SITES];
+		const void *k = e->key;
+
+		if (k == key)
+			return &e->stats;
+
+		if (!k && strict_cas(&e->key, NULL, key)) {
+			e->stats.site = name ? NULL : stats_site;
+			e->stats.name = name;
+			return &e->stats;
+		}
+	}
+
+	return &stats_entries[SKINNY_MUTEX_STATS_SITES].stats;
+}
+
+static void stats_histogram(unsigned long *hist, long long nsecs)
+{
+	int i = 0;
+
+	while (nsecs > 1 && i < SKINNY_MUTEX_STATS_BUCKETS - 1) {
+		nsecs >>= 1;
+		i++;
+	}
+
+	__sync_fetch_and_add(&hist[i], 1);
+}
+
+#define STATS_INC(field) __sync_fetch_and_add(&stats_get()->field, 1)
+
+static void stats_slow_lock(void)
+{
+	STATS_INC(slow_locks);
+}
+
+static void stats_trylock_failure(void)
+{
+	STATS_INC(trylock_failures);
+}
+
+static void stats_peg(void)
+{
+	STATS_INC(pegs);
+}
+
+#ifndef SKINNY_MUTEX_WORD_BACKEND
+static void stats_promotion(void)
+{
+	STATS_INC(promotions);
+}
+
+/* Record the start of a hold of a mutex with a fat_mutex. */
+static void stats_acquired(struct fat_mutex *fat)
+{
+	fat->held_stats = stats_get();
+	fat->held_since = stats_now();
+}
+
+static void stats_released(struct fat_mutex *fat)
+{
+	if (fat->held_stats) {
+		stats_histogram(fat->held_stats->hold_ns,
+				stats_now() - fat->held_since);
+		fat->held_stats = NULL;
+	}
+}
+#endif
+
+/* Record that the thread blocked, for the time since "start". */
+static void stats_wait(long long start)
+{
+	struct skinny_mutex_stats *stats = stats_get();
+
+	__sync_fetch_and_add(&stats->waits, 1);
+	stats_histogram(stats->wait_ns, stats_now() - start);
+}
+
+static int stats_is_empty(const struct skinny_mutex_stats *stats)
+{
+	int i;
+
+	if (stats->slow_locks || stats->trylock_failures || stats->promotions
+	    || stats->pegs || stats->waits)
+		return 0;
+
+	for (i = 0; i < SKINNY_MUTEX_STATS_BUCKETS; i++)
+		if (stats->hold_ns[i])
+			return 0;
+
+	return 1;
+}
+
+int skinny_mutex_stats_iterate(int (*fn)(const struct skinny_mutex_stats *,
+					 void *),
+			       void *arg)
+{
+	int i;
+
+	for (i = 0; i <= SKINNY_MUTEX_STATS_SITES; i++) {
+		struct skinny_mutex_stats *stats = &stats_entries[i].stats;
+		int res;
+
+		if (stats_is_empty(stats))
+			continue;
+
+		res = fn(stats, arg);
+		if (res)
+			return res;
+	}
+
+	return 0;
+}
+
+static void stats_dump_histogram(FILE *f, const char *label,
+				 const unsigned long *hist)
+{
+	int i;
+
+	for (i = 0; i < SKINNY_MUTEX_STATS_BUCKETS; i++)
+		if (hist[i])
+			fprintf(f, "  %s >=%lluns: %lu\n", label,
+				i ? 1ULL << i : 0ULL, hist[i]);
+}
+
+static int stats_dump_one(const struct skinny_mutex_stats *stats, void *v_f)
+{
+	FILE *f = v_f;
+
+	if (stats->name)
+		fprintf(f, "%s:", stats->name);
+	else if (stats->site)
+		fprintf(f, "%p:", stats->site);
+	else
+		fprintf(f, "(other):");
+
+	fprintf(f, " slow_locks %lu, waits %lu, promotions %lu, pegs %lu, "
+		"trylock_failures %lu\n", stats->slow_locks, stats->waits,
+		stats->promotions, stats->pegs, stats->trylock_failures);
+	stats_dump_histogram(f, "wait", stats->wait_ns);
+	stats_dump_histogram(f, "hold", stats->hold_ns);
+	return 0;
+}
+
+int skinny_mutex_stats_dump(FILE *f)
+{
+	return skinny_mutex_stats_iterate(stats_dump_one, f);
+}
+
+int skinny_mutex_stats_reset(void)
+{
+	int i;
+
+	/* Keep the keys, so that concurrent updates go to the right
+	   place. */
+	for (i = 0; i <= SKINNY_MUTEX_STATS_SITES; i++) {
+		struct skinny_mutex_stats *stats = &stats_entries[i].stats;
+		const void *site = stats->site;
+		const char *name = stats->name;
+
+		memset(stats, 0, sizeof *stats);
+		stats->site = site;
+		stats->name = name;
+	}
+
+	return 0;
+}
+
+#else
+
+static void stats_enter(skinny_mutex_t *skinny, const void *site)
+{
+	(void)skinny;
+	(void)site;
+}
+
+static long long stats_now(void)
+{
+	return 0;
+}
+
+static void stats_slow_lock(void) {}
+static void stats_trylock_failure(void) {}
+static void stats_peg(void) {}
+
+static void stats_wait(long long start)
+{
+	(void)start;
+}
+
+#ifndef SKINNY_MUTEX_WORD_BACKEND
+static void stats_promotion(void) {}
+
+static void stats_acquired(struct fat_mutex *fat)
+{
+	(void)fat;
+}
+
+static void stats_released(struct fat_mutex *fat)
+{
+	(void)fat;
+}
+#endif
+
+int skinny_mutex_stats_name(skinny_mutex_t *skinny, const char *name)
+{
+	(void)skinny;
+	(void)name;
+	return ENOSYS;
+}
+
+int skinny_mutex_stats_iterate(int (*fn)(const struct skinny_mutex_stats *,
+					 void *),
+			       void *arg)
+{
+	(void)fn;
+	(void)arg;
+	return ENOSYS;
+}
+
+int skinny_mutex_stats_dump(FILE *f)
+{
+	(void)f;
+	return ENOSYS;
+}
+
+int skinny_mutex_stats_reset(void)
+{
+	return ENOSYS;
+}
+
+#endif
+
+/* Given a skinny_mutex containing a pointer, find the associated
+ * fat_mutex and lock its mutex.
+ *
+ * "skinny" points to the skinny_mutex.
+ *
+ * "p" is the pointer previously obtained from the skinny_mutex.
+ *
+ * "fatp" is used to return the pointer to the locked fat_mutex.
+ *
+ * Returns 0 on success, a positive error code, or <0 if the
+ * skinny_mutex was found to no longer contain a pointer.
+ */
+static int fat_mutex_peg(skinny_mutex_t *skinny, struct common *p,
+			 struct fat_mutex **fatp)
+{
+	int res;
+	unsigned int peg_refcount_decr;
+	struct fat_mutex *fat;
+	struct peg *peg;
+
+	res = pool_alloc(SKINNY_MUTEX_POOL_PEG, (void **)&peg);
+	if (res)
+		return res;
+
+	stats_peg();
+
+	/* Install our peg.  The initial ref count is two: One for the
+	 * reference from this thread, and one that will be from the
+	 * skinny_mutex. */
+	peg->common.peg = 1;
+	peg->refcount = 2;
+	peg->next = p;
+
+	while (!cas(&skinny->val, p, peg)) {
+		/* The value in the skinny_mutex has changed from what
+		   we saw earlier. */
+
+		p = skinny->val;
+		if (!word_is_pointer(p)) {
+			/* There is no longer a fat_mutex to peg, so
+			   backtrack. */
+			pool_free(SKINNY_MUTEX_POOL_PEG, peg);
+			return -1;
+		}
+
+		/* There is a new fat_mutex, so try again to install
+		   our peg. */
+		peg->next = p;
+	}
+
+	/* Our peg is now installed.  Now we know the rest of the
+	 * chain won't disappear under us, so we can walk it to find
+	 * the fat_mutex and lock it. */
+	while (p->peg)
+		p = ((struct peg *)p)->next;
+
+	*fatp = fat = (struct fat_mutex *)p;
+	res = pthread_mutex_lock(&fat->mutex);
+
+	/* The fat_mutex is locked, and we know it won't go away while
+	 * we hold its lock.  So we can release our peg.
+	 *
+	 * To do this, we set the skinny_mutex to point to the
+	 * fat_mutex, turning the primary chain into a secondary
+	 * chain.  Note that we don't know whether this thread's peg
+	 * is still on the primary chain when we do this.  Handling
+	 * the various cases correctly hinges on the refcounts.  By
+	 * the end of this function, the fat_mutex refcount can be
+	 * incremented, decremented, or returned to its original
+	 * value. */
+	p = atomic_xchg(&skinny->val, fat);
+
+	/* By setting the skinny_mutex to point to the fat_mutex, we
+	 * have theoretically created a new reference to it.  This
+	 * might be a real reference (e.g. from a new secondary chain)
+	 * or not.  If not, we'll decrement the fat_mutex refcount
+	 * below. */
+	fat->refcount++;
+
+	/* In this loop, we walk the peg chain starting with the old
+	 * value of skinny_mutex. */
+	for (;;) {
+		struct peg *chain_peg;
+
+		peg_refcount_decr = 2;
+		if (p == &peg->common)
+			/* We have reached our peg, so fall through to
+			 * the loop below. */
+			break;
+
+		peg_refcount_decr = 1;
+		if (p == &fat->common) {
+			/* We have reached the fat_mutex at the end of
+			   the chain, eliminating a reference to it. */
+			fat->refcount--;
+			break;
+		}
+
+		/* Decrement the ref count of the peg, and see whether
+		 * we can free it yet. */
+		chain_peg = (struct peg *)p;
+		if (atomic_sub_and_test(&chain_peg->refcount, 1))
+			/* We can't free this peg yet, so leave a
+			 * secondary chain in place. */
+			break;
+
+		/* Free the peg, and proceed to the next peg in the
+		 * chain. */
+		p = chain_peg->next;
+		pool_free(SKINNY_MUTEX_POOL_PEG, chain_peg);
+	}
+
+	for (;;) {
+		if (atomic_sub_and_test(&peg->refcount, peg_refcount_decr))
+			/* We can't free this peg yet, so leave a
+			 * secondary chain in place. */
+			break;
+
+		/* No references to the peg remain, so free it. */
+		p = peg->next;
+		pool_free(SKINNY_MUTEX_POOL_PEG, peg);
+
+		if (p == &fat->common) {
+			/* We have reached the fat_mutex at the end of
+			   the chain, eliminating a reference to it. */
+			fat->refcount--;
+			break;
+		}
+
+		/* Proceed to the next peg in the chain. */
+		peg = (struct peg *)p;
+		peg_refcount_decr =  1;
+	}
+
+	return res;
+}
+
+/* Make a skinny_mutex point to a newly allocated fat_mutex, locking
+ * the fat_mutex.
+ *
+ * "skinny" points to the skinny_mutex.
+ *
+ * "head" is the value previously obtained from the skinny_mutex.
+ *
+ * Returns 0 on success, a positive error code, or <0 if the
+ * skinny_mutex was found to no longer contain "head".  On failure,
+ * the fat_mutex is freed.
+ */
+static int fat_mutex_install(skinny_mutex_t *skinny, void *head,
+			     struct fat_mutex *fat)
+{
+	int res = pthread_mutex_lock(&fat->mutex);
+	if (res)
+		goto err;
+
+	/* The fat_mutex is now ready, so try to make the skinny_mutex
+	   point to it. */
+	if (cas(&skinny->val, head, fat))
+		return 0;
+
+	res = -1;
+	pthread_mutex_unlock(&fat->mutex);
+ err:
+	pool_free(fat->pool, fat);
+	return res;
+}
+
+static long long monotonic_usecs(void)
+{
+	struct timespec ts;
+
+	check(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Decrement the refcount on a fat_mutex, unlock it, and free it if
+   the conditions are right. */
+static int fat_mutex_release(skinny_mutex_t *skinny, struct fat_mutex *fat)
+{
+	int keep, res;
+
+	/* If the fat_mutex is still held, it has been handed off to
+	   another thread, or we are giving up waiting for it, so the
+	   reference from the holding thread remains. */
+	assert(!fat->held || fat->refcount > 1);
+
+	/* If the decremented refcount reaches zero, then we know
+	   there are no secondary peg chains or other threads pinning
+	   the fat_mutex.  And if the skinny_mutex points to the
+	   fat_mutex, then we know that there are no pegs on the
+	   primary chain either.  So if the CAS succeeds in nulling
+	   out the skinny_mutex, we can free the fat_mutex. */
+	keep = (--fat->refcount || !strict_cas(&skinny->val, fat,
+			       fat->cond_released ? COND_RELEASED : NULL));
+
+	res = pthread_mutex_unlock(&fat->mutex);
+	if (keep || res)
+		return res;
+
+	return pool_free(fat->pool, fat);
+}
+
+/* Wait on a cond var associated with a fat_mutex, while acquiring a
+ * lock, until the absolute time "abstime" if it is not NULL. */
+static int fat_mutex_timedwait(struct fat_mutex *fat, pthread_cond_t *cond,
+			       const struct timespec *abstime)
+{
+	int res, old_state, old_state2;
+
+	/* Locking is not a cancellation point, but pthread_cond_wait
+	   is, so we need to defer cancellation around it. */
+	check(pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state));
+	if (!abstime)
+		res = pthread_cond_wait(cond, &fat->mutex);
+	else
+		res = pthread_cond_timedwait(cond, &fat->mutex, abstime);
+	check(pthread_setcancelstate(old_state, &old_state2));
+	return res;
+}
+
+static int fat_mutex_wait(struct fat_mutex *fat, pthread_cond_t *cond)
+{
+	return fat_mutex_timedwait(fat, cond, NULL);
+}
+
+#ifndef SKINNY_MUTEX_FUTEX
+
+/* Initialize a cond var whose timed waits use the given clock.  (The
+ * futex backend waits on futexes directly, so does not need this.) */
+static int cond_init_clock(pthread_cond_t *cond, clockid_t clock)
+{
+	pthread_condattr_t attr;
+	int res;
+
+	if (clock == CLOCK_REALTIME)
+		return pthread_cond_init(cond, NULL);
+
+	res = pthread_condattr_init(&attr);
+	if (res)
+		return res;
+
+	res = pthread_condattr_setclock(&attr, clock);
+	if (!res)
+		res = pthread_cond_init(cond, &attr);
+
+	return recover(res, pthread_condattr_destroy(&attr));
+}
+
+#endif
+
+/* Add a relative time to the current time on a clock. */
+static void abstime_from_reltime(struct timespec *abstime, clockid_t clock,
+				 const struct timespec *reltime)
+{
+	check(clock_gettime(clock, abstime));
+	abstime->tv_sec += reltime->tv_sec;
+	abstime->tv_nsec += reltime->tv_nsec;
+	if (abstime->tv_nsec >= 1000000000) {
+		abstime->tv_nsec -= 1000000000;
+		abstime->tv_sec++;
+	}
+}
+
+static int mutex_lock_slow(skinny_mutex_t *skinny, const void *site,
+			   clockid_t clock, const struct timespec *abstime);
+
+/* Called from skinny_mutex_lock when the fast path fails. */
+int skinny_mutex_lock_slow(skinny_mutex_t *skinny)
+{
+	return mutex_lock_slow(skinny, __builtin_return_address(0),
+			       CLOCK_REALTIME, NULL);
+}
+
+static int timespec_valid(const struct timespec *ts)
+{
+	return ts->tv_nsec >= 0 && ts->tv_nsec < 1000000000;
+}
+
+int skinny_mutex_timedlock(skinny_mutex_t *skinny,
+			   const struct timespec *abstime)
+{
+	if (skinny_mutex_fast_lock_(skinny))
+		return 0;
+
+	if (!timespec_valid(abstime))
+		return EINVAL;
+
+	return mutex_lock_slow(skinny, __builtin_return_address(0),
+			       CLOCK_REALTIME, abstime);
+}
+
+int skinny_mutex_reltimedlock(skinny_mutex_t *skinny,
+			      const struct timespec *reltime)
+{
+	struct timespec abstime;
+
+	if (skinny_mutex_fast_lock_(skinny))
+		return 0;
+
+	if (!timespec_valid(reltime) || reltime->tv_sec < 0)
+		return EINVAL;
+
+	abstime_from_reltime(&abstime, CLOCK_MONOTONIC, reltime);
+	return mutex_lock_slow(skinny, __builtin_return_address(0),
+			       CLOCK_MONOTONIC, &abstime);
+}
+
+#ifndef SKINNY_MUTEX_PI
+
+/* Only SKINNY_MUTEX_ROBUST mutexes, which require SKINNY_MUTEX_PI,
+ * can be inconsistent. */
+int skinny_mutex_consistent(skinny_mutex_t *skinny)
+{
+	(void)skinny;
+	return EINVAL;
+}
+
+#endif
+
+/*
+ * Condition variables.
+ *
+ * skinny_mutex_cond_timedwait has to pass a pthreads mutex to
+ * pthread_cond_wait, and that mutex must be held by any thread that
+ * acquires the skinny_mutex between the waiting thread releasing the
+ * skinny_mutex and blocking on the condition variable.  Otherwise, a
+ * thread that acquires the skinny_mutex, changes the state protected
+ * by it, and signals the condition variable might do so before the
+ * waiting thread is blocked, and the wakeup would be lost.
+ *
+ * Rather than allocating a pthreads mutex for each skinny_mutex, we
+ * use a fixed table of side mutexes, indexed by a hash of the
+ * address of the skinny_mutex.  When skinny_mutex_cond_timedwait
+ * releases the skinny_mutex, it sets it to COND_RELEASED while
+ * holding the side mutex.  A thread that finds a skinny_mutex in the
+ * COND_RELEASED state locks the side mutex before acquiring it,
+ * which cannot succeed until the waiting thread is blocked on the
+ * condition variable.
+ *
+ * In the fat_mutex backend, this is how a skinny_mutex that contains
+ * 1 is released, so that a thread waiting on a condition variable
+ * doesn't need a fat_mutex, and one is only allocated if threads
+ * then contend for the mutex.  When the skinny_mutex already points
+ * to a fat_mutex, the waiting thread releases the fat_mutex with its
+ * cond_released flag set, and whichever thread acquires it next
+ * passes through the side mutex once it has unlocked fat->mutex (see
+ * fat_mutex_acquired).  If the fat_mutex is freed instead, the
+ * skinny_mutex is left as COND_RELEASED.  Either way, the waiting
+ * thread does not pin the fat_mutex, and acquires the mutex afresh
+ * when it wakes up.
+ *
+ * The side mutexes are private to the process, so even with
+ * SKINNY_MUTEX_PSHARED, a skinny_mutex passed to
+ * skinny_mutex_cond_timedwait must only be used within one process.
+ * skinny_conds have no such restriction.
+ */
+
+#define SIDE_MUTEX_COUNT 64
+
+static pthread_mutex_t side_mutexes[SIDE_MUTEX_COUNT];
+static pthread_once_t side_mutexes_once = PTHREAD_ONCE_INIT;
+
+static void side_mutexes_init(void)
+{
+	int i;
+
+	for (i = 0; i < SIDE_MUTEX_COUNT; i++)
+		check(pthread_mutex_init(&side_mutexes[i], NULL));
+}
+
+static pthread_mutex_t *side_mutex(skinny_mutex_t *skinny)
+{
+	uintptr_t h = (uintptr_t)skinny / sizeof *skinny;
+
+	check(pthread_once(&side_mutexes_once, side_mutexes_init));
+	h ^= h >> 7;
+	return &side_mutexes[h % SIDE_MUTEX_COUNT];
+}
+
+/* Acquire a skinny_mutex in the COND_RELEASED state, leaving it set
+ * to "new_val".
+ *
+ * Returns 0 on success, a positive error code, or <0 if the
+ * skinny_mutex was found to no longer be COND_RELEASED.
+ */
+static int cond_released_acquire(skinny_mutex_t *skinny, void *new_val)
+{
+	pthread_mutex_t *side = side_mutex(skinny);
+	int acquired, res = pthread_mutex_lock(side);
+	if (res)
+		return res;
+
+	/* The CAS has to happen while we hold the side mutex, or the
+	 * mutex might have been through another cycle of being
+	 * acquired and released by skinny_mutex_cond_timedwait. */
+	acquired = strict_cas(&skinny->val, COND_RELEASED, new_val);
+
+	res = pthread_mutex_unlock(side);
+	if (res)
+		return res;
+
+	return acquired ? 0 : -1;
+}
+
+struct cond_wait_cleanup {
+	skinny_mutex_t *skinny;
+	pthread_mutex_t *side;
+	int lock_res;
+};
+
+/* Thread cancallation cleanup handler when waiting for a condition
+   variable with a side mutex. */
+static void cond_wait_cleanup(void *v_c)
+{
+	struct cond_wait_cleanup *c = v_c;
+	int res = pthread_mutex_unlock(c->side);
+
+	/* Cancellation of pthread_cond_wait should re-acquire the
+	   mutex. */
+	c->lock_res = recover(res, skinny_mutex_lock(c->skinny));
+}
+
+/*
+ * Fairness.
+ *
+ * Threads waiting for a skinny_mutex queue on the fat_mutex in FIFO
+ * order, each waiting on its own cond var.  Normally, releasing the
+ * mutex clears fat->held and wakes the oldest waiter, which then
+ * competes to acquire it with any threads that arrive in the
+ * meantime.  That gives the best throughput, but a waiter can lose
+ * repeatedly to threads that release and re-acquire the mutex
+ * promptly.  So once a waiter has lost after waiting longer than
+ * starvation_usecs, it becomes starving, and when the mutex is
+ * released while a starving waiter is at the head of the queue, the
+ * mutex is handed to it directly: fat->held remains set, and the
+ * waiter is marked as granted.
+ *
+ * The invariant is that whenever fat->held is clear and the queue is
+ * not empty, the waiter at the head of the queue has been signalled.
+ */
+struct fat_waiter {
+	struct fat_waiter *next;
+	struct fat_waiter **pprev;
+
+	/* Set when the mutex is handed off to this waiter. */
+	uint8_t granted;
+
+	/* Set if the mutex should be handed off to this waiter. */
+	uint8_t starving;
+
+	/* When the thread started waiting for the mutex. */
+	long long start;
+
+	/* The skinny_cond this thread is waiting on, if it is on the
+	   fat_mutex's cond_queue rather than its queue. */
+	skinny_cond_t *cond_wait;
+
+	/* For a thread on the fat_mutex's run_queue, the closure to
+	   run, and whether it has been run by the holder. */
+	void (*run_fn)(void *);
+	void *run_arg;
+	uint8_t run_done;
+
+	/* For a thread waiting for a bit lock, the word containing the
+	   bit. */
+	uintptr_t *bitlock;
+
+#ifdef SKINNY_MUTEX_NUMA
+	/* The NUMA node the thread was on when it started waiting, and
+	   its links in the fat_mutex's node_queues. */
+	unsigned int node;
+	struct fat_waiter *node_next;
+	struct fat_waiter **node_pprev;
+#endif
+
+	pthread_cond_t cond;
+};
+
+static void fat_waiter_enqueue(struct fat_waiter_queue *q,
+			       struct fat_waiter *w)
+{
+	w->next = NULL;
+	w->pprev = q->tail;
+	*q->tail = w;
+	q->tail = &w->next;
+}
+
+static void fat_waiter_dequeue(struct fat_waiter_queue *q,
+			       struct fat_waiter *w)
+{
+	*w->pprev = w->next;
+	if (w->next)
+		w->next->pprev = w->pprev;
+	else
+		q->tail = w->pprev;
+}
+
+#ifndef SKINNY_MUTEX_WORD_BACKEND
+
+static void numa_init(struct fat_mutex *fat);
+
+/* Wait for a thread in skinny_mutex_cond_timedwait holding a side
+ * mutex to block on its condition variable. */
+static int cond_gate(pthread_mutex_t *side)
+{
+	int res;
+
+	if (!side)
+		return 0;
+
+	res = pthread_mutex_lock(side);
+	if (res)
+		return res;
+
+	return pthread_mutex_unlock(side);
+}
+
+/* Note that this thread has acquired a fat_mutex.  If it was last
+ * released by skinny_mutex_cond_timedwait, returns the side mutex to
+ * pass with cond_gate once fat->mutex is unlocked, or NULL. */
+static pthread_mutex_t *fat_mutex_acquired(skinny_mutex_t *skinny,
+					   struct fat_mutex *fat)
+{
+	stats_acquired(fat);
+	if (!fat->cond_released)
+		return NULL;
+
+	fat->cond_released = 0;
+	return side_mutex(skinny);
+}
+
+/* Allocate a fat_mutex and associate it with a skinny_mutex.
+ *
+ * "skinny" points to the skinny_mutex.
+ *
+ * "head" is the value previously obtained from the skinny_mutex.
+ *
+ * "fatp" is used to return the pointer to the locked fat_mutex.
+ *
+ * Returns 0 on success, a positive error code, or <0 if the
+ * skinny_mutex was found to no longer contain "head".
+ */
+static int skinny_mutex_promote(skinny_mutex_t *skinny, void *head,
+				struct fat_mutex **fatp)
+{
+	struct fat_mutex *fat;
+	int res = pool_alloc(SKINNY_MUTEX_POOL_FAT_MUTEX, (void **)&fat);
+	if (res)
+		return res;
+
+	*fatp = fat;
+	fat->common.peg = 0;
+	fat->held = !!head;
+	fat->cond_released = 0;
+	fat->pool = SKINNY_MUTEX_POOL_FAT_MUTEX;
+	/* If the skinny_mutex is held, then refcount needs to account
+	   for the pseudo-reference from the holding thread. */
+	fat->refcount = fat->held;
+	fat->waiters = 0;
+	fat->queue.head = NULL;
+	fat->queue.tail = &fat->queue.head;
+	fat->cond_queue.head = NULL;
+	fat->cond_queue.tail = &fat->cond_queue.head;
+	fat->run_queue.head = NULL;
+	fat->run_queue.tail = &fat->run_queue.head;
+	fat->async_head = NULL;
+	fat->async_tail = &fat->async_head;
+	numa_init(fat);
+#ifdef SKINNY_MUTEX_STATS
+	fat->held_stats = NULL;
+#endif
+
+	res = fat_mutex_install(skinny, head, fat);
+	if (!res) {
+		probe(promote, skinny, fat);
+		stats_promotion();
+	}
+
+	return res;
+}
+
+/* Get and lock the fat_mutex associated with a skinny_mutex,
+ * allocating it if necessary.
+ *
+ * "skinny" points to the skinny_mutex.
+ *
+ * "head" is the value that previously seen in the skinny_mutex.
+ *
+ * "fatp" is used to return the pointer to the locked fat_mutex.
+ *
+ * Returns 0 on success, a positive error code, or <0 if the
+ * skinny_mutex value changed so that the operation should be retried.
+ */
+static int fat_mutex_get(skinny_mutex_t *skinny, struct common *head,
+			 struct fat_mutex **fatp)
+{
+	if (!word_is_pointer(head))
+		return skinny_mutex_promote(skinny, head, fatp);
+	else
+		return fat_mutex_peg(skinny, head, fatp);
+}
+
+/*
+ * NUMA cohorting.
+ *
+ * On a machine with several NUMA nodes, passing a contended mutex to
+ * a thread on another node means that the mutex and the data it
+ * protects have to move between nodes too.  When SKINNY_MUTEX_NUMA
+ * is defined, waiters are also queued by node, and a releasing
+ * thread wakes the oldest waiter on its own node, or hands the mutex
+ * off to it, when it would otherwise have woken the oldest waiter
+ * overall, as in lock cohorting.  To bound the delay to the other
+ * nodes, after SKINNY_MUTEX_NUMA_BATCH consecutive releases within a
+ * node, the oldest waiter is woken as usual (see fat_mutex_unhold).
+ *
+ * So the waiter that has been signalled while fat->held is clear
+ * need not be at the head of the queue, and the invariant described
+ * above becomes that some waiter has been signalled.
+ *
+ * Node numbers are folded modulo SKINNY_MUTEX_NUMA_NODES.  The node
+ * is that of the CPU the thread happens to be running on, so threads
+ * that are not bound to a node might be assigned the wrong one, which
+ * costs performance but not correctness.  A thread can say which node
+ * it belongs to with skinny_mutex_set_numa_node instead.
+ */
+
+#ifdef SKINNY_MUTEX_NUMA
+
+/* One more than the node set by skinny_mutex_set_numa_node, or 0 */
+static __thread unsigned int numa_node_override;
+
+int skinny_mutex_set_numa_node(int node)
+{
+	if (node < -1)
+		return EINVAL;
+
+	numa_node_override = node + 1;
+	return 0;
+}
+
+static unsigned int numa_current_node(void)
+{
+	unsigned int cpu, node;
+
+	if (numa_node_override)
+		return (numa_node_override - 1) % SKINNY_MUTEX_NUMA_NODES;
+
+	/* glibc's getcpu uses the vDSO, avoiding a system call. */
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29)
+	if (getcpu(&cpu, &node))
+#else
+	if (syscall(SYS_getcpu, &cpu, &node, NULL))
+#endif
+		return 0;
+
+	return node % SKINNY_MUTEX_NUMA_NODES;
+}
+
+static void numa_init(struct fat_mutex *fat)
+{
+	unsigned int i;
+
+	for (i = 0; i < SKINNY_MUTEX_NUMA_NODES; i++) {
+		fat->node_queues[i].head = NULL;
+		fat->node_queues[i].tail = &fat->node_queues[i].head;
+	}
+
+	fat->node_batch = 0;
+}
+
+/* Record the node of the calling thread, which is about to wait. */
+static void numa_set_node(struct fat_waiter *w)
+{
+	w->node = numa_current_node();
+}
+
+static void numa_enqueue(struct fat_mutex *fat, struct fat_waiter *w)
+{
+	struct fat_waiter_queue *q = &fat->node_queues[w->node];
+
+	w->node_next = NULL;
+	w->node_pprev = q->tail;
+	*q->tail = w;
+	q->tail = &w->node_next;
+}
+
+static void numa_dequeue(struct fat_mutex *fat, struct fat_waiter *w)
+{
+	*w->node_pprev = w->node_next;
+	if (w->node_next)
+		w->node_next->node_pprev = w->node_pprev;
+	else
+		fat->node_queues[w->node].tail = w->node_pprev;
+}
+
+/* Return the waiter the releasing thread should hand the mutex to
+ * within its node, or NULL to release it in the usual way. */
+static struct fat_waiter *numa_successor(struct fat_mutex *fat)
+{
+	struct fat_waiter *w = fat->node_queues[numa_current_node()].head;
+
+	if (w && fat->node_batch < SKINNY_MUTEX_NUMA_BATCH) {
+		fat->node_batch++;
+		return w;
+	}
+
+	fat->node_batch = 0;
+	return NULL;
+}
+
+#else
+
+static void numa_init(struct fat_mutex *fat) { (void)fat; }
+static void numa_set_node(struct fat_waiter *w) { (void)w; }
+
+static void numa_enqueue(struct fat_mutex *fat, struct fat_waiter *w)
+{
+	(void)fat;
+	(void)w;
+}
+
+static void numa_dequeue(struct fat_mutex *fat, struct fat_waiter *w)
+{
+	(void)fat;
+	(void)w;
+}
+
+static struct fat_waiter *numa_successor(struct fat_mutex *fat)
+{
+	(void)fat;
+	return NULL;
+}
+
+#endif
+
+/* Add a thread to the queue of waiters for a fat_mutex.  The node of
+ * the waiting thread should already have been recorded with
+ * numa_set_node. */
+static void fat_mutex_enqueue(struct fat_mutex *fat, struct fat_waiter *w)
+{
+	w->granted = 0;
+	w->starving = !starvation_usecs;
+	w->start = monotonic_usecs();
+	fat_waiter_enqueue(&fat->queue, w);
+	numa_enqueue(fat, w);
+	fat->waiters++;
+
+	/* Maintain the invariant described above. */
+	if (!fat->held && fat->queue.head == w)
+		pthread_cond_signal(&w->cond);
+}
+
+static void fat_mutex_dequeue(struct fat_mutex *fat, struct fat_waiter *w)
+{
+	fat_waiter_dequeue(&fat->queue, w);
+	numa_dequeue(fat, w);
+	fat->waiters--;
+}
+
+/* Relinquish a fat_mutex held by this thread, either waking the
+ * oldest waiter or handing the mutex off to it, to a thread in
+ * skinny_mutex_run, or to a node from skinny_mutex_lock_async.  In
+ * the last case, the node is returned in *asyncp, and the caller
+ * should pass it to async_grant once it has unlocked fat->mutex.  The
+ * pseudo-reference from the holding thread is left for the caller to
+ * release. */
+static void async_grant(struct skinny_mutex_async *a);
+
+static int fat_mutex_unhold(struct fat_mutex *fat,
+			    struct skinny_mutex_async **asyncp)
+{
+	struct fat_waiter *w = fat->queue.head;
+	struct fat_waiter *r = fat->run_queue.head;
+	struct skinny_mutex_async *a = fat->async_head;
+	struct fat_waiter *local;
+
+	*asyncp = NULL;
+
+	/* A node cannot compete for the mutex, so it is always handed
+	   the mutex, unless a waiter that has waited longer is
+	   starving, or a thread in skinny_mutex_run has waited
+	   longer.  The node's reference becomes the holder's
+	   pseudo-reference. */
+	if (a && !(r && r->start < a->start)
+	    && !(w && w->starving && w->start <= a->start)) {
+		fat->async_head = a->next;
+		if (!a->next)
+			fat->async_tail = &fat->async_head;
+
+		*asyncp = a;
+		return 0;
+	}
+
+	/* Unless a waiter that has waited longer is starving, pass the
+	   mutex to a thread in skinny_mutex_run, which will run the
+	   queued closures. */
+	if (r && !(w && w->starving && w->start <= r->start)) {
+		fat_waiter_dequeue(&fat->run_queue, r);
+		r->granted = 1;
+		return pthread_cond_signal(&r->cond);
+	}
+
+	if (!w) {
+		fat->held = 0;
+		return 0;
+	}
+
+	/* A starving waiter at the head of the queue is handed the
+	   mutex.  Otherwise, within the NUMA batch limit, the waiter on
+	   this thread's node takes the place of the oldest waiter. */
+	if (!w->starving) {
+		local = numa_successor(fat);
+		if (local)
+			w = local;
+	}
+
+	if (w->starving) {
+		fat_mutex_dequeue(fat, w);
+		w->granted = 1;
+	}
+	else {
+		fat->held = 0;
+	}
+
+	return pthread_cond_signal(&w->cond);
+}
+
+/* Wait in the queue of a fat_mutex until this thread acquires it, or
+ * until "abstime" if it is not NULL (on the clock of self->cond).
+ * On error or timeout, the thread is removed from the queue, and the
+ * error is returned without acquiring the mutex. */
+static int fat_waiter_acquire(struct fat_mutex *fat, struct fat_waiter *self,
+			      const struct timespec *abstime)
+{
+	int res = 0;
+
+	for (;;) {
+		if (self->granted)
+			/* The releasing thread removed us from the
+			   queue, and fat->held remains set. */
+			return 0;
+
+		if (!fat->held || res) {
+			fat_mutex_dequeue(fat, self);
+			if (fat->held)
+				return res;
+
+			fat->held = 1;
+			return 0;
+		}
+
+		res = fat_mutex_timedwait(fat, &self->cond, abstime);
+
+		/* If another thread acquired the mutex first, we might
+		   be starving. */
+		if (!res && !self->granted && fat->held && !self->starving
+		    && monotonic_usecs() - self->start
+					>= (long long)starvation_usecs)
+			self->starving = 1;
+	}
+}
+
+/* Try to acquire a skinny_mutex with an associated fat_mutex, giving
+ * up at "abstime" on "clock" if it is not NULL.
+ *
+ * The fat_mutex's mutex will be released, so the calling thread
+ * should already be accounted for in the fat_mutex's refcount.  If
+ * the mutex is not acquired, that reference is released.
+ */
+static int fat_mutex_timedlock(skinny_mutex_t *skinny, struct fat_mutex *fat,
+			       clockid_t clock,
+			       const struct timespec *abstime)
+{
+	struct fat_waiter self;
+	pthread_mutex_t *side;
+	int res, res2;
+	long long start;
+
+	if (!fat->held) {
+		fat->held = 1;
+		side = fat_mutex_acquired(skinny, fat);
+		res = pthread_mutex_unlock(&fat->mutex);
+		return recover(res, cond_gate(side));
+	}
+
+	/* The mutex is already held, so we have to wait for it. */
+	res = cond_init_clock(&self.cond, clock);
+	if (res)
+		return recover(res, fat_mutex_release(skinny, fat));
+
+	start = stats_now();
+	probe(block, skinny, fat);
+	numa_set_node(&self);
+	fat_mutex_enqueue(fat, &self);
+	res = fat_waiter_acquire(fat, &self, abstime);
+	res2 = pthread_cond_destroy(&self.cond);
+	if (res)
+		return recover(res, fat_mutex_release(skinny, fat));
+
+	probe(acquired, skinny, fat);
+	stats_wait(start);
+	side = fat_mutex_acquired(skinny, fat);
+	res = recover(res2, pthread_mutex_unlock(&fat->mutex));
+	return recover(res, cond_gate(side));
+}
+
+/* Called when the fast path of locking fails, with the call site of
+ * the locking function, and the deadline if any. */
+static int mutex_lock_slow(skinny_mutex_t *skinny, const void *site,
+			   clockid_t clock, const struct timespec *abstime)
+{
+	stats_enter(skinny, site);
+	stats_slow_lock();
+	probe(lock_slow, skinny, NULL);
+
+	if (skinny->val != COND_RELEASED
+	    && spin_acquire(skinny, site, (void *)1))
+		return 0;
+
+	for (;;) {
+		struct common *head = skinny->val;
+		if (head == COND_RELEASED) {
+			int res = cond_released_acquire(skinny, (void *)1);
+			if (res >= 0)
+				return res;
+		}
+		else if (head) {
+			struct fat_mutex *fat;
+			int res = fat_mutex_get(skinny, head, &fat);
+			if (!res) {
+				fat->refcount++;
+				res = fat_mutex_timedlock(skinny, fat, clock,
+							  abstime);
+			}
+
+			if (res >= 0)
+				return res;
+
+			/* skinny_mutex value changed under us, try
+			   again. */
+		}
+		else {
+			/* Recapitulate skinny_mutex_lock */
+			if (cas(&skinny->val, head, (void *)1))
+				return 0;
+		}
+	}
+}
+
+int skinny_mutex_trylock(skinny_mutex_t *skinny)
+{
+	stats_enter(skinny, __builtin_return_address(0));
+
+	for (;;) {
+		struct common *head = skinny->val;
+		struct fat_mutex *fat;
+		pthread_mutex_t *side;
+		int res;
+
+		switch ((uintptr_t)head) {
+		case 0:
+			if (cas(&skinny->val, head, (void *)1))
+				return 0;
+
+			break;
+
+		case 1:
+			stats_trylock_failure();
+			return EBUSY;
+
+		case 2:
+			/* COND_RELEASED.  This might block briefly on the
+			 * side mutex, but only while another thread is on
+			 * its way to waiting on a condition variable. */
+			res = cond_released_acquire(skinny, (void *)1);
+			if (res >= 0)
+				return res;
+
+			break;
+
+		default:
+			res = fat_mutex_peg(skinny, head, &fat);
+			if (res > 0)
+				return res;
+			else if (res < 0)
+				/* skinny_mutex value changed under us, try
+				   again. */
+				break;
+
+			res = EBUSY;
+			side = NULL;
+			if (!fat->held) {
+				fat->held = 1;
+				fat->refcount++;
+				side = fat_mutex_acquired(skinny, fat);
+				res = 0;
+			}
+			else {
+				stats_trylock_failure();
+			}
+
+			res = recover(res, pthread_mutex_unlock(&fat->mutex));
+			return recover(res, cond_gate(side));
+		}
+	}
+}
+
+/*
+ * Combining.
+ *
+ * skinny_mutex_run(m, fn, arg) runs fn(arg) while holding m.  If m
+ * is held, rather than waiting to acquire it, the calling thread
+ * queues the closure on the fat_mutex's run_queue, and the holder
+ * runs it on the caller's behalf, before releasing the mutex.  So
+ * under contention, a batch of critical sections runs on one thread,
+ * without the mutex (or the data it protects) moving between
+ * threads.
+ *
+ * A thread that acquired the mutex with skinny_mutex_lock does not
+ * run queued closures, so when it releases the mutex,
+ * fat_mutex_unhold hands the mutex to the first thread on the
+ * run_queue, which then runs its own closure and the others queued.
+ * To bound the time one thread spends running the closures of
+ * others, the holder stops after SKINNY_MUTEX_COMBINE_LIMIT, and
+ * hands the mutex on to the next thread in the queue in the same
+ * way.
+ */
+
+#ifndef SKINNY_MUTEX_COMBINE_LIMIT
+#define SKINNY_MUTEX_COMBINE_LIMIT 64
+#endif
+
+/* Take up to "max" waiters from the head of the run_queue, clearing
+ * their pprev so that they know they have been taken.  Returns the
+ * first, and the last in *lastp. */
+static struct fat_waiter *run_queue_take(struct fat_mutex *fat,
+					 unsigned int max,
+					 struct fat_waiter **lastp)
+{
+	struct fat_waiter *batch = fat->run_queue.head;
+	struct fat_waiter *last = batch;
+
+	last->pprev = NULL;
+	while (last->next && --max) {
+		last = last->next;
+		last->pprev = NULL;
+	}
+
+	fat->run_queue.head = last->next;
+	if (last->next)
+		last->next->pprev = &fat->run_queue.head;
+	else
+		fat->run_queue.tail = &fat->run_queue.head;
+
+	last->next = NULL;
+	*lastp = last;
+	return batch;
+}
+
+/* Put a batch taken with run_queue_take back at the head of the
+ * run_queue. */
+static void run_queue_requeue(struct fat_mutex *fat, struct fat_waiter *batch,
+			      struct fat_waiter *last)
+{
+	struct fat_waiter *w;
+
+	last->next = fat->run_queue.head;
+	if (last->next)
+		last->next->pprev = &last->next;
+	else
+		fat->run_queue.tail = &last->next;
+
+	fat->run_queue.head = batch;
+	batch->pprev = &fat->run_queue.head;
+	for (w = batch; w != last; w = w->next)
+		w->next->pprev = &w->next;
+}
+
+/* Tell the waiters in a batch that their closures have run.  Once
+ * run_done is set, a waiter can return, so its struct must not be
+ * touched afterwards. */
+static int run_batch_done(struct fat_waiter *batch)
+{
+	struct fat_waiter *w, *next;
+	int res = 0;
+
+	for (w = batch; w; w = next) {
+		next = w->next;
+		w->run_done = 1;
+		res = recover(res, pthread_cond_signal(&w->cond));
+	}
+
+	return res;
+}
+
+/* Run "fn" while holding a skinny_mutex with an associated
+ * fat_mutex, then the queued closures, and release the mutex. */
+static int fat_mutex_combine(skinny_mutex_t *skinny, struct fat_mutex *fat,
+			     void (*fn)(void *), void *arg)
+{
+	struct fat_waiter *batch, *last, *w;
+	struct skinny_mutex_async *async;
+	unsigned int n = 0;
+	int res;
+
+	fn(arg);
+
+	res = pthread_mutex_lock(&fat->mutex);
+	if (res)
+		return res;
+
+	while (fat->run_queue.head && n < SKINNY_MUTEX_COMBINE_LIMIT) {
+		batch = run_queue_take(fat, SKINNY_MUTEX_COMBINE_LIMIT - n,
+				       &last);
+
+		res = pthread_mutex_unlock(&fat->mutex);
+		if (res) {
+			/* Leave the batch for whoever gets the mutex
+			   next. */
+			run_queue_requeue(fat, batch, last);
+			break;
+		}
+
+		for (w = batch; w; w = w->next, n++)
+			w->run_fn(w->run_arg);
+
+		res = pthread_mutex_lock(&fat->mutex);
+		if (res) {
+			/* We can't release the mutex, but the closures
+			   have run, so their threads can go. */
+			return recover(res, run_batch_done(batch));
+		}
+
+		res = run_batch_done(batch);
+		if (res)
+			break;
+	}
+
+	stats_released(fat);
+	res = recover(res, fat_mutex_unhold(fat, &async));
+	res = recover(res, fat_mutex_release(skinny, fat));
+	if (async)
+		async_grant(async);
+
+	return res;
+}
+
+int skinny_mutex_run(skinny_mutex_t *skinny, void (*fn)(void *), void *arg)
+{
+	stats_enter(skinny, __builtin_return_address(0));
+
+	for (;;) {
+		struct common *head = skinny->val;
+		struct fat_waiter self;
+		struct fat_mutex *fat;
+		pthread_mutex_t *side;
+		int res, res2;
+
+		if (!head) {
+			if (cas(&skinny->val, head, (void *)1)) {
+				fn(arg);
+				return skinny_mutex_unlock(skinny);
+			}
+
+			continue;
+		}
+
+		if (head == COND_RELEASED) {
+			res = cond_released_acquire(skinny, (void *)1);
+			if (res > 0)
+				return res;
+
+			if (!res) {
+				fn(arg);
+				return skinny_mutex_unlock(skinny);
+			}
+
+			continue;
+		}
+
+		res = fat_mutex_get(skinny, head, &fat);
+		if (res > 0)
+			return res;
+		else if (res < 0)
+			/* skinny_mutex value changed under us, try
+			   again. */
+			continue;
+
+		stats_slow_lock();
+		fat->refcount++;
+
+		if (!fat->held) {
+			fat->held = 1;
+			side = fat_mutex_acquired(skinny, fat);
+			res = pthread_mutex_unlock(&fat->mutex);
+			res = recover(res, cond_gate(side));
+			if (res)
+				return res;
+
+			return fat_mutex_combine(skinny, fat, fn, arg);
+		}
+
+		res = pthread_cond_init(&self.cond, NULL);
+		if (res)
+			return recover(res, fat_mutex_release(skinny, fat));
+
+		self.granted = 0;
+		self.run_fn = fn;
+		self.run_arg = arg;
+		self.run_done = 0;
+		self.start = monotonic_usecs();
+		fat_waiter_enqueue(&fat->run_queue, &self);
+
+		/* Once the holder has taken our closure from the queue
+		   (clearing pprev), we have to wait for it to run. */
+		while (!self.granted && !self.run_done) {
+			res = fat_mutex_wait(fat, &self.cond);
+			if (res && self.pprev) {
+				fat_waiter_dequeue(&fat->run_queue, &self);
+				break;
+			}
+		}
+
+		res2 = pthread_cond_destroy(&self.cond);
+
+		if (self.granted) {
+			side = fat_mutex_acquired(skinny, fat);
+			res = recover(res2, pthread_mutex_unlock(&fat->mutex));
+			res = recover(res, cond_gate(side));
+			if (res)
+				return res;
+
+			return fat_mutex_combine(skinny, fat, fn, arg);
+		}
+
+		if (!self.run_done)
+			return recover(res, fat_mutex_release(skinny, fat));
+
+		return recover(res2, fat_mutex_release(skinny, fat));
+	}
+}
+
+/*
+ * Asynchronous locking.
+ *
+ * skinny_mutex_lock_async(m, node, callback) queues the node on the
+ * fat_mutex's async queue when m is held, rather than blocking.
+ * Like a thread in skinny_mutex_run, the node takes a reference to
+ * the fat_mutex, and fat_mutex_unhold hands the mutex to it, so that
+ * its reference becomes the pseudo-reference of the holder.  The
+ * releasing thread then invokes the callback, once it has unlocked
+ * fat->mutex, so the callback is free to release the mutex again,
+ * or to lock the mutex, or to lock other mutexes.
+ *
+ * The exception is skinny_mutex_cond_timedwait, which holds the side
+ * mutex until it waits on the pthreads cond var, and then it does
+ * not return until it has the mutex again.  So there the node is
+ * posted to a helper thread, started the first time that happens,
+ * which passes the side mutex before invoking the callback.
+ *
+ * A callback that resumes a coroutine would run it on the stack of
+ * the releasing thread, and if the coroutine releases the mutex to
+ * another such node, the stack grows without bound.  So nodes from
+ * skinny_mutex_lock_async_deferred are always posted to the helper
+ * thread, which is started when the first one is queued.
+ */
+
+static pthread_mutex_t async_poster_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_poster_cond = PTHREAD_COND_INITIALIZER;
+static struct skinny_mutex_async *async_posted;
+static struct skinny_mutex_async **async_posted_tail = &async_posted;
+static int async_poster_running;
+static pthread_once_t async_poster_once = PTHREAD_ONCE_INIT;
+
+/* The helper thread does not survive a fork, and nodes posted in the
+   parent are not the child's business. */
+static void async_poster_reset(void)
+{
+	check(pthread_mutex_init(&async_poster_mutex, NULL));
+	check(pthread_cond_init(&async_poster_cond, NULL));
+	async_posted = NULL;
+	async_posted_tail = &async_posted;
+	async_poster_running = 0;
+}
+
+static void async_poster_register_atfork(void)
+{
+	check(pthread_atfork(NULL, NULL, async_poster_reset));
+}
+
+static void *async_poster(void *unused)
+{
+	(void)unused;
+
+	check(pthread_mutex_lock(&async_poster_mutex));
+
+	for (;;) {
+		struct skinny_mutex_async *a = async_posted;
+		if (!a) {
+			check(pthread_cond_wait(&async_poster_cond,
+					     &async_poster_mutex));
+			continue;
+		}
+
+		async_posted = a->next;
+		if (!a->next)
+			async_posted_tail = &async_posted;
+
+		check(pthread_mutex_unlock(&async_poster_mutex));
+		check(cond_gate(side_mutex(a->mutex)));
+		a->callback(a);
+		check(pthread_mutex_lock(&async_poster_mutex));
+	}
+
+	return NULL;
+}
+
+/* Start the helper thread if it is not already running. */
+static int async_poster_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int res = 0;
+
+	check(pthread_once(&async_poster_once, async_poster_register_atfork));
+	check(pthread_mutex_lock(&async_poster_mutex));
+	if (!async_poster_running) {
+		res = pthread_attr_init(&attr);
+		if (!res) {
+			pthread_attr_setdetachstate(&attr,
+						    PTHREAD_CREATE_DETACHED);
+			res = pthread_create(&thread, &attr, async_poster,
+					     NULL);
+			pthread_attr_destroy(&attr);
+		}
+
+		async_poster_running = !res;
+	}
+
+	check(pthread_mutex_unlock(&async_poster_mutex));
+	return res;
+}
+
+/* Have the helper thread invoke the callback of a node. */
+static void async_post(struct skinny_mutex_async *a)
+{
+	check(pthread_mutex_lock(&async_poster_mutex));
+	a->next = NULL;
+	*async_posted_tail = a;
+	async_posted_tail = &a->next;
+	check(pthread_cond_signal(&async_poster_cond));
+	check(pthread_mutex_unlock(&async_poster_mutex));
+}
+
+/* Invoke the callback of a node that has been handed the mutex, or
+ * have the helper thread do so. */
+static void async_grant(struct skinny_mutex_async *a)
+{
+	if (a->deferred)
+		async_post(a);
+	else
+		a->callback(a);
+}
+
+static int mutex_lock_async(skinny_mutex_t *skinny,
+			    struct skinny_mutex_async *node,
+			    void (*callback)(struct skinny_mutex_async *node),
+			    int deferred, const void *site)
+{
+	stats_enter(skinny, site);
+
+	for (;;) {
+		struct common *head = skinny->val;
+		struct fat_mutex *fat;
+		pthread_mutex_t *side;
+		int res;
+
+		if (!head) {
+			if (cas(&skinny->val, head, (void *)1))
+				return 0;
+
+			continue;
+		}
+
+		if (head == COND_RELEASED) {
+			/* This only blocks while another thread is on
+			   its way to waiting on a condition variable. */
+			res = cond_released_acquire(skinny, (void *)1);
+			if (res >= 0)
+				return res;
+
+			continue;
+		}
+
+		res = fat_mutex_get(skinny, head, &fat);
+		if (res > 0)
+			return res;
+		else if (res < 0)
+			/* skinny_mutex value changed under us, try
+			   again. */
+			continue;
+
+		stats_slow_lock();
+		fat->refcount++;
+
+		if (!fat->held) {
+			fat->held = 1;
+			side = fat_mutex_acquired(skinny, fat);
+			res = pthread_mutex_unlock(&fat->mutex);
+			return recover(res, cond_gate(side));
+		}
+
+		if (deferred) {
+			res = async_poster_start();
+			if (res)
+				return recover(res,
+					       fat_mutex_release(skinny, fat));
+		}
+
+		probe(block, skinny, fat);
+		node->next = NULL;
+		node->callback = callback;
+		node->mutex = skinny;
+		node->start = monotonic_usecs();
+		node->deferred = deferred;
+		*fat->async_tail = node;
+		fat->async_tail = &node->next;
+		return recover(EINPROGRESS,
+			       pthread_mutex_unlock(&fat->mutex));
+	}
+}
+
+int skinny_mutex_lock_async(skinny_mutex_t *skinny,
+			    struct skinny_mutex_async *node,
+			    void (*callback)(struct skinny_mutex_async *node))
+{
+	return mutex_lock_async(skinny, node, callback, 0,
+				__builtin_return_address(0));
+}
+
+int skinny_mutex_lock_async_deferred(skinny_mutex_t *skinny,
+				     struct skinny_mutex_async *node,
+				     void (*callback)(
+					     struct skinny_mutex_async *node))
+{
+	return mutex_lock_async(skinny, node, callback, 1,
+				__builtin_return_address(0));
+}
+
+/* Get and lock the fat_mutex associated with a skinny_mutex, when
+ * this thread is expected to already hold the mutex. */
+static int fat_mutex_get_held(skinny_mutex_t *skinny, struct fat_mutex **fatp)
+{
+	for (;;) {
+		int res;
+		struct common *head = skinny->val;
+		if (!head || head == COND_RELEASED)
+			return EPERM;
+
+		res = fat_mutex_get(skinny, head, fatp);
+		if (res == 0) {
+			if ((*fatp)->held)
+				return 0;
+
+			res = pthread_mutex_unlock(&(*fatp)->mutex);
+			if (res)
+				return res;
+
+			return EPERM;
+		}
+
+		if (res >= 0)
+			return res;
+	}
+}
+
+/* Called from skinny_mutex_unlock when the fast path fails. */
+int skinny_mutex_unlock_slow(skinny_mutex_t *skinny)
+{
+	struct fat_mutex *fat;
+	struct skinny_mutex_async *async;
+	int res;
+
+	stats_enter(skinny, __builtin_return_address(0));
+	res = fat_mutex_get_held(skinny, &fat);
+	if (res)
+		return res;
+
+	stats_released(fat);
+	if (fat->queue.head)
+		probe(wake, skinny, fat);
+
+	res = fat_mutex_unhold(fat, &async);
+	res = recover(res, fat_mutex_release(skinny, fat));
+	if (async)
+		async_grant(async);
+
+	return res;
+}
+
+/* Release a fat_mutex held by this thread from
+ * skinny_mutex_cond_timedwait, which holds the side mutex.  The next
+ * thread to acquire the mutex has to pass the side mutex (see
+ * fat_mutex_acquired), so it cannot signal the condition variable
+ * before we wait on it.  A node handed the mutex can't have its
+ * callback invoked before then either, so it goes to the helper
+ * thread, which passes the side mutex first. */
+static int fat_mutex_cond_release(skinny_mutex_t *skinny,
+				  struct fat_mutex *fat)
+{
+	struct skinny_mutex_async *async;
+	int res;
+
+	if (fat->async_head) {
+		res = async_poster_start();
+		if (res)
+			return recover(res, pthread_mutex_unlock(&fat->mutex));
+	}
+
+	stats_released(fat);
+	fat->cond_released = 1;
+	res = fat_mutex_unhold(fat, &async);
+	if (res) {
+		fat->cond_released = 0;
+		return recover(res, pthread_mutex_unlock(&fat->mutex));
+	}
+
+	if (async) {
+		fat->cond_released = 0;
+		async_post(async);
+	}
+
+	return fat_mutex_release(skinny, fat);
+}
+
+int skinny_mutex_cond_timedwait(pthread_cond_t *cond, skinny_mutex_t *skinny,
+				const struct timespec *abstime)
+{
+	struct cond_wait_cleanup c;
+	struct fat_mutex *fat;
+	int res;
+
+	elision_abort(skinny);
+	stats_enter(skinny, __builtin_return_address(0));
+	c.skinny = skinny;
+	c.side = side_mutex(skinny);
+	res = pthread_mutex_lock(c.side);
+	if (res)
+		return res;
+
+	/* Without a fat_mutex, releasing the mutex is just a matter of
+	   marking it as COND_RELEASED. */
+	if (!cas(&skinny->val, (void *)1, COND_RELEASED)) {
+		res = fat_mutex_get_held(skinny, &fat);
+		if (!res)
+			res = fat_mutex_cond_release(skinny, fat);
+
+		if (res) {
+			pthread_mutex_unlock(c.side);
+			return res;
+		}
+	}
+
+	probe(cond_wait, skinny, NULL);
+
+	/* pthread_cond_wait is a cancellation point */
+	pthread_cleanup_push(cond_wait_cleanup, &c);
+
+	if (!abstime)
+		res = pthread_cond_wait(cond, c.side);
+	else
+		res = pthread_cond_timedwait(cond, c.side, abstime);
+
+	pthread_cleanup_pop(1);
+	probe(cond_return, skinny, NULL);
+	return recover(res, c.lock_res);
+}
+
+/*
+ * skinny_conds.
+ *
+ * While threads are waiting on a skinny_cond, it points to the
+ * associated skinny_mutex, and the waiting threads are queued on the
+ * cond_queue of the fat_mutex.  Each waiting thread retains its
+ * reference to the fat_mutex, so the fat_mutex remains associated
+ * with the skinny_mutex until the last of them is done.  The
+ * skinny_cond is only changed while holding the fat_mutex's mutex.
+ *
+ * Signalling a skinny_cond moves a waiter from the cond_queue to the
+ * queue of threads waiting to acquire the mutex, without waking it
+ * unless the mutex is free.  So when the signalling thread releases
+ * the mutex, the waiter is woken once, and acquires it, rather than
+ * being woken only to block again waiting for the mutex.
+ */
+
+int skinny_cond_destroy(skinny_cond_t *cond)
+{
+	return !cond->val ? 0 : EBUSY;
+}
+
+/* Disassociate a skinny_cond from a skinny_mutex if none of the
+   remaining waiters on the fat_mutex's cond_queue are waiting on
+   it. */
+static void cond_release_if_unused(struct fat_mutex *fat, skinny_cond_t *cond)
+{
+	struct fat_waiter *w;
+
+	for (w = fat->cond_queue.head; w; w = w->next)
+		if (w->cond_wait == cond)
+			return;
+
+	cond->val = NULL;
+}
+
+int skinny_cond_timedwait(skinny_cond_t *cond, skinny_mutex_t *skinny,
+			  const struct timespec *abstime)
+{
+	struct fat_waiter self;
+	struct fat_mutex *fat;
+	struct skinny_mutex_async *async;
+	pthread_mutex_t *side = NULL;
+	int res, res2;
+
+	elision_abort(skinny);
+	stats_enter(skinny, __builtin_return_address(0));
+	res = fat_mutex_get_held(skinny, &fat);
+	if (res)
+		return res;
+
+	res = pthread_cond_init(&self.cond, NULL);
+	if (res)
+		goto out;
+
+	if (cond->val != skinny && !strict_cas(&cond->val, NULL, skinny)) {
+		/* The skinny_cond is in use with another mutex. */
+		res = EINVAL;
+		pthread_cond_destroy(&self.cond);
+		goto out;
+	}
+
+	self.cond_wait = cond;
+	numa_set_node(&self);
+	fat_waiter_enqueue(&fat->cond_queue, &self);
+
+	/* Relinquish the mutex.  But we leave our reference accounted
+	   for in fat->refcount in place, in order to pin the
+	   fat_mutex. */
+	stats_released(fat);
+	res = fat_mutex_unhold(fat, &async);
+	if (!res && async) {
+		/* Our place on the cond_queue means that a signal cannot
+		   be missed while fat->mutex is unlocked. */
+		res = pthread_mutex_unlock(&fat->mutex);
+		async_grant(async);
+		if (!res)
+			res = pthread_mutex_lock(&fat->mutex);
+	}
+
+	while (!res && self.cond_wait)
+		res = fat_mutex_timedwait(fat, &self.cond, abstime);
+
+	if (self.cond_wait) {
+		/* We timed out without being signalled. */
+		fat_waiter_dequeue(&fat->cond_queue, &self);
+		self.cond_wait = NULL;
+		cond_release_if_unused(fat, cond);
+		fat_mutex_enqueue(fat, &self);
+	}
+	else {
+		/* We were signalled, even if we then timed out while
+		   waiting for the mutex. */
+		res = 0;
+	}
+
+	res2 = fat_waiter_acquire(fat, &self, NULL);
+	pthread_cond_destroy(&self.cond);
+	if (res2)
+		return recover(res2, fat_mutex_release(skinny, fat));
+
+	side = fat_mutex_acquired(skinny, fat);
+
+ out:
+	res = recover(res, pthread_mutex_unlock(&fat->mutex));
+	return recover(res, cond_gate(side));
+}
+
+/* Move one or all of the threads waiting on a skinny_cond to the
+   queue of threads waiting to acquire the associated mutex. */
+static int skinny_cond_wake(skinny_cond_t *cond, int all)
+{
+	for (;;) {
+		skinny_mutex_t *skinny = cond->val;
+		struct common *head;
+		struct fat_mutex *fat;
+		struct fat_waiter *w, *next;
+		int res;
+
+		if (!skinny)
+			return 0;
+
+		/* If there are waiters, the skinny_mutex must point to
+		   the fat_mutex.  Otherwise, the last waiter
+		   disassociated the skinny_cond before releasing the
+		   fat_mutex. */
+		head = skinny->val;
+		if (!word_is_pointer(head))
+			continue;
+
+		res = fat_mutex_peg(skinny, head, &fat);
+		if (res > 0)
+			return res;
+		else if (res < 0)
+			continue;
+
+		if (cond->val == skinny) {
+			for (w = fat->cond_queue.head; w; w = next) {
+				next = w->next;
+				if (w->cond_wait != cond)
+					continue;
+
+				fat_waiter_dequeue(&fat->cond_queue, w);
+				w->cond_wait = NULL;
+				fat_mutex_enqueue(fat, w);
+				if (!all)
+					break;
+			}
+
+			cond_release_if_unused(fat, cond);
+		}
+
+		return pthread_mutex_unlock(&fat->mutex);
+	}
+}
+
+int skinny_cond_signal(skinny_cond_t *cond)
+{
+	return skinny_cond_wake(cond, 0);
+}
+
+int skinny_cond_broadcast(skinny_cond_t *cond)
+{
+	return skinny_cond_wake(cond, 1);
+}
+
+#else /* SKINNY_MUTEX_WORD_BACKEND */
+
+/*
+ * The word backends.
+ *
+ * We can avoid the fat_mutex altogether.  Rather than falling back
+ * to pthreads primitives associated with the skinny_mutex when it
+ * becomes contended, threads block on the address of the
+ * skinny_mutex word, either using the futex system call, or in a
+ * parking lot: a fixed table of wait queues indexed by a hash of the
+ * address.  So nothing is allocated or initialized on the contended
+ * path, however many skinny_mutexes are contended at once.
+ *
+ * In these backends, the skinny_mutex never contains a pointer.
+ * Instead it contains one of the following values:
+ *
+ * 0 (UNLOCKED): The mutex is not held.
+ *
+ * 1 (LOCKED): The mutex is held, and no threads are blocked waiting
+ * for it.
+ *
+ * 2 (CONTENDED): The mutex is held, and threads might be blocked
+ * waiting for it.  The thread releasing the mutex needs to wake one
+ * of them.
+ *
+ * 3 (COND_RELEASED): The mutex is not held, but it was released by
+ * skinny_mutex_cond_timedwait, and the waiting thread might not yet
+ * be blocked on the condition variable (see below).
+ *
+ * The values 0 and 1 have the same meaning as with the fat_mutex
+ * backend, so the inline fast paths in skinny_mutex.h work
+ * unchanged.  SKINNY_MUTEX_PI uses different values (see "Priority
+ * inheritance" below).
+ *
+ * The blocking primitives are word_wait, which blocks while a word
+ * contains a given value, and word_wake, which wakes one or all of
+ * the threads blocked in word_wait on a word.  A thread releasing the
+ * mutex changes the word before calling word_wake, and word_wait
+ * checks the word atomically with respect to word_wake, so wakeups
+ * cannot be lost.  The same primitives are used for skinny_conds.
+ */
+
+#define UNLOCKED ((void *)0)
+#define LOCKED ((void *)1)
+#define CONTENDED ((void *)2)
+
+#ifdef SKINNY_MUTEX_FUTEX
+
+/* Futexes are normally private to the process, which lets the
+ * kernel key them by virtual address.  With SKINNY_MUTEX_PSHARED the
+ * kernel has to find the underlying shared page, so that mutexes and
+ * skinny_conds in shared memory work between processes. */
+#ifndef SKINNY_MUTEX_PSHARED
+#define FUTEX_CMD(op) ((op) | FUTEX_PRIVATE_FLAG)
+#else
+#define FUTEX_CMD(op) (op)
+#endif
+
+/* The futex system call operates on an int.  The words we wait on
+ * are pointer-sized, but only the low-order bits are significant, so
+ * we use the part of the word containing them. */
+static int *futex_word(void **word)
+{
+	int *p = (int *)word;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	p += sizeof(void *) / sizeof(int) - 1;
+#endif
+	return p;
+}
+
+/* Block while the word contains "val", or until the absolute time
+ * "abstime" on "clock", if it is not NULL. */
+static int word_wait(void **word, void *val, clockid_t clock,
+		     const struct timespec *abstime)
+{
+	if (syscall(SYS_futex, futex_word(word),
+		    FUTEX_CMD(FUTEX_WAIT_BITSET)
+		    | (clock == CLOCK_REALTIME ? FUTEX_CLOCK_REALTIME : 0),
+		    (int)(uintptr_t)val, abstime, NULL, FUTEX_BITSET_MATCH_ANY)
+	    && errno != EAGAIN && errno != EINTR)
+		return errno;
+
+	return 0;
+}
+
+/* Wake a single thread blocked in word_wait, or all of them. */
+static int word_wake(void **word, int all)
+{
+	if (syscall(SYS_futex, futex_word(word), FUTEX_CMD(FUTEX_WAKE),
+		    all ? INT_MAX : 1, NULL, NULL, 0) < 0)
+		return errno;
+
+	return 0;
+}
+
+#else /* SKINNY_MUTEX_PARKING_LOT */
+
+/*
+ * The parking lot.
+ *
+ * This emulates futexes in userspace.  Each bucket in the parking
+ * lot has a pthreads mutex and a FIFO queue of parked threads.  A
+ * parked thread is represented by a node on its own stack, with its
+ * own condition variable, so that word_wake can wake exactly the
+ * thread it dequeues.  Several words can share a bucket, so each
+ * node records the word it is waiting on.
+ *
+ * The buckets are aligned to cache lines so that unrelated
+ * skinny_mutexes hashing to neighbouring buckets don't contend on
+ * the same cache line.
+ */
+
+#ifndef SKINNY_MUTEX_PARKING_LOT_BUCKETS
+#define SKINNY_MUTEX_PARKING_LOT_BUCKETS 256
+#endif
+
+struct parked_thread {
+	struct parked_thread *next;
+	void **word;
+	int woken;
+	pthread_cond_t cond;
+};
+
+struct parking_bucket {
+	pthread_mutex_t mutex;
+	struct parked_thread *head;
+	struct parked_thread **tail;
+} __attribute__((aligned(64)));
+
+static struct parking_bucket parking_lot[SKINNY_MUTEX_PARKING_LOT_BUCKETS];
+static pthread_once_t parking_lot_once = PTHREAD_ONCE_INIT;
+
+static void parking_lot_init(void)
+{
+	int i;
+
+	for (i = 0; i < SKINNY_MUTEX_PARKING_LOT_BUCKETS; i++) {
+		struct parking_bucket *bucket = &parking_lot[i];
+
+		check(pthread_mutex_init(&bucket->mutex, NULL));
+		bucket->head = NULL;
+		bucket->tail = &bucket->head;
+	}
+}
+
+static struct parking_bucket *parking_bucket(void **word)
+{
+	check(pthread_once(&parking_lot_once, parking_lot_init));
+	return &parking_lot[hash_ptr(word)
+			    % SKINNY_MUTEX_PARKING_LOT_BUCKETS];
+}
+
+/* Block while the word contains "val", or until the absolute time
+ * "abstime" on "clock", if it is not NULL. */
+static int word_wait(void **word, void *val, clockid_t clock,
+		     const struct timespec *abstime)
+{
+	struct parking_bucket *bucket = parking_bucket(word);
+	struct parked_thread self;
+	int res, old_state, old_state2;
+
+	res = pthread_mutex_lock(&bucket->mutex);
+	if (res)
+		return res;
+
+	/* word_wake holds the bucket mutex, so if the word changes
+	   after this check, we will be on the queue by the time the
+	   releasing thread looks for us. */
+	if (*word != val)
+		return pthread_mutex_unlock(&bucket->mutex);
+
+	res = cond_init_clock(&self.cond, clock);
+	if (res) {
+		pthread_mutex_unlock(&bucket->mutex);
+		return res;
+	}
+
+	self.next = NULL;
+	self.word = word;
+	self.woken = 0;
+	*bucket->tail = &self;
+	bucket->tail = &self.next;
+
+	/* Locking is not a cancellation point, but pthread_cond_wait
+	   is, and our node must not be left on the queue. */
+	check(pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state));
+	while (!self.woken) {
+		if (!abstime)
+			res = pthread_cond_wait(&self.cond, &bucket->mutex);
+		else
+			res = pthread_cond_timedwait(&self.cond,
+						     &bucket->mutex, abstime);
+		if (res)
+			break;
+	}
+	check(pthread_setcancelstate(old_state, &old_state2));
+
+	if (!self.woken) {
+		/* Remove ourself from the queue. */
+		struct parked_thread **pp = &bucket->head;
+
+		while (*pp != &self)
+			pp = &(*pp)->next;
+
+		*pp = self.next;
+		if (bucket->tail == &self.next)
+			bucket->tail = pp;
+	}
+	else {
+		res = 0;
+	}
+
+	res = recover(res, pthread_mutex_unlock(&bucket->mutex));
+	return recover(res, pthread_cond_destroy(&self.cond));
+}
+
+/* Wake a single thread blocked in word_wait, or all of them. */
+static int word_wake(void **word, int all)
+{
+	struct parking_bucket *bucket = parking_bucket(word);
+	struct parked_thread **pp = &bucket->head, *parked;
+	int res = pthread_mutex_lock(&bucket->mutex);
+	if (res)
+		return res;
+
+	while ((parked = *pp)) {
+		if (parked->word != word) {
+			pp = &parked->next;
+			continue;
+		}
+
+		*pp = parked->next;
+		if (bucket->tail == &parked->next)
+			bucket->tail = pp;
+
+		/* The parked thread can't return from word_wait until
+		   we release the bucket mutex. */
+		parked->woken = 1;
+		res = pthread_cond_signal(&parked->cond);
+		if (res || !all)
+			break;
+	}
+
+	return recover(res, pthread_mutex_unlock(&bucket->mutex));
+}
+
+#endif /* SKINNY_MUTEX_PARKING_LOT */
+
+#ifndef SKINNY_MUTEX_PI
+
+/* Called when the fast path of locking fails, with the call site of
+ * the locking function, and the deadline if any. */
+static int mutex_lock_slow(skinny_mutex_t *skinny, const void *site,
+			   clockid_t clock, const struct timespec *abstime)
+{
+	/* Until this thread has blocked, it can acquire the mutex in
+	 * the LOCKED state: Any threads already blocked will be
+	 * accounted for by a thread that has been woken.  But after
+	 * being woken, this thread is that thread, so it has to
+	 * leave the mutex CONTENDED. */
+	void *acquired = LOCKED;
+	long long start = 0;
+
+	stats_enter(skinny, site);
+	stats_slow_lock();
+	probe(lock_slow, skinny, NULL);
+
+	if (spin_acquire(skinny, site, LOCKED))
+		return 0;
+
+	for (;;) {
+		void *val = skinny->val;
+		int res;
+
+		switch ((uintptr_t)val) {
+		case 0:
+			/* Recapitulate skinny_mutex_lock */
+			if (cas(&skinny->val, val, acquired)) {
+				if (acquired == CONTENDED) {
+					probe(acquired, skinny, NULL);
+					stats_wait(start);
+				}
+
+				return 0;
+			}
+
+			break;
+
+		case 1:
+			/* Indicate that there will be a waiter */
+			if (!cas(&skinny->val, val, CONTENDED))
+				break;
+
+			/* fall through */
+		case 2:
+			if (acquired == LOCKED)
+				start = stats_now();
+
+			probe(block, skinny, NULL);
+			/* On timeout, the mutex is left CONTENDED, so
+			   any other waiters will still be woken. */
+			res = word_wait(&skinny->val, CONTENDED, clock,
+					abstime);
+			if (res)
+				return res;
+
+			acquired = CONTENDED;
+			break;
+
+		default:
+			res = cond_released_acquire(skinny, acquired);
+			if (res >= 0) {
+				if (!res && acquired == CONTENDED)
+					stats_wait(start);
+
+				return res;
+			}
+		}
+	}
+}
+
+int skinny_mutex_trylock(skinny_mutex_t *skinny)
+{
+	stats_enter(skinny, __builtin_return_address(0));
+
+	for (;;) {
+		void *val = skinny->val;
+		int res;
+
+		switch ((uintptr_t)val) {
+		case 0:
+			if (cas(&skinny->val, val, LOCKED))
+				return 0;
+
+			break;
+
+		case 1:
+		case 2:
+			stats_trylock_failure();
+			return EBUSY;
+
+		default:
+			/* This might block briefly on the side mutex,
+			 * but only while another thread is on its way
+			 * to waiting on a condition variable. */
+			res = cond_released_acquire(skinny, LOCKED);
+			if (res >= 0)
+				return res;
+		}
+	}
+}
+
+#endif
+
+/* Without a fat_mutex to hang a queue of closures from, there is no
+ * combining: skinny_mutex_run simply runs the closure while holding
+ * the mutex. */
+int skinny_mutex_run(skinny_mutex_t *skinny, void (*fn)(void *), void *arg)
+{
+	int res = skinny_mutex_lock(skinny);
+	if (res)
+		return res;
+
+	fn(arg);
+	return skinny_mutex_unlock(skinny);
+}
+
+/* There is no fat_mutex to queue the node on, and blocking instead
+ * would defeat the point, so asynchronous locking is not
+ * supported. */
+int skinny_mutex_lock_async(skinny_mutex_t *skinny,
+			    struct skinny_mutex_async *node,
+			    void (*callback)(struct skinny_mutex_async *node))
+{
+	(void)skinny;
+	(void)node;
+	(void)callback;
+	return ENOSYS;
+}
+
+int skinny_mutex_lock_async_deferred(skinny_mutex_t *skinny,
+				     struct skinny_mutex_async *node,
+				     void (*callback)(
+					     struct skinny_mutex_async *node))
+{
+	(void)skinny;
+	(void)node;
+	(void)callback;
+	return ENOSYS;
+}
+
+#ifndef SKINNY_MUTEX_PI
+
+/* Called from skinny_mutex_unlock when the fast path fails. */
+int skinny_mutex_unlock_slow(skinny_mutex_t *skinny)
+{
+	for (;;) {
+		void *val = skinny->val;
+
+		switch ((uintptr_t)val) {
+		case 1:
+			/* Recapitulate skinny_mutex_unlock */
+			if (cas(&skinny->val, val, UNLOCKED))
+				return 0;
+
+			break;
+
+		case 2:
+			/* Only the holding thread can change the
+			   mutex from CONTENDED. */
+			atomic_xchg(&skinny->val, UNLOCKED);
+			probe(wake, skinny, NULL);
+			return word_wake(&skinny->val, 0);
+
+		default:
+			return EPERM;
+		}
+	}
+}
+
+#ifdef SKINNY_MUTEX_XCHG_UNLOCK
+
+/* Called from skinny_mutex_unlock when the word it replaced with 0
+ * was not LOCKED. */
+int skinny_mutex_unlock_wake(skinny_mutex_t *skinny, void *old)
+{
+	switch ((uintptr_t)old) {
+	case 2:
+		probe(wake, skinny, NULL);
+		return word_wake(&skinny->val, 0);
+
+	case 3:
+		/* The mutex wasn't held.  Put it back if nobody else
+		   has seen it in the meantime. */
+		strict_cas(&skinny->val, UNLOCKED, COND_RELEASED);
+		return EPERM;
+
+	default:
+		return EPERM;
+	}
+}
+
+#endif
+
+#endif
+
+/* The result of waiting on a condition variable, given the result of
+   re-acquiring the mutex.  With SKINNY_MUTEX_ROBUST, that can fail
+   with EOWNERDEAD or ENOTRECOVERABLE, which the caller has to see
+   whatever happened to the wait. */
+static int cond_relock_result(int res, int lock_res)
+{
+	if (lock_res == EOWNERDEAD || lock_res == ENOTRECOVERABLE)
+		return lock_res;
+
+	return recover(res, lock_res);
+}
+
+#ifndef SKINNY_MUTEX_PI
+
+int skinny_mutex_cond_timedwait(pthread_cond_t *cond, skinny_mutex_t *skinny,
+				const struct timespec *abstime)
+{
+	struct cond_wait_cleanup c;
+	int res;
+
+	elision_abort(skinny);
+	if (skinny->val != LOCKED && skinny->val != CONTENDED)
+		return EPERM;
+
+	c.skinny = skinny;
+	c.side = side_mutex(skinny);
+	res = pthread_mutex_lock(c.side);
+	if (res)
+		return res;
+
+	/* Relinquish the mutex, waking a waiter if necessary. */
+	if (atomic_xchg(&skinny->val, COND_RELEASED) == CONTENDED) {
+		res = word_wake(&skinny->val, 0);
+		if (res) {
+			pthread_mutex_unlock(c.side);
+			return res;
+		}
+	}
+
+	probe(cond_wait, skinny, NULL);
+
+	/* pthread_cond_wait is a cancellation point */
+	pthread_cleanup_push(cond_wait_cleanup, &c);
+
+	if (!abstime)
+		res = pthread_cond_wait(cond, c.side);
+	else
+		res = pthread_cond_timedwait(cond, c.side, abstime);
+
+	pthread_cleanup_pop(1);
+	probe(cond_return, skinny, NULL);
+	return recover(res, c.lock_res);
+}
+
+#else /* SKINNY_MUTEX_PI */
+
+/*
+ * Priority inheritance.
+ *
+ * With SKINNY_MUTEX_PI, a held skinny_mutex contains the thread ID
+ * of its holder, and threads block using the kernel's PI futex
+ * operations, FUTEX_LOCK_PI and FUTEX_UNLOCK_PI.  Knowing the holder,
+ * the kernel boosts it to the priority of the highest-priority
+ * waiter until it releases the mutex, which it then hands directly
+ * to that waiter.  So a high-priority thread waits only for the
+ * critical section of the holder, not for whatever lower-priority
+ * work preempted it.
+ *
+ * The futex is the low-order 32 bits of the word, and belongs to the
+ * kernel: it sets FUTEX_WAITERS when threads block, so that the
+ * inline unlock, which compares the word with the thread ID, fails
+ * and skinny_mutex_unlock_slow asks the kernel to hand the mutex
+ * over.
+ *
+ * The kernel never touches the rest of the word, so that is where
+ * skinny_mutex_cond_timedwait puts COND_RELEASED_FLAG.  If there
+ * are no waiters, it simply sets the word to COND_RELEASED, which is
+ * just the flag.  Otherwise, only the kernel can release the mutex,
+ * by handing it to a waiter, so it sets the flag before calling
+ * FUTEX_UNLOCK_PI.  The kernel might instead leave the futex 0, if
+ * the waiters have all timed out, but then the word is still
+ * COND_RELEASED.  Whichever way a thread acquires a mutex with the
+ * flag set, it synchronizes with the side mutex, and then clears the
+ * flag.  The inline fast paths only deal in words with the flag
+ * clear, so they never do the wrong thing.
+ *
+ * With SKINNY_MUTEX_ROBUST, the holder of a mutex also sets
+ * HOLDER_FLAG in the upper half of the word, from acquiring the
+ * mutex until it is about to release it.  We can't use the kernel's
+ * robust futex lists: the kernel supports only one list per thread,
+ * and glibc uses it for robust pthreads mutexes.  Instead, we rely
+ * on the thread ID in the futex.  When a thread holding a PI futex
+ * exits, the kernel hands it to the highest-priority waiter blocked
+ * in FUTEX_LOCK_PI, if there is one.  Otherwise, because the thread
+ * no longer exists, the next FUTEX_LOCK_PI fails with ESRCH, and
+ * the caller takes the mutex over by putting its own thread ID in
+ * the futex.  Either way, the thread that acquires the mutex finds
+ * HOLDER_FLAG still set, so it knows that the previous holder died
+ * holding it, and sets FUTEX_OWNER_DIED (which means nothing to the
+ * kernel when the thread ID is not 0).  It then gets EOWNERDEAD,
+ * and skinny_mutex_consistent clears FUTEX_OWNER_DIED.  If the ID of
+ * a thread that exits holding a mutex is reused before another
+ * thread contends for it, the mutex is never recovered.  Releasing
+ * the mutex with it still set sets NOT_RECOVERABLE_FLAG, in the
+ * upper half of the word, which is never cleared.  A thread handed
+ * such a mutex by the kernel passes it on to the next waiter.
+ */
+
+#define FUTEX_BITS ((uintptr_t)0xffffffff)
+#define COND_RELEASED_FLAG ((uintptr_t)1 << 32)
+#define NOT_RECOVERABLE_FLAG ((uintptr_t)1 << 33)
+#define PI_OWNER(val) ((uintptr_t)(val) & FUTEX_TID_MASK)
+#define HOLDER_FLAG SKINNY_MUTEX_HOLDER_FLAG_
+
+__thread uintptr_t skinny_mutex_tid_;
+
+static pthread_once_t tid_once = PTHREAD_ONCE_INIT;
+
+#ifdef SKINNY_MUTEX_ROBUST
+
+/* FUTEX_LOCK_PI failed with ESRCH, because the thread whose ID
+ * "owner" was in the futex no longer exists, and nobody is blocked
+ * waiting for the mutex.  If the word still contains that ID,
+ * replace it with ours, leaving the rest of the word as it is, so
+ * that pi_acquired sees HOLDER_FLAG if the owner died holding the
+ * mutex.  Returns EAGAIN to try locking again if the word has
+ * changed. */
+static int robust_take_over(skinny_mutex_t *skinny, uintptr_t owner)
+{
+	uintptr_t self = PI_OWNER(skinny_mutex_held_());
+
+	for (;;) {
+		void *val = skinny->val;
+
+		if (!owner || PI_OWNER(val) != owner)
+			return EAGAIN;
+
+		if (cas(&skinny->val, val,
+			(void *)(((uintptr_t)val & ~(uintptr_t)FUTEX_TID_MASK)
+				 | self)))
+			return 0;
+	}
+}
+
+/* Deal with the ways FUTEX_LOCK_PI fails when the holder exits. */
+static int robust_lock_failed(skinny_mutex_t *skinny, uintptr_t owner,
+			      const struct timespec *abstime, int res)
+{
+	switch (res) {
+	case ESRCH:
+		return robust_take_over(skinny, owner);
+
+	case EINVAL:
+		/* While the kernel is handing the mutex of a thread that
+		   has exited to the waiter it had blocked, before the
+		   waiter has put its ID in the futex, other threads
+		   trying to lock it get EINVAL.  With a valid deadline,
+		   that is the only way to get it. */
+		if (!abstime || (abstime->tv_nsec >= 0
+				 && abstime->tv_nsec < 1000000000)) {
+			sched_yield();
+			return EAGAIN;
+		}
+
+		break;
+	}
+
+	return res;
+}
+
+/* Whether the thread whose ID is in the word no longer exists, for
+ * skinny_mutex_trylock, which can't ask FUTEX_LOCK_PI.  A process
+ * that has exited but not yet been reaped still seems to exist, so
+ * trylock fails with EBUSY until it has been. */
+static int robust_owner_dead(void *val)
+{
+	pid_t owner = PI_OWNER(val);
+
+	return owner && kill(owner, 0) && errno == ESRCH;
+}
+
+#else
+
+static int robust_lock_failed(skinny_mutex_t *skinny, uintptr_t owner,
+			      const struct timespec *abstime, int res)
+{
+	(void)skinny;
+	(void)owner;
+	(void)abstime;
+	return res;
+}
+
+static int robust_owner_dead(void *val)
+{
+	(void)val;
+	return 0;
+}
+
+static int robust_take_over(skinny_mutex_t *skinny, uintptr_t owner)
+{
+	(void)skinny;
+	(void)owner;
+	return ESRCH;
+}
+
+#endif
+
+/* The child of a fork has a new thread ID. */
+static void tid_reset(void)
+{
+	skinny_mutex_tid_ = 0;
+}
+
+static void tid_register_atfork(void)
+{
+	check(pthread_atfork(NULL, NULL, tid_reset));
+}
+
+/* Called from skinny_mutex_held_ the first time a thread uses a
+ * skinny_mutex. */
+uintptr_t skinny_mutex_tid_init(void)
+{
+	check(pthread_once(&tid_once, tid_register_atfork));
+	skinny_mutex_tid_ = (uintptr_t)syscall(SYS_gettid);
+	return skinny_mutex_tid_;
+}
+
+static int pi_futex(skinny_mutex_t *skinny, int op,
+		    const struct timespec *abstime)
+{
+	if (syscall(SYS_futex, futex_word(&skinny->val), op, 0, abstime,
+		    NULL, 0))
+		return errno;
+
+	return 0;
+}
+
+/* Block in the kernel until the mutex is handed to us, or until the
+ * absolute time "abstime" on "clock", if it is not NULL.
+ * FUTEX_LOCK_PI only takes a deadline on CLOCK_REALTIME, so other
+ * clocks need FUTEX_LOCK_PI2 (Linux 5.14), or failing that a
+ * conversion. */
+static int pi_lock(skinny_mutex_t *skinny, clockid_t clock,
+		   const struct timespec *abstime)
+{
+	struct timespec now, reltime, converted;
+
+	if (abstime && clock != CLOCK_REALTIME) {
+#ifdef FUTEX_LOCK_PI2
+		int res = pi_futex(skinny, FUTEX_CMD(FUTEX_LOCK_PI2),
+				   abstime);
+		if (res != ENOSYS)
+			return res;
+#endif
+
+		check(clock_gettime(clock, &now));
+		reltime.tv_sec = abstime->tv_sec - now.tv_sec;
+		reltime.tv_nsec = abstime->tv_nsec - now.tv_nsec;
+		if (reltime.tv_nsec < 0) {
+			reltime.tv_nsec += 1000000000;
+			reltime.tv_sec--;
+		}
+
+		if (reltime.tv_sec < 0)
+			reltime.tv_sec = reltime.tv_nsec = 0;
+
+		abstime_from_reltime(&converted, CLOCK_REALTIME, &reltime);
+		abstime = &converted;
+	}
+
+	return pi_futex(skinny, FUTEX_CMD(FUTEX_LOCK_PI), abstime);
+}
+
+/* Release a mutex we hold, preserving the flags in the upper half of
+ * the word, apart from HOLDER_FLAG. */
+static int pi_release(skinny_mutex_t *skinny)
+{
+	for (;;) {
+		void *val = skinny->val;
+
+		if ((uintptr_t)val & FUTEX_WAITERS) {
+			if (((uintptr_t)val & HOLDER_FLAG)
+			    && !cas(&skinny->val, val,
+				    (void *)((uintptr_t)val & ~HOLDER_FLAG)))
+				continue;
+
+			return pi_futex(skinny, FUTEX_CMD(FUTEX_UNLOCK_PI),
+					NULL);
+		}
+
+		if (cas(&skinny->val, val, (void *)((uintptr_t)val
+						    & ~(FUTEX_BITS
+							| HOLDER_FLAG))))
+			return 0;
+	}
+}
+
+/* Having acquired a mutex with COND_RELEASED_FLAG set, wait for the
+ * thread that set it to block on its condition variable. */
+static int cond_released_sync(skinny_mutex_t *skinny)
+{
+	pthread_mutex_t *side = side_mutex(skinny);
+	void *val;
+	int res = pthread_mutex_lock(side);
+	if (res)
+		return res;
+
+	res = pthread_mutex_unlock(side);
+
+	/* The kernel might be setting FUTEX_WAITERS. */
+	do
+		val = skinny->val;
+	while (!cas(&skinny->val, val,
+		    (void *)((uintptr_t)val & ~COND_RELEASED_FLAG)));
+
+	return res;
+}
+
+/* The result of acquiring a mutex through the kernel. */
+static int pi_acquired(skinny_mutex_t *skinny)
+{
+	void *val = skinny->val;
+	int res;
+
+	if ((uintptr_t)val & NOT_RECOVERABLE_FLAG) {
+		/* We were handed it by the kernel.  Pass it on. */
+		res = pi_release(skinny);
+		return res ? res : ENOTRECOVERABLE;
+	}
+
+	if (HOLDER_FLAG) {
+		/* If HOLDER_FLAG is still set, the previous holder
+		   never released the mutex. */
+		uintptr_t new_val;
+
+		for (;;) {
+			new_val = (uintptr_t)val | HOLDER_FLAG;
+			if ((uintptr_t)val & HOLDER_FLAG)
+				new_val |= FUTEX_OWNER_DIED;
+
+			if (cas(&skinny->val, val, (void *)new_val))
+				break;
+
+			val = skinny->val;
+		}
+
+		val = (void *)new_val;
+	}
+
+	return ((uintptr_t)val & FUTEX_OWNER_DIED) ? EOWNERDEAD : 0;
+}
+
+static int pi_mutex_lock(skinny_mutex_t *skinny, const void *site,
+			 clockid_t clock, const struct timespec *abstime)
+{
+	void *self = skinny_mutex_held_();
+	long long start;
+	int res;
+
+	stats_enter(skinny, site);
+	stats_slow_lock();
+	probe(lock_slow, skinny, NULL);
+
+	for (;;) {
+		void *val = skinny->val;
+
+		if ((uintptr_t)val & NOT_RECOVERABLE_FLAG) {
+			return ENOTRECOVERABLE;
+		}
+		else if (!val) {
+			if (cas(&skinny->val, val, self))
+				return 0;
+		}
+		else if (val == COND_RELEASED) {
+			res = cond_released_acquire(skinny, self);
+			if (res >= 0)
+				return res;
+		}
+		else if (PI_OWNER(val) == PI_OWNER(self)) {
+			return EDEADLK;
+		}
+		else {
+			break;
+		}
+	}
+
+	start = stats_now();
+	probe(block, skinny, NULL);
+
+	/* EAGAIN means that the holder is exiting. */
+	for (;;) {
+		uintptr_t owner = PI_OWNER(skinny->val);
+
+		res = robust_lock_failed(skinny, owner, abstime,
+					 pi_lock(skinny, clock, abstime));
+		if (res != EINTR && res != EAGAIN)
+			break;
+	}
+
+	if (res)
+		return res;
+
+	if ((uintptr_t)skinny->val & COND_RELEASED_FLAG)
+		res = cond_released_sync(skinny);
+
+	if (!res)
+		res = pi_acquired(skinny);
+
+	probe(acquired, skinny, NULL);
+	stats_wait(start);
+	return res;
+}
+
+static int mutex_lock_slow(skinny_mutex_t *skinny, const void *site,
+			   clockid_t clock, const struct timespec *abstime)
+{
+	return pi_mutex_lock(skinny, site, clock, abstime);
+}
+
+static int pi_mutex_trylock(skinny_mutex_t *skinny, const void *site)
+{
+	void *self = skinny_mutex_held_();
+
+	stats_enter(skinny, site);
+
+	for (;;) {
+		void *val = skinny->val;
+		int res;
+
+		if ((uintptr_t)val & NOT_RECOVERABLE_FLAG) {
+			return ENOTRECOVERABLE;
+		}
+		else if (!val) {
+			if (cas(&skinny->val, val, self))
+				return 0;
+		}
+		else if (val == COND_RELEASED) {
+			res = cond_released_acquire(skinny, self);
+			if (res >= 0)
+				return res;
+		}
+		else if (!((uintptr_t)val & (FUTEX_WAITERS
+					     | COND_RELEASED_FLAG))
+			 && robust_owner_dead(val)) {
+			/* With nobody blocked in the kernel, we can take
+			   it over as FUTEX_LOCK_PI would. */
+			res = robust_take_over(skinny, PI_OWNER(val));
+			if (res != EAGAIN)
+				return res ? res : pi_acquired(skinny);
+		}
+		else {
+			stats_trylock_failure();
+			return EBUSY;
+		}
+	}
+}
+
+int skinny_mutex_trylock(skinny_mutex_t *skinny)
+{
+	return pi_mutex_trylock(skinny, __builtin_return_address(0));
+}
+
+/* Whether the calling thread holds the mutex, in a state it can
+ * release. */
+static int pi_held(void *val)
+{
+	return PI_OWNER(val) == PI_OWNER(skinny_mutex_held_())
+		&& !((uintptr_t)val & COND_RELEASED_FLAG);
+}
+
+/* Called from skinny_mutex_unlock when the word is not just our
+ * thread ID. */
+int skinny_mutex_unlock_slow(skinny_mutex_t *skinny)
+{
+	void *val = skinny->val;
+
+	if (!pi_held(val))
+		return EPERM;
+
+	/* It was never made consistent after its previous holder
+	   died. */
+	if ((uintptr_t)val & FUTEX_OWNER_DIED)
+		do
+			val = skinny->val;
+		while (!cas(&skinny->val, val, (void *)((uintptr_t)val
+					| NOT_RECOVERABLE_FLAG)));
+
+	probe(wake, skinny, NULL);
+	return pi_release(skinny);
+}
+
+int skinny_mutex_consistent(skinny_mutex_t *skinny)
+{
+	void *val;
+
+	do {
+		val = skinny->val;
+		if (!pi_held(val) || !((uintptr_t)val & FUTEX_OWNER_DIED))
+			return EINVAL;
+	} while (!cas(&skinny->val, val,
+		      (void *)((uintptr_t)val & ~(uintptr_t)FUTEX_OWNER_DIED)));
+
+	return 0;
+}
+
+int skinny_mutex_cond_timedwait(pthread_cond_t *cond, skinny_mutex_t *skinny,
+				const struct timespec *abstime)
+{
+	struct cond_wait_cleanup c;
+	void *val = skinny->val;
+	int res = 0;
+
+	if (!pi_held(val))
+		return EPERM;
+
+	/* The mutex has to be made consistent before it can be
+	   released and reacquired. */
+	if ((uintptr_t)val & FUTEX_OWNER_DIED)
+		return EINVAL;
+
+	c.skinny = skinny;
+	c.side = side_mutex(skinny);
+	res = pthread_mutex_lock(c.side);
+	if (res)
+		return res;
+
+	/* Relinquish the mutex, via the kernel if there are waiters. */
+	for (;;) {
+		val = skinny->val;
+
+		if (!((uintptr_t)val & FUTEX_WAITERS)) {
+			if (cas(&skinny->val, val, COND_RELEASED))
+				break;
+		}
+		else if (cas(&skinny->val, val,
+			     (void *)(((uintptr_t)val | COND_RELEASED_FLAG)
+				      & ~HOLDER_FLAG))) {
+			res = pi_futex(skinny, FUTEX_CMD(FUTEX_UNLOCK_PI), NULL);
+			break;
+		}
+	}
+
+	if (res) {
+		pthread_mutex_unlock(c.side);
+		return res;
+	}
+
+	probe(cond_wait, skinny, NULL);
+
+	/* pthread_cond_wait is a cancellation point */
+	pthread_cleanup_push(cond_wait_cleanup, &c);
+
+	if (!abstime)
+		res = pthread_cond_wait(cond, c.side);
+	else
+		res = pthread_cond_timedwait(cond, c.side, abstime);
+
+	pthread_cleanup_pop(1);
+	probe(cond_return, skinny, NULL);
+	return cond_relock_result(res, c.lock_res);
+}
+
+#endif /* SKINNY_MUTEX_PI */
+
+/*
+ * skinny_conds.
+ *
+ * In the word backends, a skinny_cond contains a sequence number in
+ * the bits above bit 0, which is advanced by each signal and
+ * broadcast.  Waiters block until the skinny_cond changes.  Bit 0
+ * is set by waiters, and cleared by broadcasts, so signals and
+ * broadcasts when there are no waiters don't involve any system
+ * calls.
+ *
+ * There is nowhere to record the associated skinny_mutex, so woken
+ * threads have to compete to re-acquire it.
+ */
+
+int skinny_cond_destroy(skinny_cond_t *cond)
+{
+	(void)cond;
+	return 0;
+}
+
+int skinny_cond_timedwait(skinny_cond_t *cond, skinny_mutex_t *skinny,
+			  const struct timespec *abstime)
+{
+	void *seq;
+	int res;
+
+	elision_abort(skinny);
+	do {
+		seq = cond->val;
+	} while (!((uintptr_t)seq & 1)
+		 && !cas(&cond->val, seq, (void *)((uintptr_t)seq | 1)));
+
+	seq = (void *)((uintptr_t)seq | 1);
+	res = skinny_mutex_unlock(skinny);
+	if (res)
+		return res;
+
+	res = word_wait(&cond->val, seq, CLOCK_REALTIME, abstime);
+	return cond_relock_result(res, skinny_mutex_lock(skinny));
+}
+
+static int skinny_cond_wake(skinny_cond_t *cond, int all)
+{
+	void *seq;
+	uintptr_t next;
+
+	do {
+		seq = cond->val;
+		if (!((uintptr_t)seq & 1))
+			/* No waiters */
+			return 0;
+
+		next = (uintptr_t)seq + 2;
+		if (all)
+			next &= ~(uintptr_t)1;
+	} while (!cas(&cond->val, seq, (void *)next));
+
+	return word_wake(&cond->val, all);
+}
+
+int skinny_cond_signal(skinny_cond_t *cond)
+{
+	return skinny_cond_wake(cond, 0);
+}
+
+int skinny_cond_broadcast(skinny_cond_t *cond)
+{
+	return skinny_cond_wake(cond, 1);
+}
+
+#endif /* SKINNY_MUTEX_WORD_BACKEND */
+
+/*
+ * Reader-writer locks.
+ *
+ * A skinny_rwlock_t is a pointer-sized word, like a skinny_mutex_t.
+ * The non-contended cases are again simple: If the lock is not held,
+ * it contains 0.  If it is held by a writer, it contains 1.  If it is
+ * held by n readers, it contains (n << 2) | 2.  A compare-and-swap is
+ * used to make all transitions between these states.
+ *
+ * When the lock is contended - a reader finds it held by a writer, or
+ * a writer finds it held at all - it contains a pointer to a
+ * fat_rwlock, or to a chain of pegs leading to one, just as a
+ * skinny_mutex contains a pointer to a fat_mutex.  A fat_rwlock
+ * begins with a fat_mutex, so all the pegging and lifetime logic is
+ * shared.  The fat_mutex's held flag indicates whether a writer holds
+ * the lock, its waiters and held_cond are used for waiting writers,
+ * and its refcount includes pseudo-references from each holding
+ * thread (reader or writer).
+ *
+ * Writers are preferred: A reader will not join a read-locked
+ * fat_rwlock while a writer is waiting.  But so that readers are not
+ * starved, when a writer releases the lock, all the readers waiting at
+ * that point are admitted before another writer: they are added to
+ * the count of readers holding the lock before they are woken, so a
+ * writer that arrives before they run finds the lock read-held.
+ */
+
+#define RWLOCK_WRITER ((void *)1)
+#define RWLOCK_IS_READ_LOCKED(val) (((uintptr_t)(val) & 3) == 2)
+#define RWLOCK_ADD_READER(val) ((void *)(((uintptr_t)(val) | 2) + 4))
+#define RWLOCK_READERS(val) ((uintptr_t)(val) >> 2)
+
+static int fat_rwlock_init(void *v_rw)
+{
+	struct fat_rwlock *rw = v_rw;
+	int res = fat_mutex_init(&rw->fat);
+	if (res)
+		return res;
+
+	res = pthread_cond_init(&rw->read_cond, NULL);
+	if (res)
+		fat_mutex_destroy(&rw->fat);
+
+	return res;
+}
+
+static int fat_rwlock_destroy(void *v_rw)
+{
+	struct fat_rwlock *rw = v_rw;
+	int res = fat_mutex_destroy(&rw->fat);
+	if (res)
+		return res;
+
+	return pthread_cond_destroy(&rw->read_cond);
+}
+
+/* Allocate a fat_rwlock and associate it with a skinny_rwlock.
+ *
+ * Arguments and return value as for skinny_mutex_promote.
+ */
+static int skinny_rwlock_promote(skinny_rwlock_t *skinny, void *head,
+				 struct fat_rwlock **rwp)
+{
+	struct fat_rwlock *rw;
+	int res = pool_alloc(SKINNY_MUTEX_POOL_FAT_RWLOCK, (void **)&rw);
+	if (res)
+		return res;
+
+	*rwp = rw;
+	rw->fat.common.peg = 0;
+	rw->fat.held = (head == RWLOCK_WRITER);
+	rw->fat.cond_released = 0;
+	rw->fat.pool = SKINNY_MUTEX_POOL_FAT_RWLOCK;
+	rw->fat.waiters = 0;
+	rw->readers = RWLOCK_IS_READ_LOCKED(head) ? RWLOCK_READERS(head) : 0;
+	rw->read_waiters = 0;
+	rw->read_gen = 0;
+	/* Account for the pseudo-references from the holding
+	   threads. */
+	rw->fat.refcount = rw->fat.held + rw->readers;
+
+	return fat_mutex_install(&skinny->word, head, &rw->fat);
+}
+
+/* Get and lock the fat_rwlock associated with a skinny_rwlock,
+ * allocating it if necessary.
+ *
+ * Arguments and return value as for fat_mutex_get.
+ */
+static int fat_rwlock_get(skinny_rwlock_t *skinny, void *head,
+			  struct fat_rwlock **rwp)
+{
+	struct fat_mutex *fat;
+	int res;
+
+	if (!word_is_pointer(head))
+		return skinny_rwlock_promote(skinny, head, rwp);
+
+	res = fat_mutex_peg(&skinny->word, head, &fat);
+	if (!res)
+		*rwp = (struct fat_rwlock *)fat;
+
+	return res;
+}
+
+/* Wake any threads that can acquire a fat_rwlock following a change
+ * to its state.  "writer_released" indicates that a writer has just
+ * released the lock. */
+static int fat_rwlock_wake(struct fat_rwlock *rw, int writer_released)
+{
+	if (rw->fat.held)
+		return 0;
+
+	if (rw->read_waiters && (writer_released || !rw->fat.waiters)) {
+		rw->readers += rw->read_waiters;
+		rw->read_waiters = 0;
+		rw->read_gen++;
+		return pthread_cond_broadcast(&rw->read_cond);
+	}
+
+	if (!rw->readers && rw->fat.waiters)
+		return pthread_cond_signal(&rw->fat.held_cond);
+
+	return 0;
+}
+
+/* Acquire the read lock on a fat_rwlock.
+ *
+ * The fat_mutex's mutex will be released, so the calling thread
+ * should already be accounted for in the fat_mutex's refcount.
+ */
+static int fat_rwlock_rdlock(skinny_rwlock_t *skinny, struct fat_rwlock *rw)
+{
+	if (rw->fat.held || rw->fat.waiters) {
+		unsigned long gen = rw->read_gen;
+
+		rw->read_waiters++;
+
+		/* Once read_gen changes, fat_rwlock_wake has counted us
+		   among the readers. */
+		do {
+			int res = fat_mutex_wait(&rw->fat, &rw->read_cond);
+			if (res && rw->read_gen == gen) {
+				rw->read_waiters--;
+				return recover(res,
+					       fat_mutex_release(&skinny->word,
+								 &rw->fat));
+			}
+		} while (rw->read_gen == gen);
+
+		return pthread_mutex_unlock(&rw->fat.mutex);
+	}
+
+	rw->readers++;
+	return pthread_mutex_unlock(&rw->fat.mutex);
+}
+
+/* Acquire the write lock on a fat_rwlock.
+ *
+ * The fat_mutex's mutex will be released, so the calling thread
+ * should already be accounted for in the fat_mutex's refcount.
+ */
+static int fat_rwlock_wrlock(skinny_rwlock_t *skinny, struct fat_rwlock *rw)
+{
+	if (rw->fat.held || rw->readers) {
+		rw->fat.waiters++;
+
+		do {
+			int res = fat_mutex_wait(&rw->fat, &rw->fat.held_cond);
+			if (res) {
+				rw->fat.waiters--;
+				res = recover(res, fat_rwlock_wake(rw, 0));
+				return recover(res,
+					       fat_mutex_release(&skinny->word,
+								 &rw->fat));
+			}
+		} while (rw->fat.held || rw->readers);
+
+		rw->fat.waiters--;
+	}
+
+	rw->fat.held = 1;
+	return pthread_mutex_unlock(&rw->fat.mutex);
+}
+
+/* Called from skinny_rwlock_rdlock when the fast path fails. */
+int skinny_rwlock_rdlock_slow(skinny_rwlock_t *skinny)
+{
+	stats_enter(&skinny->word, __builtin_return_address(0));
+
+	for (;;) {
+		void *head = skinny->word.val;
+		if (!head || RWLOCK_IS_READ_LOCKED(head)) {
+			/* Recapitulate skinny_rwlock_rdlock */
+			if (cas(&skinny->word.val, head,
+				RWLOCK_ADD_READER(head)))
+				return 0;
+		}
+		else {
+			struct fat_rwlock *rw;
+			int res = fat_rwlock_get(skinny, head, &rw);
+			if (!res) {
+				rw->fat.refcount++;
+				res = fat_rwlock_rdlock(skinny, rw);
+			}
+
+			if (res >= 0)
+				return res;
+
+			/* skinny_rwlock value changed under us, try
+			   again. */
+		}
+	}
+}
+
+/* Called from skinny_rwlock_wrlock when the fast path fails. */
+int skinny_rwlock_wrlock_slow(skinny_rwlock_t *skinny)
+{
+	stats_enter(&skinny->word, __builtin_return_address(0));
+
+	for (;;) {
+		void *head = skinny->word.val;
+		if (head) {
+			struct fat_rwlock *rw;
+			int res = fat_rwlock_get(skinny, head, &rw);
+			if (!res) {
+				rw->fat.refcount++;
+				res = fat_rwlock_wrlock(skinny, rw);
+			}
+
+			if (res >= 0)
+				return res;
+
+			/* skinny_rwlock value changed under us, try
+			   again. */
+		}
+		else {
+			/* Recapitulate skinny_rwlock_wrlock */
+			if (cas(&skinny->word.val, head, RWLOCK_WRITER))
+				return 0;
+		}
+	}
+}
+
+int skinny_rwlock_tryrdlock(skinny_rwlock_t *skinny)
+{
+	stats_enter(&skinny->word, __builtin_return_address(0));
+
+	for (;;) {
+		void *head = skinny->word.val;
+		struct fat_rwlock *rw;
+		int res;
+
+		if (!head || RWLOCK_IS_READ_LOCKED(head)) {
+			if (cas(&skinny->word.val, head,
+				RWLOCK_ADD_READER(head)))
+				return 0;
+
+			continue;
+		}
+
+		if (head == RWLOCK_WRITER)
+			return EBUSY;
+
+		res = fat_rwlock_get(skinny, head, &rw);
+		if (res > 0)
+			return res;
+		else if (res < 0)
+			/* skinny_rwlock value changed under us, try
+			   again. */
+			continue;
+
+		res = EBUSY;
+		if (!rw->fat.held && !rw->fat.waiters) {
+			rw->readers++;
+			rw->fat.refcount++;
+			res = 0;
+		}
+
+		return recover(res, pthread_mutex_unlock(&rw->fat.mutex));
+	}
+}
+
+int skinny_rwlock_trywrlock(skinny_rwlock_t *skinny)
+{
+	stats_enter(&skinny->word, __builtin_return_address(0));
+
+	for (;;) {
+		void *head = skinny->word.val;
+		struct fat_rwlock *rw;
+		int res;
+
+		if (!head) {
+			if (cas(&skinny->word.val, head, RWLOCK_WRITER))
+				return 0;
+
+			continue;
+		}
+
+		if (!word_is_pointer(head))
+			return EBUSY;
+
+		res = fat_rwlock_get(skinny, head, &rw);
+		if (res > 0)
+			return res;
+		else if (res < 0)
+			/* skinny_rwlock value changed under us, try
+			   again. */
+			continue;
+
+		res = EBUSY;
+		if (!rw->fat.held && !rw->readers) {
+			rw->fat.held = 1;
+			rw->fat.refcount++;
+			res = 0;
+		}
+
+		return recover(res, pthread_mutex_unlock(&rw->fat.mutex));
+	}
+}
+
+/* Called from skinny_rwlock_unlock when the fast path fails. */
+int skinny_rwlock_unlock_slow(skinny_rwlock_t *skinny)
+{
+	stats_enter(&skinny->word, __builtin_return_address(0));
+
+	for (;;) {
+		void *head = skinny->word.val;
+		struct fat_rwlock *rw;
+		int res;
+
+		if (!word_is_pointer(head)) {
+			/* Recapitulate skinny_rwlock_unlock */
+			void *new_val;
+
+			if (head == RWLOCK_WRITER || RWLOCK_READERS(head) == 1)
+				new_val = NULL;
+			else if (RWLOCK_IS_READ_LOCKED(head))
+				new_val = (void *)((uintptr_t)head - 4);
+			else
+				return EPERM;
+
+			if (cas(&skinny->word.val, head, new_val))
+				return 0;
+
+			continue;
+		}
+
+		res = fat_rwlock_get(skinny, head, &rw);
+		if (res > 0)
+			return res;
+		else if (res < 0)
+			/* skinny_rwlock value changed under us, try
+			   again. */
+			continue;
+
+		if (rw->fat.held) {
+			rw->fat.held = 0;
+			res = fat_rwlock_wake(rw, 1);
+		}
+		else if (rw->readers) {
+			rw->readers--;
+			res = fat_rwlock_wake(rw, 0);
+		}
+		else {
+			return recover(EPERM,
+				       pthread_mutex_unlock(&rw->fat.mutex));
+		}
+
+		return recover(res, fat_mutex_release(&skinny->word, &rw->fat));
+	}
+}
+
+struct rwlock_cond_wait_cleanup {
+	skinny_rwlock_t *skinny;
+	struct fat_rwlock *rw;
+	int lock_res;
+};
+
+/* Thread cancallation cleanup handler when waiting for the condition
+   variable below. */
+static void rwlock_cond_wait_cleanup(void *v_c)
+{
+	struct rwlock_cond_wait_cleanup *c = v_c;
+
+	/* Cancellation of pthread_cond_wait should re-acquire the
+	   lock. */
+	c->lock_res = fat_rwlock_wrlock(c->skinny, c->rw);
+}
+
+int skinny_rwlock_cond_timedwait(pthread_cond_t *cond,
+				 skinny_rwlock_t *skinny,
+				 const struct timespec *abstime)
+{
+	struct rwlock_cond_wait_cleanup c;
+	int res;
+
+	/* Get the fat_rwlock, which should be held by this thread as a
+	   writer. */
+	for (;;) {
+		void *head = skinny->word.val;
+		if (head != RWLOCK_WRITER && !word_is_pointer(head))
+			return EPERM;
+
+		res = fat_rwlock_get(skinny, head, &c.rw);
+		if (res > 0)
+			return res;
+		else if (res == 0)
+			break;
+	}
+
+	if (!c.rw->fat.held)
+		return recover(EPERM, pthread_mutex_unlock(&c.rw->fat.mutex));
+
+	/* Relinquish the lock, waking waiters.  But we leave our
+	   reference accounted for in the refcount in place, in order
+	   to pin the fat_rwlock. */
+	c.rw->fat.held = 0;
+	res = fat_rwlock_wake(c.rw, 1);
+	if (res) {
+		c.rw->fat.held = 1;
+		pthread_mutex_unlock(&c.rw->fat.mutex);
+		return res;
+	}
+
+	c.skinny = skinny;
+
+	/* pthread_cond_wait is a cancellation point */
+	pthread_cleanup_push(rwlock_cond_wait_cleanup, &c);
+
+	if (!abstime)
+		res = pthread_cond_wait(cond, &c.rw->fat.mutex);
+	else
+		res = pthread_cond_timedwait(cond, &c.rw->fat.mutex, abstime);
+
+	pthread_cleanup_pop(1);
+	return recover(res, c.lock_res);
+}
+
+int skinny_rwlock_cond_wait(pthread_cond_t *cond, skinny_rwlock_t *skinny)
+{
+	return skinny_rwlock_cond_timedwait(cond, skinny, NULL);
+}
+
+int skinny_mutex_cond_wait(pthread_cond_t *cond, skinny_mutex_t *skinny)
+{
+	return skinny_mutex_cond_timedwait(cond, skinny, NULL);
+}
+
+int skinny_cond_wait(skinny_cond_t *cond, skinny_mutex_t *skinny)
+{
+	return skinny_cond_timedwait(cond, skinny, NULL);
+}
+
+/*
+ * Bit locks.
+ *
+ * A bit lock uses bit 0 of a caller-supplied word as the lock,
+ * leaving the rest of the word alone.  There is no room in the word
+ * to point to a fat_mutex, so the fat_mutexes used to wait for bit
+ * locks live in a fixed side table, indexed by a hash of the address
+ * of the word.
+ *
+ * A fat_mutex in the side table can be shared by several bit locks,
+ * and the bit itself indicates whether a lock is held, so we can't
+ * use fat_mutex_lock.  But waiters queue on the fat_mutex in FIFO
+ * order with their own cond vars, as for a skinny_mutex, noting the
+ * word they are waiting for.  Releasing a bit lock wakes the oldest
+ * waiter for that word, and a waiter becomes starving on the same
+ * terms as described under "Fairness", in which case the releasing
+ * thread sets the bit on its behalf and hands it the lock.
+ *
+ * skinny_bitlock_buckets_ counts the threads waiting in each bucket
+ * of the side table, each count on its own cache line, so that the
+ * inline skinny_bitlock_unlock can avoid consulting the side table
+ * when there are no waiters for bit locks that hash to it.  Waiters
+ * increment the count before trying to set the bit, and
+ * skinny_bitlock_unlock reads it after clearing the bit.  Both are
+ * ordered by the full barriers of the atomic operations on the word,
+ * so either the waiter sees the bit clear, or the releasing thread
+ * sees the waiter.
+ */
+
+struct skinny_bitlock_bucket_ skinny_bitlock_buckets_[SKINNY_BITLOCK_BUCKETS]
+	__attribute__((aligned(64)));
+
+static struct fat_mutex bitlock_buckets[SKINNY_BITLOCK_BUCKETS];
+static pthread_once_t bitlock_buckets_once = PTHREAD_ONCE_INIT;
+
+static void bitlock_buckets_init(void)
+{
+	int i;
+
+	for (i = 0; i < SKINNY_BITLOCK_BUCKETS; i++) {
+		struct fat_mutex *fat = &bitlock_buckets[i];
+
+		check(fat_mutex_init(fat));
+		fat->common.peg = 0;
+		fat->held = 0;
+		fat->waiters = 0;
+		fat->refcount = 0;
+		fat->queue.head = NULL;
+		fat->queue.tail = &fat->queue.head;
+	}
+}
+
+static struct fat_mutex *bitlock_bucket(uintptr_t *word)
+{
+	check(pthread_once(&bitlock_buckets_once, bitlock_buckets_init));
+	return &bitlock_buckets[hash_ptr(word) % SKINNY_BITLOCK_BUCKETS];
+}
+
+/* Called from skinny_bitlock_lock when the fast path fails. */
+int skinny_bitlock_lock_slow(uintptr_t *word)
+{
+	long *waiting = skinny_bitlock_waiting_(word);
+	struct fat_mutex *fat;
+	struct fat_waiter self;
+	unsigned int i;
+	int res;
+
+	/* Spin for a while in case the holder is about to release
+	   it. */
+	for (i = 0; i < spin_limit; i++) {
+		cpu_relax();
+		if (!(*(volatile uintptr_t *)word & 1)
+		    && !(__sync_fetch_and_or(word, 1) & 1))
+			return 0;
+	}
+
+	fat = bitlock_bucket(word);
+	res = pthread_cond_init(&self.cond, NULL);
+	if (res)
+		return res;
+
+	res = pthread_mutex_lock(&fat->mutex);
+	if (res)
+		goto out;
+
+	self.bitlock = word;
+	self.granted = 0;
+	self.starving = !starvation_usecs;
+	self.start = monotonic_usecs();
+	fat_waiter_enqueue(&fat->queue, &self);
+	__sync_fetch_and_add(waiting, 1);
+
+	while (!self.granted && (__sync_fetch_and_or(word, 1) & 1)) {
+		res = fat_mutex_wait(fat, &self.cond);
+		if (res)
+			break;
+
+		if (!self.starving
+		    && monotonic_usecs() - self.start
+					>= (long long)starvation_usecs)
+			self.starving = 1;
+	}
+
+	if (self.granted)
+		/* The bit was set for us, so we hold the lock whatever
+		   happened. */
+		res = 0;
+	else
+		fat_waiter_dequeue(&fat->queue, &self);
+
+	__sync_fetch_and_sub(waiting, 1);
+	res = recover(res, pthread_mutex_unlock(&fat->mutex));
+
+ out:
+	return recover(res, pthread_cond_destroy(&self.cond));
+}
+
+/* Called from skinny_bitlock_unlock when there might be threads
+ * waiting for the lock. */
+int skinny_bitlock_wake(uintptr_t *word)
+{
+	struct fat_mutex *fat = bitlock_bucket(word);
+	struct fat_waiter *w;
+	int res = pthread_mutex_lock(&fat->mutex);
+	if (res)
+		return res;
+
+	/* Other bit locks can share the fat_mutex, so find the oldest
+	   waiter for this one. */
+	for (w = fat->queue.head; w; w = w->next)
+		if (w->bitlock == word)
 			break;
+
+	if (w) {
+		if (w->starving && !(__sync_fetch_and_or(word, 1) & 1)) {
+			fat_waiter_dequeue(&fat->queue, w);
+			w->granted = 1;
 		}
 
-		/* Proceed to the next peg in the chain. */
-		peg = (struct peg *)p;
-		peg_refcount_decr =  1;
+		res = pthread_cond_signal(&w->cond);
 	}
 
-	return res;
+	return recover(res, pthread_mutex_unlock(&fat->mutex));
 }
 
-/* Allocate a fat_mutex and associate it with a skinny_mutex.
- *
- * "skinny" points to the skinny_mutex.
- *
- * "head" is the value previously obtained from the skinny_mutex.
- *
- * "fatp" is used to return the pointer to the locked fat_mutex.
+/*
+ * Sequence locks.
  *
- * Returns 0 on success, a positive error code, or <0 if the
- * skinny_mutex was found to no longer contain "head".
+ * The inline read paths only come here when they find a writer
+ * active.  We spin for a while in case the writer is about to finish,
+ * and then wait for it by acquiring the lock.  That can't return an
+ * odd sequence number, because only writers make it odd, and we
+ * exclude them.  If locking fails, we keep spinning instead, as the
+ * read paths have no way to report errors.
  */
-static int skinny_mutex_promote(skinny_mutex_t *skinny, void *head,
-				struct fat_mutex **fatp)
+
+uintptr_t skinny_seqlock_read_wait(skinny_seqlock_t *s)
 {
-	int res = ENOMEM;
-	struct fat_mutex *fat = malloc(sizeof *fat);
-	*fatp = fat;
-	if (!fat)
-		goto err;
+	unsigned int i;
+	uintptr_t seq;
 
-	fat->common.peg = 0;
-	fat->held = !!head;
-	/* If the skinny_mutex is held, then refcount needs to account
-	   for the pseudo-reference from the holding thread. */
-	fat->refcount = fat->held;
-	fat->waiters = 0;
+	for (i = 0; i < spin_limit; i++) {
+		cpu_relax();
+		seq = skinny_seq_load_(&s->word);
+		if (!(seq & 1))
+			return seq;
+	}
 
-	res = pthread_mutex_init(&fat->mutex, NULL);
-	if (res)
-		goto err_mutex_init;
+	for (;;) {
+		if (!skinny_bitlock_lock(&s->word)) {
+			/* The lock bit is ours, so the rest is stable. */
+			seq = s->word & ~(uintptr_t)1;
+			skinny_bitlock_unlock(&s->word);
+			return seq;
+		}
 
-	res = pthread_cond_init(&fat->held_cond, NULL);
-	if (res)
-		goto err_cond_init;
+		seq = skinny_seq_load_(&s->word);
+		if (!(seq & 1))
+			return seq;
 
-	res = pthread_mutex_lock(&fat->mutex);
-	if (res)
-		goto err_mutex_lock;
+		cpu_relax();
+	}
+}
 
-	/* The fat_mutex is now ready, so try to make the skinny_mutex
-	   point to it. */
-	if (cas(&skinny->val, head, fat))
-		return 0;
+uintptr_t skinny_seqmutex_read_wait(skinny_seqmutex_t *s)
+{
+	unsigned int i;
+	uintptr_t seq;
 
-	res = -1;
-	pthread_mutex_unlock(&fat->mutex);
- err_mutex_lock:
-	pthread_cond_destroy(&fat->held_cond);
- err_cond_init:
-	pthread_mutex_destroy(&fat->mutex);
- err_mutex_init:
-	free(fat);
- err:
-	return res;
+	for (i = 0; i < spin_limit; i++) {
+		cpu_relax();
+		seq = skinny_seq_load_(&s->seq);
+		if (!(seq & 1))
+			return seq;
+	}
+
+	for (;;) {
+		if (!skinny_mutex_lock(&s->mutex)) {
+			seq = s->seq;
+			skinny_mutex_unlock(&s->mutex);
+			return seq;
+		}
+
+		seq = skinny_seq_load_(&s->seq);
+		if (!(seq & 1))
+			return seq;
+
+		cpu_relax();
+	}
 }
 
-/* Get and lock the fat_mutex associated with a skinny_mutex,
- * allocating it if necessary.
- *
- * "skinny" points to the skinny_mutex.
- *
- * "head" is the value that previously seen in the skinny_mutex.
+/*
+ * Locking several mutexes.
  *
- * "fatp" is used to return the pointer to the locked fat_mutex.
+ * We first try to take all the mutexes in address order, which
+ * normally succeeds on the inline fast paths.  If one of them is
+ * held, we release the others and block for that one alone.  Once we
+ * have it, we try the rest again, without blocking.  If another one
+ * is held, we release everything and block on that one, and so on.
  *
- * Returns 0 on success, a positive error code, or <0 if the
- * skinny_mutex value changed so that the operation should be retried.
+ * A mutex acquired with EOWNERDEAD cannot be released without making
+ * it unrecoverable, so we release the others and return holding just
+ * that one, letting the caller repair it and try again.
  */
-static int fat_mutex_get(skinny_mutex_t *skinny, struct common *head,
-			 struct fat_mutex **fatp)
-{
-	if ((uintptr_t)head <= 1)
-		return skinny_mutex_promote(skinny, head, fatp);
-	else
-		return fat_mutex_peg(skinny, head, fatp);
-}
 
-/* Decrement the refcount on a fat_mutex, unlock it, and free it if
-   the conditions are right. */
-static int fat_mutex_release(skinny_mutex_t *skinny, struct fat_mutex *fat)
+static int mutex_ptr_cmp(const void *ap, const void *bp)
 {
-	int keep, res;
+	uintptr_t a = (uintptr_t)*(skinny_mutex_t *const *)ap;
+	uintptr_t b = (uintptr_t)*(skinny_mutex_t *const *)bp;
 
-	assert(!fat->held);
+	return a < b ? -1 : a > b;
+}
 
-	/* If the decremented refcount reaches zero, then we know
-	   there are no secondary peg chains or other threads pinning
-	   the fat_mutex.  And if the skinny_mutex points to the
-	   fat_mutex, then we know that there are no pegs on the
-	   primary chain either.  So if the CAS succeeds in nulling
-	   out the skinny_mutex, we can free the fat_mutex. */
-	keep = (--fat->refcount || !strict_cas(&skinny->val, fat, NULL));
+static int mutex_is_dup(skinny_mutex_t **mutexes, size_t i)
+{
+	return i > 0 && mutexes[i] == mutexes[i - 1];
+}
 
-	res = pthread_mutex_unlock(&fat->mutex);
-	if (keep || res)
-		return res;
+/* The number of mutexes that can be sorted without calling malloc. */
+#define LOCK_MANY_LOCAL 8
 
-	res = pthread_mutex_destroy(&fat->mutex);
-	if (res)
-		return res;
+/* Sort a copy of the caller's array of mutexes by address, using
+   "local" if it is big enough.  The copy is released with
+   mutexes_sorted_free. */
+static int mutexes_sort(skinny_mutex_t *const *mutexes, size_t n,
+			skinny_mutex_t **local, skinny_mutex_t ***sortedp)
+{
+	skinny_mutex_t **sorted = local;
 
-	res = pthread_cond_destroy(&fat->held_cond);
-	if (res)
-		return res;
+	if (n > LOCK_MANY_LOCAL) {
+		sorted = malloc(n * sizeof *sorted);
+		if (!sorted)
+			return ENOMEM;
+	}
 
-	free(fat);
+	memcpy(sorted, mutexes, n * sizeof *sorted);
+	qsort(sorted, n, sizeof *sorted, mutex_ptr_cmp);
+	*sortedp = sorted;
 	return 0;
 }
 
-/* Try to acquire a skinny_mutex with an associated fat_mutex.
- *
- * The fat_mutex's mutex will be released, so the calling thread
- * should already be accounted for in the fat_mutex's refcount.
- */
-static int fat_mutex_lock(skinny_mutex_t *skinny, struct fat_mutex *fat)
+static void mutexes_sorted_free(skinny_mutex_t **sorted,
+				skinny_mutex_t **local)
 {
-	if (fat->held) {
-		/* The mutex is already held, so we have to wait for
-		 * it. */
-		fat->waiters++;
+	if (sorted != local)
+		free(sorted);
+}
 
-		do {
-			int res, old_state, old_state2;
+static int mutex_trylock_fast(skinny_mutex_t *skinny)
+{
+	if (skinny_mutex_fast_lock_(skinny))
+		return 0;
 
-			/* skinny_mutex_lock is not a cancellation
-			   point, but pthread_cond_wait is, so we need
-			   to defer cancellation around it. */
-			assert(!pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,
-						       &old_state));
-			res = pthread_cond_wait(&fat->held_cond, &fat->mutex);
-			assert(!pthread_setcancelstate(old_state, &old_state2));
+	return skinny_mutex_trylock(skinny);
+}
 
-			if (res) {
-				fat->waiters--;
-				return recover(res,
-					       fat_mutex_release(skinny, fat));
-			}
-		} while (fat->held);
+/* Release the first n of the mutexes, other than the one at index
+   "except". */
+static int mutexes_unlock(skinny_mutex_t **mutexes, size_t n, size_t except)
+{
+	size_t i;
+	int res = 0;
 
-		fat->waiters--;
-	}
+	for (i = 0; i < n; i++)
+		if (i != except && !mutex_is_dup(mutexes, i))
+			res = recover(res, skinny_mutex_unlock(mutexes[i]));
 
-	fat->held = 1;
-	return pthread_mutex_unlock(&fat->mutex);
+	return res;
 }
 
-/* Called from skinny_mutex_lock when the fast path fails. */
-int skinny_mutex_lock_slow(skinny_mutex_t *skinny)
+/* Try to acquire all the mutexes other than the one at index "held",
+   which is already held (or n if none is).  On failure, the index of
+   the mutex that could not be acquired is stored in *failed, and only
+   the mutex at "held" remains held.  Except that if the mutex at
+   *failed was acquired with EOWNERDEAD, only it remains held. */
+static int mutexes_trylock(skinny_mutex_t **mutexes, size_t n, size_t held,
+			   size_t *failed)
 {
-	for (;;) {
-		struct common *head = skinny->val;
-		if (head) {
-			struct fat_mutex *fat;
-			int res = fat_mutex_get(skinny, head, &fat);
-			if (!res) {
-				fat->refcount++;
-				res = fat_mutex_lock(skinny, fat);
-			}
+	size_t i;
+	int res;
 
-			if (res >= 0)
-				return res;
+	for (i = 0; i < n; i++) {
+		if (i == held || mutex_is_dup(mutexes, i))
+			continue;
 
-			/* skinny_mutex value changed under us, try
-			   again. */
-		}
-		else {
-			/* Recapitulate skinny_mutex_lock */
-			if (cas(&skinny->val, head, (void *)1))
-				return 0;
+		res = mutex_trylock_fast(mutexes[i]);
+		if (res) {
+			*failed = i;
+			res = recover(res, mutexes_unlock(mutexes, i, held));
+			if (res == EOWNERDEAD && held < n)
+				res = recover(res,
+					      skinny_mutex_unlock(mutexes[held]));
+
+			return res;
 		}
 	}
+
+	return 0;
 }
 
-int skinny_mutex_trylock(skinny_mutex_t *skinny)
+/* Store the index in the caller's array of a mutex that was acquired
+   with EOWNERDEAD. */
+static void mutexes_report_dead(skinny_mutex_t *const *mutexes,
+				skinny_mutex_t *m, size_t *dead)
 {
-	for (;;) {
-		struct common *head = skinny->val;
-		struct fat_mutex *fat;
-		int res;
+	size_t i;
 
-		switch ((uintptr_t)head) {
-		case 0:
-			if (cas(&skinny->val, head, (void *)1))
-				return 0;
+	if (!dead)
+		return;
 
-			break;
+	for (i = 0; mutexes[i] != m; i++)
+		;
 
-		case 1:
-			return EBUSY;
+	*dead = i;
+}
 
-		default:
-			res = fat_mutex_peg(skinny, head, &fat);
-			if (res > 0)
-				return res;
-			else if (res < 0)
-				/* skinny_mutex value changed under us, try
-				   again. */
-				break;
+int skinny_mutex_lock_many(skinny_mutex_t *const *mutexes, size_t n,
+			   size_t *dead)
+{
+	skinny_mutex_t *local[LOCK_MANY_LOCAL], **sorted;
+	size_t held, busy;
+	int res = mutexes_sort(mutexes, n, local, &sorted);
+	if (res)
+		return res;
 
-			res = EBUSY;
-			if (!fat->held) {
-				fat->held = 1;
-				fat->refcount++;
-				res = 0;
-			}
+	res = mutexes_trylock(sorted, n, n, &busy);
+	while (res == EBUSY) {
+		held = busy;
+		res = skinny_mutex_lock(sorted[held]);
+		if (res)
+			break;
 
-			return recover(res,
-				       pthread_mutex_unlock(&fat->mutex));
-		}
+		res = mutexes_trylock(sorted, n, held, &busy);
+		if (res && res != EOWNERDEAD)
+			res = recover(res, skinny_mutex_unlock(sorted[held]));
 	}
+
+	if (res == EOWNERDEAD)
+		mutexes_report_dead(mutexes, sorted[busy], dead);
+
+	mutexes_sorted_free(sorted, local);
+	return res;
 }
 
-/* Get and lock the fat_mutex associated with a skinny_mutex, when
- * this thread is expected to already hold the mutex. */
-static int fat_mutex_get_held(skinny_mutex_t *skinny, struct fat_mutex **fatp)
+int skinny_mutex_trylock_many(skinny_mutex_t *const *mutexes, size_t n,
+			      size_t *dead)
 {
-	for (;;) {
-		int res;
-		struct common *head = skinny->val;
-		if (!head)
-			return EPERM;
+	skinny_mutex_t *local[LOCK_MANY_LOCAL], **sorted;
+	size_t busy;
+	int res = mutexes_sort(mutexes, n, local, &sorted);
+	if (res)
+		return res;
 
-		res = fat_mutex_get(skinny, head, fatp);
-		if (res == 0) {
-			if ((*fatp)->held)
-				return 0;
+	res = mutexes_trylock(sorted, n, n, &busy);
+	if (res == EOWNERDEAD)
+		mutexes_report_dead(mutexes, sorted[busy], dead);
 
-			res = pthread_mutex_unlock(&(*fatp)->mutex);
-			if (res)
-				return res;
+	mutexes_sorted_free(sorted, local);
+	return res;
+}
 
-			return EPERM;
-		}
+/* Unlocking must not fail for want of memory, so rather than sorting,
+   this skips duplicates by searching the earlier entries. */
+int skinny_mutex_unlock_many(skinny_mutex_t *const *mutexes, size_t n)
+{
+	size_t i, j;
+	int res = 0;
 
-		if (res >= 0)
-			return res;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i && mutexes[j] != mutexes[i]; j++)
+			;
+
+		if (j == i) {
+			int res2 = skinny_mutex_unlock(mutexes[i]);
+			if (!res)
+				res = res2;
+		}
 	}
+
+	return res;
 }
 
-/* Called from skinny_mutex_unlock when the fast path fails. */
-int skinny_mutex_unlock_slow(skinny_mutex_t *skinny)
+/*
+ * Mutex arrays.
+ *
+ * The index of the mutex for a key is the top bits of the product of
+ * the key's hash and SKINNY_MUTEX_ARRAY_HASH_MUL.  So sorting hashes
+ * by that product also sorts them by index, and brings together
+ * hashes that share a mutex.
+ */
+
+int skinny_mutex_array_init(skinny_mutex_array_t *a, size_t count,
+			    int flags)
 {
-	struct fat_mutex *fat;
-	int res = fat_mutex_get_held(skinny, &fat);
+	unsigned int bits = 0;
+	size_t stride;
+	void *base;
 
-	if (res)
-		return res;
+	if (!count || (count & (count - 1))
+	    || (flags & ~SKINNY_MUTEX_ARRAY_PADDED))
+		return EINVAL;
 
-	fat->held = 0;
-	res = 0;
-	if (fat->waiters)
-		/* Wake a single waiter. */
-		res = pthread_cond_signal(&fat->held_cond);
+	stride = (flags & SKINNY_MUTEX_ARRAY_PADDED)
+		? SKINNY_MUTEX_CACHE_LINE : sizeof(skinny_mutex_t);
+	if (count > SIZE_MAX / stride)
+		return ENOMEM;
 
-	return recover(res, fat_mutex_release(skinny, fat));
-}
+	/* Anonymous mappings are zero-filled, and a zeroed
+	   skinny_mutex is unlocked. */
+	base = mmap(NULL, count * stride, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return errno;
 
-struct cond_wait_cleanup {
-	skinny_mutex_t *skinny;
-	struct fat_mutex *fat;
-	int lock_res;
-};
+	while (((size_t)1 << bits) < count)
+		bits++;
 
-/* Thread cancallation cleanup handler when waiting for the condition
-   variable below. */
-static void cond_wait_cleanup(void *v_c)
+	a->base = base;
+	a->count = count;
+	a->stride = stride;
+
+	/* With a single mutex, the mask in skinny_mutex_array_for_key
+	   discards the remaining bit. */
+	a->shift = sizeof(size_t) * CHAR_BIT - (bits ? bits : 1);
+	return 0;
+}
+
+int skinny_mutex_array_destroy(skinny_mutex_array_t *a)
 {
-	struct cond_wait_cleanup *c = v_c;
+	size_t i;
 
-	/* Cancellation of pthread_cond_wait should re-acquire the
-	   mutex. */
-	c->lock_res = fat_mutex_lock(c->skinny, c->fat);
+	for (i = 0; i < a->count; i++)
+		if (skinny_mutex_array_get(a, i)->val)
+			return EBUSY;
+
+	if (munmap(a->base, a->count * a->stride))
+		return errno;
+
+	a->base = NULL;
+	return 0;
 }
 
-int skinny_mutex_cond_timedwait(pthread_cond_t *cond, skinny_mutex_t *skinny,
-				const struct timespec *abstime)
+int skinny_mutex_array_lock_keys(skinny_mutex_array_t *a, size_t n,
+				 const size_t *hashes)
 {
-	struct cond_wait_cleanup c;
-	int res = fat_mutex_get_held(skinny, &c.fat);
-	if (res)
-		return res;
+	skinny_mutex_t *local[LOCK_MANY_LOCAL], **sorted = local;
+	size_t i;
+	int res = 0;
 
-	/* We will release the lock, so wake a waiter */
-	if (c.fat->waiters) {
-		res = pthread_cond_signal(&c.fat->held_cond);
-		if (res) {
-			pthread_mutex_unlock(&c.fat->mutex);
-			return res;
-		}
+	if (n > LOCK_MANY_LOCAL) {
+		sorted = malloc(n * sizeof *sorted);
+		if (!sorted)
+			return ENOMEM;
 	}
 
-       /* Relinquish the mutex.  But we leave our reference accounted
-          for in fat->refcount in place, in order to pin the
-          fat_mutex. */
-	c.fat->held = 0;
+	/* The mutexes lie in array order, so sorting them by address
+	   gives a consistent locking order, and brings together keys
+	   that share a mutex. */
+	for (i = 0; i < n; i++)
+		sorted[i] = skinny_mutex_array_for_key(a, hashes[i]);
 
-	/* pthread_cond_wait is a cancellation point */
-	pthread_cleanup_push(cond_wait_cleanup, &c);
+	qsort(sorted, n, sizeof *sorted, mutex_ptr_cmp);
 
-	if (!abstime)
-		res = pthread_cond_wait(cond, &c.fat->mutex);
-	else
-		res = pthread_cond_timedwait(cond, &c.fat->mutex, abstime);
+	for (i = 0; i < n; i++) {
+		if (mutex_is_dup(sorted, i))
+			continue;
 
-	pthread_cleanup_pop(1);
-	return recover(res, c.lock_res);
+		res = skinny_mutex_lock(sorted[i]);
+		if (res) {
+			res = recover(res, mutexes_unlock(sorted, i, n));
+			break;
+		}
+	}
+
+	mutexes_sorted_free(sorted, local);
+	return res;
 }
 
-int skinny_mutex_cond_wait(pthread_cond_t *cond, skinny_mutex_t *skinny)
+/* As with skinny_mutex_unlock_many, this skips keys sharing a mutex
+   with an earlier key by searching, rather than sorting. */
+int skinny_mutex_array_unlock_keys(skinny_mutex_array_t *a, size_t n,
+				   const size_t *hashes)
 {
-	return skinny_mutex_cond_timedwait(cond, skinny, NULL);
+	size_t i, j;
+	int res = 0;
+
+	for (i = 0; i < n; i++) {
+		skinny_mutex_t *m = skinny_mutex_array_for_key(a, hashes[i]);
+
+		for (j = 0; j < i; j++)
+			if (skinny_mutex_array_for_key(a, hashes[j]) == m)
+				break;
+
+		if (j == i) {
+			int res2 = skinny_mutex_unlock(m);
+			if (!res)
+				res = res2;
+		}
+	}
+
+	return res;
 }
@@ -4,11 +4,45 @@
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Atomic operations for the inline fast paths.  Where the compiler
+   provides the __atomic built-ins, acquiring a lock only needs
+   acquire ordering, and releasing it only needs release ordering.
+   Otherwise, or if SKINNY_MUTEX_SYNC_BUILTINS is defined, we use the
+   __sync built-ins, which are full barriers. */
+
+#if defined(__ATOMIC_ACQUIRE) && !defined(SKINNY_MUTEX_SYNC_BUILTINS)
+#define SKINNY_MUTEX_ATOMIC_BUILTINS
+#endif
+
+static __inline__ int skinny_atomic_cas_acquire(void **p, void *old,
+						void *val)
+{
+#ifdef SKINNY_MUTEX_ATOMIC_BUILTINS
+	return __atomic_compare_exchange_n(p, &old, val, 0, __ATOMIC_ACQUIRE,
+					   __ATOMIC_RELAXED);
+#else
+	return __sync_bool_compare_and_swap(p, old, val);
+#endif
+}
+
+static __inline__ int skinny_atomic_cas_release(void **p, void *old,
+						void *val)
+{
+#ifdef SKINNY_MUTEX_ATOMIC_BUILTINS
+	return __atomic_compare_exchange_n(p, &old, val, 0, __ATOMIC_RELEASE,
+					   __ATOMIC_RELAXED);
+#else
+	return __sync_bool_compare_and_swap(p, old, val);
+#endif
+}
+
 typedef struct {
 	void *val;
 } skinny_mutex_t;
@@ -26,13 +60,89 @@ static __inline__ int skinny_mutex_destroy(skinny_mutex_t *m)
 
 #define SKINNY_MUTEX_INITIALIZER { (void *)0 }
 
+/* The value of a held, uncontended mutex.  With SKINNY_MUTEX_PI,
+   which requires the futex backend, this is the thread ID of the
+   holder, as the kernel's priority-inheriting futexes need to know
+   which thread to boost.  With SKINNY_MUTEX_ROBUST, which requires
+   SKINNY_MUTEX_PI, the holder also sets a flag in the upper half of
+   the word, which it clears when it releases the mutex, so that the
+   next thread to acquire it can tell whether the holder died. */
+
+#ifdef SKINNY_MUTEX_ROBUST
+#define SKINNY_MUTEX_HOLDER_FLAG_ ((uintptr_t)1 << 34)
+#else
+#define SKINNY_MUTEX_HOLDER_FLAG_ ((uintptr_t)0)
+#endif
+
+#ifndef SKINNY_MUTEX_PI
+
+static __inline__ void *skinny_mutex_held_(void)
+{
+	return (void *)1;
+}
+
+#else
+
+extern __thread uintptr_t skinny_mutex_tid_;
+uintptr_t skinny_mutex_tid_init(void);
+
+static __inline__ void *skinny_mutex_held_(void)
+{
+	uintptr_t tid = skinny_mutex_tid_;
+
+	if (__builtin_expect(!tid, 0))
+		tid = skinny_mutex_tid_init();
+
+	return (void *)(tid | SKINNY_MUTEX_HOLDER_FLAG_);
+}
+
+#endif
+
+/* The inline fast paths: a single compare-and-swap to acquire an
+   unheld mutex, or release an uncontended one. */
+
+static __inline__ int skinny_mutex_fast_lock_(skinny_mutex_t *m)
+{
+	return skinny_atomic_cas_acquire(&m->val, (void *)0,
+					 skinny_mutex_held_());
+}
+
+static __inline__ int skinny_mutex_fast_unlock_(skinny_mutex_t *m)
+{
+	return skinny_atomic_cas_release(&m->val, skinny_mutex_held_(),
+					 (void *)0);
+}
+
+/* With SKINNY_MUTEX_ELISION, skinny_mutex_lock first tries to run
+   the critical section as a hardware transaction, leaving the word 0,
+   on CPUs found to support it at run time.  So a mutex held with the
+   word 0 has been elided, and is released by committing the
+   transaction. */
+
+#ifdef SKINNY_MUTEX_ELISION
+extern int skinny_mutex_elision_;
+int skinny_mutex_lock_elide_(skinny_mutex_t *m);
+int skinny_mutex_unlock_elided_(skinny_mutex_t *m);
+#endif
+
+static __inline__ int skinny_mutex_elide_(skinny_mutex_t *m)
+{
+#ifdef SKINNY_MUTEX_ELISION
+	return skinny_mutex_elision_ && skinny_mutex_lock_elide_(m);
+#else
+	(void)m;
+	return 0;
+#endif
+}
+
 int skinny_mutex_lock_slow(skinny_mutex_t *m);
 
 static __inline__ int skinny_mutex_lock(skinny_mutex_t *m)
 {
-	if (__builtin_expect(__sync_bool_compare_and_swap(&m->val,
-							  (void *)0, (void *)1),
-			     1))
+	if (skinny_mutex_elide_(m))
+		return 0;
+
+	if (__builtin_expect(skinny_mutex_fast_lock_(m), 1))
 		return 0;
 	else
 		return skinny_mutex_lock_slow(m);
@@ -40,21 +150,669 @@ static __inline__ int skinny_mutex_lock(skinny_mutex_t *m)
 
 int skinny_mutex_unlock_slow(skinny_mutex_t *m);
 
+#ifndef SKINNY_MUTEX_XCHG_UNLOCK
+
 static __inline__ int skinny_mutex_unlock(skinny_mutex_t *m)
 {
-	if (__builtin_expect(__sync_bool_compare_and_swap(&m->val,
-							  (void *)1, (void *)0),
-			     1))
+#ifdef SKINNY_MUTEX_ELISION
+	/* Even a failed compare-and-swap would write the word inside a
+	   transaction, and abort all the other threads eliding the
+	   mutex. */
+	if (!m->val)
+		return skinny_mutex_unlock_elided_(m);
+#endif
+
+	if (__builtin_expect(skinny_mutex_fast_unlock_(m), 1))
 		return 0;
 	else
 		return skinny_mutex_unlock_slow(m);
 }
 
+#else
+
+/* With SKINNY_MUTEX_XCHG_UNLOCK, which requires one of the futex or
+   parking lot backends, unlocking unconditionally exchanges the word
+   with 0, and then deals with the previous value if the mutex was
+   contended. */
+
+int skinny_mutex_unlock_wake(skinny_mutex_t *m, void *old);
+
+static __inline__ int skinny_mutex_unlock(skinny_mutex_t *m)
+{
+	void *old;
+
+#ifdef SKINNY_MUTEX_ATOMIC_BUILTINS
+	old = __atomic_exchange_n(&m->val, (void *)0, __ATOMIC_RELEASE);
+#else
+	do
+		old = m->val;
+	while (!__sync_bool_compare_and_swap(&m->val, old, (void *)0));
+#endif
+
+	if (__builtin_expect(old == (void *)1, 1))
+		return 0;
+	else
+		return skinny_mutex_unlock_wake(m, old);
+}
+
+#endif
+
 int skinny_mutex_trylock(skinny_mutex_t *m);
+
+/* Like pthread_mutex_timedlock, give up with ETIMEDOUT at the
+   absolute CLOCK_REALTIME time abstime. */
+int skinny_mutex_timedlock(skinny_mutex_t *m, const struct timespec *abstime);
+
+/* Give up with ETIMEDOUT once reltime has elapsed, measured on
+   CLOCK_MONOTONIC, so unaffected by changes to the system time. */
+int skinny_mutex_reltimedlock(skinny_mutex_t *m,
+			      const struct timespec *reltime);
+
+/* With SKINNY_MUTEX_ROBUST, if the holder of a mutex dies, the next
+   thread to acquire it gets EOWNERDEAD from skinny_mutex_lock (or
+   any of the functions that acquire a mutex), holding the mutex.
+   Like pthread_mutex_consistent, skinny_mutex_consistent then marks
+   the state it protects as repaired.  If the mutex is unlocked
+   without that, it can never be acquired again, and locking it fails
+   with ENOTRECOVERABLE.  skinny_mutex_consistent returns EINVAL if
+   the mutex is not held in an inconsistent state, as it always
+   is without SKINNY_MUTEX_ROBUST. */
+int skinny_mutex_consistent(skinny_mutex_t *m);
+
+/* Run fn(arg) while holding the mutex.  When the mutex is contended,
+   the thread holding it might run fn on behalf of the calling thread,
+   so fn should not depend on which thread it runs on. */
+int skinny_mutex_run(skinny_mutex_t *m, void (*fn)(void *), void *arg);
+
+/* A waiter for skinny_mutex_lock_async, provided by the caller,
+   usually embedded in a larger structure.  The fields are private. */
+struct skinny_mutex_async {
+	struct skinny_mutex_async *next;
+	void (*callback)(struct skinny_mutex_async *node);
+	skinny_mutex_t *mutex;
+	long long start;
+	int deferred;
+};
+
+/* Acquire the mutex without blocking the calling thread.  If the
+   mutex is free, it is acquired and 0 is returned.  If it is held,
+   the node is queued and EINPROGRESS is returned.  When the mutex is
+   later handed over to the node, callback(node) is invoked, holding
+   the mutex on its behalf, on the releasing thread, or from a helper
+   thread when the mutex is released by skinny_mutex_cond_wait.  The
+   callback is called from within skinny_mutex_unlock, so it should
+   be short, for instance handing the node to an event loop.  The
+   node must remain valid until then, and a queued node cannot be
+   withdrawn.  The futex and parking lot backends have nowhere to
+   queue the node, so there this returns ENOSYS. */
+int skinny_mutex_lock_async(skinny_mutex_t *m, struct skinny_mutex_async *node,
+			    void (*callback)(struct skinny_mutex_async *node));
+
+/* Like skinny_mutex_lock_async, but callback(node) is always invoked
+   from the helper thread, never from the releasing thread, so it can
+   resume a coroutine directly.  Callbacks run one at a time there,
+   so one that takes long delays the others. */
+int skinny_mutex_lock_async_deferred(skinny_mutex_t *m,
+				     struct skinny_mutex_async *node,
+				     void (*callback)(
+					     struct skinny_mutex_async *node));
+
+/* Lock several mutexes.  They are taken in address order, and a
+   mutex appearing in the array more than once is only locked once.
+   The array is not modified.  The calling thread never blocks while
+   holding some of the mutexes, so these cannot deadlock with each
+   other.  skinny_mutex_trylock_many returns EBUSY, holding none of
+   the mutexes, if any of them is held.  With more than 8 mutexes,
+   the locking functions can fail with ENOMEM; unlocking does not
+   allocate.  With SKINNY_MUTEX_ROBUST, if a mutex is acquired with
+   EOWNERDEAD, they return EOWNERDEAD holding only that mutex, and
+   store its index in the array in *dead if dead is not NULL. */
+int skinny_mutex_lock_many(skinny_mutex_t *const *mutexes, size_t n,
+			   size_t *dead);
+int skinny_mutex_trylock_many(skinny_mutex_t *const *mutexes, size_t n,
+			      size_t *dead);
+int skinny_mutex_unlock_many(skinny_mutex_t *const *mutexes, size_t n);
+
 int skinny_mutex_cond_wait(pthread_cond_t *cond, skinny_mutex_t *m);
 int skinny_mutex_cond_timedwait(pthread_cond_t *cond, skinny_mutex_t *m,
 				const struct timespec *abstime);
 
+/* Condition variables occupying one word, for use with skinny
+   mutexes.  Unlike pthreads condition variables, waiting on a
+   skinny_cond is not a cancellation point.  A skinny_cond may only be
+   used with one skinny_mutex at a time. */
+
+typedef struct {
+	void *val;
+} skinny_cond_t;
+
+static __inline__ int skinny_cond_init(skinny_cond_t *c)
+{
+	c->val = 0;
+	return 0;
+}
+
+#define SKINNY_COND_INITIALIZER { (void *)0 }
+
+int skinny_cond_destroy(skinny_cond_t *c);
+int skinny_cond_wait(skinny_cond_t *c, skinny_mutex_t *m);
+int skinny_cond_timedwait(skinny_cond_t *c, skinny_mutex_t *m,
+			  const struct timespec *abstime);
+int skinny_cond_signal(skinny_cond_t *c);
+int skinny_cond_broadcast(skinny_cond_t *c);
+
+/* Set the maximum number of iterations for which a thread spins
+   before blocking on a held mutex, returning the old value. */
+unsigned int skinny_mutex_set_spin_limit(unsigned int limit);
+
+/* With SKINNY_MUTEX_ELISION, enable or disable lock elision,
+   returning whether it was enabled.  It cannot be enabled on CPUs
+   without transactional memory. */
+int skinny_mutex_set_elision(int enable);
+
+/* With SKINNY_MUTEX_FAULTS, for stress testing, make compare-and-swap
+   operations that the implementation can retry fail spuriously, and
+   make threads yield the CPU before atomic operations, at the given
+   rates per million operations.  Set these before other threads use
+   mutexes.  Returns ENOSYS without SKINNY_MUTEX_FAULTS. */
+int skinny_mutex_set_faults(unsigned int cas_failures, unsigned int yields);
+
+/* Set how long, in microseconds, a thread can wait for a contended
+   mutex before it is handed the mutex directly when it is released,
+   returning the old value.  Zero makes mutexes strictly FIFO. */
+unsigned long skinny_mutex_set_starvation_threshold(unsigned long usecs);
+
+/* With SKINNY_MUTEX_NUMA, set the node that the calling thread is
+   treated as running on, for threads that belong to a node without
+   being bound to its CPUs, or -1 to use the node of the CPU it is
+   running on.  Returns ENOSYS without SKINNY_MUTEX_NUMA. */
+int skinny_mutex_set_numa_node(int node);
+
+/* Reader-writer locks.  The word contains 0 when the lock is not
+   held, 1 when it is held by a writer, and (n << 2) | 2 when it is
+   held by n readers, unless the lock is contended. */
+typedef struct {
+	skinny_mutex_t word;
+} skinny_rwlock_t;
+
+static __inline__ int skinny_rwlock_init(skinny_rwlock_t *l)
+{
+	l->word.val = 0;
+	return 0;
+}
+
+static __inline__ int skinny_rwlock_destroy(skinny_rwlock_t *l)
+{
+	return !l->word.val ? 0 : EBUSY;
+}
+
+#define SKINNY_RWLOCK_INITIALIZER { SKINNY_MUTEX_INITIALIZER }
+
+int skinny_rwlock_rdlock_slow(skinny_rwlock_t *l);
+
+static __inline__ int skinny_rwlock_rdlock(skinny_rwlock_t *l)
+{
+	uintptr_t val = (uintptr_t)l->word.val;
+
+	if (__builtin_expect((!val || (val & 3) == 2)
+			     && skinny_atomic_cas_acquire(&l->word.val,
+							  (void *)val,
+							  (void *)((val | 2) + 4)),
+			     1))
+		return 0;
+	else
+		return skinny_rwlock_rdlock_slow(l);
+}
+
+int skinny_rwlock_wrlock_slow(skinny_rwlock_t *l);
+
+static __inline__ int skinny_rwlock_wrlock(skinny_rwlock_t *l)
+{
+	if (__builtin_expect(skinny_atomic_cas_acquire(&l->word.val,
+						       (void *)0, (void *)1),
+			     1))
+		return 0;
+	else
+		return skinny_rwlock_wrlock_slow(l);
+}
+
+int skinny_rwlock_unlock_slow(skinny_rwlock_t *l);
+
+static __inline__ int skinny_rwlock_unlock(skinny_rwlock_t *l)
+{
+	uintptr_t val = (uintptr_t)l->word.val;
+	uintptr_t new_val = (val == 1 || val == 6) ? 0 : val - 4;
+
+	if (__builtin_expect((val == 1 || (val & 3) == 2)
+			     && skinny_atomic_cas_release(&l->word.val,
+							  (void *)val,
+							  (void *)new_val),
+			     1))
+		return 0;
+	else
+		return skinny_rwlock_unlock_slow(l);
+}
+
+int skinny_rwlock_tryrdlock(skinny_rwlock_t *l);
+int skinny_rwlock_trywrlock(skinny_rwlock_t *l);
+
+/* The lock must be held for writing. */
+int skinny_rwlock_cond_wait(pthread_cond_t *cond, skinny_rwlock_t *l);
+int skinny_rwlock_cond_timedwait(pthread_cond_t *cond, skinny_rwlock_t *l,
+				 const struct timespec *abstime);
+
+/* Bit locks use bit 0 of a caller-supplied word as a lock, leaving
+   the other bits intact.  While the lock is held, the holder may
+   change the other bits, as long as bit 0 remains set. */
+
+/* The number of threads waiting for bit locks in each bucket of the
+   side table they wait in, each count on its own cache line, so that
+   releasing a bit lock only reads its own bucket's count. */
+#define SKINNY_BITLOCK_BUCKETS 256
+
+struct skinny_bitlock_bucket_ {
+	long waiting;
+	char pad_[64 - sizeof(long)];
+};
+
+extern struct skinny_bitlock_bucket_
+	skinny_bitlock_buckets_[SKINNY_BITLOCK_BUCKETS];
+
+static __inline__ unsigned int skinny_bitlock_hash_(const void *p)
+{
+	uintptr_t h = (uintptr_t)p;
+
+	h ^= h >> 15;
+	h *= 0x9e3779b1U;
+	return (unsigned int)(h ^ (h >> 16));
+}
+
+static __inline__ long *skinny_bitlock_waiting_(uintptr_t *word)
+{
+	return &skinny_bitlock_buckets_[skinny_bitlock_hash_(word)
+					% SKINNY_BITLOCK_BUCKETS].waiting;
+}
+
+int skinny_bitlock_lock_slow(uintptr_t *word);
+int skinny_bitlock_wake(uintptr_t *word);
+
+static __inline__ uintptr_t skinny_bitlock_set_(uintptr_t *word)
+{
+#ifdef SKINNY_MUTEX_ATOMIC_BUILTINS
+	return __atomic_fetch_or(word, 1, __ATOMIC_ACQUIRE) & 1;
+#else
+	return __sync_fetch_and_or(word, 1) & 1;
+#endif
+}
+
+static __inline__ int skinny_bitlock_lock(uintptr_t *word)
+{
+	if (__builtin_expect(!skinny_bitlock_set_(word), 1))
+		return 0;
+	else
+		return skinny_bitlock_lock_slow(word);
+}
+
+static __inline__ int skinny_bitlock_trylock(uintptr_t *word)
+{
+	return skinny_bitlock_set_(word) ? EBUSY : 0;
+}
+
+static __inline__ int skinny_bitlock_unlock(uintptr_t *word)
+{
+	/* Clearing the bit and reading the waiting count must not be
+	   reordered, so this needs sequential consistency. */
+#ifdef SKINNY_MUTEX_ATOMIC_BUILTINS
+	if (!(__atomic_fetch_and(word, ~(uintptr_t)1, __ATOMIC_SEQ_CST) & 1))
+		return EPERM;
+
+	if (__builtin_expect(__atomic_load_n(skinny_bitlock_waiting_(word),
+					     __ATOMIC_SEQ_CST) != 0, 0))
+		return skinny_bitlock_wake(word);
+#else
+	if (!(__sync_fetch_and_and(word, ~(uintptr_t)1) & 1))
+		return EPERM;
+
+	if (__builtin_expect(*(volatile long *)skinny_bitlock_waiting_(word)
+			     != 0, 0))
+		return skinny_bitlock_wake(word);
+#endif
+
+	return 0;
+}
+
+/* Sequence locks, for data that is read much more often than it is
+   written.  Writers exclude each other with a lock, and advance a
+   sequence number around their updates.  Readers take no lock, but
+   read the sequence number before and after reading the data, and
+   retry if a writer intervened:
+
+	do {
+		seq = skinny_seqlock_read_begin(&lock);
+		... copy the data ...
+	} while (skinny_seqlock_read_retry(&lock, seq));
+
+   So readers do not write to shared memory, unless they find a
+   writer active, in which case they wait for it on the lock.  A
+   reader can see inconsistent data inside the loop, so it must not
+   follow pointers from the data or otherwise act on it until
+   skinny_seqlock_read_retry returns 0.  Readers that cannot retry
+   can lock out writers with skinny_seqlock_read_lock.
+
+   skinny_seqlock_t is a single word, holding a bit lock in bit 0 and
+   the sequence number in the other bits, so that a writer releasing
+   the lock advances the sequence number in the same atomic
+   operation.  skinny_seqmutex_t instead pairs a skinny_mutex_t with a
+   separate sequence word, so that its writers wait in FIFO order on
+   the mutex, rather than in the shared wait table of bit locks. */
+
+#ifdef SKINNY_MUTEX_ATOMIC_BUILTINS
+#define skinny_seq_load_(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define skinny_seq_load_relaxed_(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define skinny_seq_read_fence_() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define skinny_seq_write_fence_() __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+#define skinny_seq_load_(p) __extension__ ({				\
+	uintptr_t v_ = *(volatile uintptr_t *)(p);			\
+	__sync_synchronize();						\
+	v_; })
+#define skinny_seq_load_relaxed_(p) (*(volatile uintptr_t *)(p))
+#define skinny_seq_read_fence_() __sync_synchronize()
+#define skinny_seq_write_fence_() __sync_synchronize()
+#endif
+
+typedef struct {
+	uintptr_t word;
+} skinny_seqlock_t;
+
+#define SKINNY_SEQLOCK_INITIALIZER { 0 }
+
+uintptr_t skinny_seqlock_read_wait(skinny_seqlock_t *s);
+
+static __inline__ int skinny_seqlock_init(skinny_seqlock_t *s)
+{
+	s->word = 0;
+	return 0;
+}
+
+static __inline__ int skinny_seqlock_destroy(skinny_seqlock_t *s)
+{
+	return (s->word & 1) ? EBUSY : 0;
+}
+
+static __inline__ uintptr_t skinny_seqlock_read_begin(skinny_seqlock_t *s)
+{
+	uintptr_t seq = skinny_seq_load_(&s->word);
+
+	if (__builtin_expect(seq & 1, 0))
+		return skinny_seqlock_read_wait(s);
+
+	return seq;
+}
+
+static __inline__ int skinny_seqlock_read_retry(skinny_seqlock_t *s,
+						uintptr_t seq)
+{
+	skinny_seq_read_fence_();
+	return skinny_seq_load_relaxed_(&s->word) != seq;
+}
+
+static __inline__ int skinny_seqlock_write_lock(skinny_seqlock_t *s)
+{
+	int res = skinny_bitlock_lock(&s->word);
+
+	/* Readers must see the lock bit set before they see any of
+	   our updates. */
+	if (!res)
+		skinny_seq_write_fence_();
+
+	return res;
+}
+
+static __inline__ int skinny_seqlock_write_trylock(skinny_seqlock_t *s)
+{
+	int res = skinny_bitlock_trylock(&s->word);
+
+	if (!res)
+		skinny_seq_write_fence_();
+
+	return res;
+}
+
+static __inline__ int skinny_seqlock_write_unlock(skinny_seqlock_t *s)
+{
+	if (!(skinny_seq_load_relaxed_(&s->word) & 1))
+		return EPERM;
+
+	/* With the lock bit set, adding 1 clears it and carries into
+	   the sequence number.  As for skinny_bitlock_unlock, this
+	   needs sequential consistency. */
+#ifdef SKINNY_MUTEX_ATOMIC_BUILTINS
+	__atomic_fetch_add(&s->word, 1, __ATOMIC_SEQ_CST);
+	if (__builtin_expect(__atomic_load_n(skinny_bitlock_waiting_(&s->word),
+					     __ATOMIC_SEQ_CST) != 0, 0))
+		return skinny_bitlock_wake(&s->word);
+#else
+	__sync_fetch_and_add(&s->word, 1);
+	if (__builtin_expect(*(volatile long *)
+			     skinny_bitlock_waiting_(&s->word) != 0, 0))
+		return skinny_bitlock_wake(&s->word);
+#endif
+
+	return 0;
+}
+
+/* Exclude writers without advancing the sequence number. */
+static __inline__ int skinny_seqlock_read_lock(skinny_seqlock_t *s)
+{
+	return skinny_bitlock_lock(&s->word);
+}
+
+static __inline__ int skinny_seqlock_read_unlock(skinny_seqlock_t *s)
+{
+	return skinny_bitlock_unlock(&s->word);
+}
+
+typedef struct {
+	skinny_mutex_t mutex;
+	uintptr_t seq;
+} skinny_seqmutex_t;
+
+#define SKINNY_SEQMUTEX_INITIALIZER { SKINNY_MUTEX_INITIALIZER, 0 }
+
+uintptr_t skinny_seqmutex_read_wait(skinny_seqmutex_t *s);
+
+static __inline__ int skinny_seqmutex_init(skinny_seqmutex_t *s)
+{
+	s->seq = 0;
+	return skinny_mutex_init(&s->mutex);
+}
+
+static __inline__ int skinny_seqmutex_destroy(skinny_seqmutex_t *s)
+{
+	return skinny_mutex_destroy(&s->mutex);
+}
+
+static __inline__ uintptr_t skinny_seqmutex_read_begin(skinny_seqmutex_t *s)
+{
+	uintptr_t seq = skinny_seq_load_(&s->seq);
+
+	if (__builtin_expect(seq & 1, 0))
+		return skinny_seqmutex_read_wait(s);
+
+	return seq;
+}
+
+static __inline__ int skinny_seqmutex_read_retry(skinny_seqmutex_t *s,
+						 uintptr_t seq)
+{
+	skinny_seq_read_fence_();
+	return skinny_seq_load_relaxed_(&s->seq) != seq;
+}
+
+/* Only the writer holding the mutex changes the sequence number, so
+   it can do so with plain stores, made odd during the update. */
+static __inline__ void skinny_seqmutex_bump_(skinny_seqmutex_t *s)
+{
+	*(volatile uintptr_t *)&s->seq = s->seq + 1;
+}
+
+static __inline__ int skinny_seqmutex_write_lock(skinny_seqmutex_t *s)
+{
+	int res = skinny_mutex_lock(&s->mutex);
+	if (res)
+		return res;
+
+	skinny_seqmutex_bump_(s);
+	skinny_seq_write_fence_();
+	return 0;
+}
+
+static __inline__ int skinny_seqmutex_write_trylock(skinny_seqmutex_t *s)
+{
+	int res = skinny_mutex_trylock(&s->mutex);
+	if (res)
+		return res;
+
+	skinny_seqmutex_bump_(s);
+	skinny_seq_write_fence_();
+	return 0;
+}
+
+static __inline__ int skinny_seqmutex_write_unlock(skinny_seqmutex_t *s)
+{
+	if (!(s->seq & 1))
+		return EPERM;
+
+	skinny_seq_write_fence_();
+	skinny_seqmutex_bump_(s);
+	return skinny_mutex_unlock(&s->mutex);
+}
+
+static __inline__ int skinny_seqmutex_read_lock(skinny_seqmutex_t *s)
+{
+	return skinny_mutex_lock(&s->mutex);
+}
+
+static __inline__ int skinny_seqmutex_read_unlock(skinny_seqmutex_t *s)
+{
+	return skinny_mutex_unlock(&s->mutex);
+}
+
+/* Arrays of skinny mutexes, for striping locks over a data
+   structure.  The array is allocated with mmap, so memory is only
+   paged in as the mutexes are used.  By default the mutexes are
+   packed densely; with SKINNY_MUTEX_ARRAY_PADDED, each occupies its
+   own cache line, so that threads using different mutexes do not
+   contend on the same line. */
+
+#define SKINNY_MUTEX_ARRAY_PADDED 1
+#define SKINNY_MUTEX_CACHE_LINE 64
+
+typedef struct {
+	char *base;
+	size_t count;
+	size_t stride;
+	unsigned int shift;
+} skinny_mutex_array_t;
+
+/* The count must be a power of two. */
+int skinny_mutex_array_init(skinny_mutex_array_t *a, size_t count,
+			    int flags);
+int skinny_mutex_array_destroy(skinny_mutex_array_t *a);
+
+static __inline__ skinny_mutex_t *skinny_mutex_array_get(
+					skinny_mutex_array_t *a, size_t i)
+{
+	return (skinny_mutex_t *)(a->base + i * a->stride);
+}
+
+/* Keys are mapped to mutexes by the top bits of the product of their
+   hash and this multiplier, so hashes of poor quality (such as
+   pointers) are spread over the array. */
+#define SKINNY_MUTEX_ARRAY_HASH_MUL ((size_t)0x9e3779b97f4a7c15ULL)
+
+static __inline__ skinny_mutex_t *skinny_mutex_array_for_key(
+					skinny_mutex_array_t *a, size_t hash)
+{
+	return skinny_mutex_array_get(a, (hash * SKINNY_MUTEX_ARRAY_HASH_MUL)
+					   >> a->shift & (a->count - 1));
+}
+
+/* Lock the mutexes for the keys with the given hashes, in array
+   order, so that concurrent callers cannot deadlock.  A mutex shared
+   by several of the keys is only locked once.  Locking more than a
+   few keys can fail with ENOMEM.  skinny_mutex_array_unlock_keys
+   undoes this, and does not allocate. */
+int skinny_mutex_array_lock_keys(skinny_mutex_array_t *a, size_t n,
+				 const size_t *hashes);
+int skinny_mutex_array_unlock_keys(skinny_mutex_array_t *a, size_t n,
+				   const size_t *hashes);
+
+/* Statistics for the pools from which the internal structures
+   used in the contended case are allocated. */
+struct skinny_mutex_pool_stats {
+	unsigned long allocs;		/* Objects allocated from the pool */
+	unsigned long frees;		/* Objects returned to the pool */
+	unsigned long mallocs;		/* Objects obtained from malloc */
+	unsigned long releases;		/* Objects given back to free */
+	unsigned long depot_gets;	/* Magazines taken from the depot */
+	unsigned long depot_puts;	/* Magazines given to the depot */
+};
+
+#define SKINNY_MUTEX_POOL_PEG 0
+#define SKINNY_MUTEX_POOL_FAT_MUTEX 1
+#define SKINNY_MUTEX_POOL_FAT_RWLOCK 2
+
+int skinny_mutex_pool_stats(int pool, struct skinny_mutex_pool_stats *stats);
+
+/* Contention statistics, collected when skinny_mutex.c is compiled
+   with SKINNY_MUTEX_STATS defined (otherwise these functions return
+   ENOSYS).  Statistics are kept for each call site of the skinny_mutex
+   functions, or for each name given to a mutex by
+   skinny_mutex_stats_name.  Only operations that miss the inline
+   fast paths are counted. */
+
+#define SKINNY_MUTEX_STATS_BUCKETS 32
+
+struct skinny_mutex_stats {
+	/* The call site, or NULL for a named mutex */
+	const void *site;
+	const char *name;
+
+	/* Acquisitions that missed the fast path */
+	unsigned long slow_locks;
+
+	/* Acquisitions that had to block */
+	unsigned long waits;
+
+	/* Allocations of fat mutexes and pegs */
+	unsigned long promotions;
+	unsigned long pegs;
+
+	unsigned long trylock_failures;
+
+	/* Histograms of the times spent blocked, and the times the
+	   mutex was held after being acquired with a fat mutex
+	   present.  Bucket i counts times of at least 2^i ns (and
+	   bucket 0 times under 2ns). */
+	unsigned long wait_ns[SKINNY_MUTEX_STATS_BUCKETS];
+	unsigned long hold_ns[SKINNY_MUTEX_STATS_BUCKETS];
+};
+
+/* Give a mutex a name, under which its statistics are collected
+   regardless of call site.  The name string must remain valid. */
+int skinny_mutex_stats_name(skinny_mutex_t *m, const char *name);
+
+/* Call fn for each set of statistics, stopping if it returns
+   non-zero, and returning that value. */
+int skinny_mutex_stats_iterate(int (*fn)(const struct skinny_mutex_stats *,
+					 void *),
+			       void *arg);
+
+int skinny_mutex_stats_dump(FILE *f);
+int skinny_mutex_stats_reset(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,430 @@
+/* C++ wrappers for skinny mutexes.
+ *
+ * skinny::mutex meets the requirements of Lockable and TimedLockable,
+ * so it can be used with std::lock_guard, std::unique_lock,
+ * std::scoped_lock and std::lock.  Its constructor is constexpr, so
+ * a mutex with static storage duration is constant-initialized, with
+ * no static initialization order issues.
+ *
+ * skinny::condition_variable_any waits with a lock on a skinny::mutex
+ * (or any skinny::basic_mutex), using skinny_mutex_cond_timedwait.
+ *
+ * skinny::basic_mutex takes a policy, fixed at compile time, so that
+ * each kind of mutex gets its own fully inlined fast path (see
+ * skinny::policy).  skinny::mutex uses the default policy.
+ *
+ * With C++20 coroutines, co_await m.lock_async() acquires a
+ * skinny::basic_mutex without blocking the thread (see
+ * skinny_mutex_lock_async_deferred), and co_await m.lock_async(post)
+ * has post(handle) hand the coroutine to an executor instead.
+ *
+ * This requires C++17.
+ */
+
+#ifndef SKINNY_MUTEX_HPP
+#define SKINNY_MUTEX_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+
+#include "skinny_mutex.h"
+
+namespace skinny {
+
+/* The policy for a skinny::basic_mutex.
+ *
+ * SpinBudget is the number of times lock() retries the inline fast
+ * path before calling into the library, which has its own adaptive
+ * spinning (see skinny_mutex_set_spin_limit).  Inline spinning avoids
+ * a function call when critical sections are very short.
+ *
+ * Fair rules out inline spinning, which lets an arriving thread
+ * overtake threads that are already blocked when the mutex is briefly
+ * free between a release and the wakeup of a waiter.  How the library
+ * hands the mutex to blocked threads is controlled by SKINNY_MUTEX_FAIR
+ * and skinny_mutex_set_starvation_threshold.
+ *
+ * Stats allows naming the mutex for the statistics registry, and
+ * removes the name when the mutex is destroyed.  It requires the
+ * library to be built with SKINNY_MUTEX_STATS.
+ */
+template <unsigned SpinBudget = 0, bool Fair = false, bool Stats = false>
+struct policy {
+	static constexpr unsigned spin_budget = SpinBudget;
+	static constexpr bool fair = Fair;
+	static constexpr bool stats = Stats;
+
+	static_assert(!(Fair && SpinBudget),
+		      "a fair policy cannot spin on the fast path");
+};
+
+namespace detail {
+
+inline void cpu_relax() noexcept
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ volatile ("pause" : : : "memory");
+#elif defined(__aarch64__)
+	__asm__ volatile ("yield" : : : "memory");
+#else
+	__asm__ volatile ("" : : : "memory");
+#endif
+}
+
+template <class Duration>
+inline struct timespec to_timespec(Duration d) noexcept
+{
+	auto secs = std::chrono::duration_cast<std::chrono::seconds>(d);
+	auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		d - secs);
+	struct timespec ts;
+
+	if (nsecs.count() < 0) {
+		secs -= std::chrono::seconds(1);
+		nsecs += std::chrono::seconds(1);
+	}
+
+	ts.tv_sec = secs.count();
+	ts.tv_nsec = nsecs.count();
+	return ts;
+}
+
+inline void throw_if(int res)
+{
+	if (res)
+		throw std::system_error(res, std::system_category());
+}
+
+#ifdef __cpp_impl_coroutine
+struct async_node : skinny_mutex_async {
+	std::coroutine_handle<> handle;
+
+	static void resume(skinny_mutex_async *node)
+	{
+		static_cast<async_node *>(node)->handle.resume();
+	}
+};
+
+template <class Post>
+struct posted_async_node : async_node {
+	Post post;
+
+	explicit posted_async_node(Post p) : post(std::move(p)) {}
+
+	static void invoke(skinny_mutex_async *node)
+	{
+		auto *n = static_cast<posted_async_node *>(node);
+		std::coroutine_handle<> h = n->handle;
+
+		/* The coroutine might be resumed before post returns,
+		   destroying the node along with the awaiter. */
+		Post post(std::move(n->post));
+		post(h);
+	}
+};
+#endif
+
+} /* namespace detail */
+
+template <class Policy = policy<> >
+class basic_mutex {
+public:
+	typedef skinny_mutex_t *native_handle_type;
+
+	constexpr basic_mutex() noexcept : m_ SKINNY_MUTEX_INITIALIZER {}
+
+	~basic_mutex()
+	{
+		if constexpr (Policy::stats)
+			skinny_mutex_stats_name(&m_, nullptr);
+
+		skinny_mutex_destroy(&m_);
+	}
+
+	basic_mutex(const basic_mutex &) = delete;
+	basic_mutex &operator=(const basic_mutex &) = delete;
+
+	void lock()
+	{
+		if (skinny_mutex_elide_(&m_))
+			return;
+
+		if (fast_lock())
+			return;
+
+		if constexpr (Policy::spin_budget > 0) {
+			for (unsigned i = 0; i < Policy::spin_budget; i++) {
+				detail::cpu_relax();
+				if (!__atomic_load_n(&m_.val, __ATOMIC_RELAXED)
+				    && fast_lock())
+					return;
+			}
+		}
+
+		detail::throw_if(skinny_mutex_lock_slow(&m_));
+	}
+
+	bool try_lock() noexcept
+	{
+		return !skinny_mutex_trylock(&m_);
+	}
+
+	void unlock() noexcept
+	{
+		skinny_mutex_unlock(&m_);
+	}
+
+	template <class Rep, class Period>
+	bool try_lock_for(const std::chrono::duration<Rep, Period> &d)
+	{
+		struct timespec reltime = detail::to_timespec(
+			d < d.zero() ? d.zero() : d);
+		return timed_result(skinny_mutex_reltimedlock(&m_, &reltime));
+	}
+
+	template <class Clock, class Duration>
+	bool try_lock_until(const std::chrono::time_point<Clock, Duration> &t)
+	{
+		if constexpr (std::is_same<Clock,
+					   std::chrono::system_clock>::value) {
+			struct timespec abstime = detail::to_timespec(
+				t.time_since_epoch());
+			return timed_result(skinny_mutex_timedlock(&m_,
+								   &abstime));
+		}
+		else {
+			return try_lock_for(t - Clock::now());
+		}
+	}
+
+	/* Name the mutex in the statistics (see
+	   skinny_mutex_stats_name).  "name" is not copied. */
+	void name(const char *name)
+	{
+		static_assert(Policy::stats,
+			      "naming a mutex requires a stats policy");
+		detail::throw_if(skinny_mutex_stats_name(&m_, name));
+	}
+
+	native_handle_type native_handle() noexcept
+	{
+		return &m_;
+	}
+
+#ifdef __cpp_impl_coroutine
+	/* The awaitable returned by lock_async.  If the mutex is held,
+	   the coroutine is suspended, and resumed holding the mutex.
+	   Without a Post, it is resumed on the library's helper thread,
+	   rather than on the stack of whichever thread released the
+	   mutex.  With one, post(handle) is called on the releasing
+	   thread, and should hand the coroutine to an executor. */
+	template <class Post = void>
+	class lock_awaiter {
+		using node_type = std::conditional_t<
+			std::is_void_v<Post>, detail::async_node,
+			detail::posted_async_node<Post> >;
+
+	public:
+		template <class... Args>
+		explicit lock_awaiter(basic_mutex &m, Args &&...args)
+			: m_(m), node_(std::forward<Args>(args)...)
+		{
+		}
+
+		bool await_ready() noexcept
+		{
+			return m_.fast_lock();
+		}
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			int res;
+
+			node_.handle = h;
+
+			/* Once the node is queued, the coroutine might be
+			   resumed at any moment, and this object with it. */
+			if constexpr (std::is_void_v<Post>)
+				res = skinny_mutex_lock_async_deferred(
+					&m_.m_, &node_, node_type::resume);
+			else
+				res = skinny_mutex_lock_async(
+					&m_.m_, &node_, node_type::invoke);
+
+			if (res == EINPROGRESS)
+				return true;
+
+			detail::throw_if(res);
+			return false;
+		}
+
+		void await_resume() noexcept {}
+
+	private:
+		basic_mutex &m_;
+		node_type node_;
+	};
+
+	lock_awaiter<> lock_async() noexcept
+	{
+		return lock_awaiter<>(*this);
+	}
+
+	template <class Post>
+	lock_awaiter<std::decay_t<Post> > lock_async(Post &&post)
+	{
+		return lock_awaiter<std::decay_t<Post> >(
+			*this, std::forward<Post>(post));
+	}
+#endif
+
+private:
+	skinny_mutex_t m_;
+
+	bool fast_lock() noexcept
+	{
+		return __builtin_expect(skinny_mutex_fast_lock_(&m_), 1);
+	}
+
+	static bool timed_result(int res)
+	{
+		if (res == ETIMEDOUT)
+			return false;
+
+		detail::throw_if(res);
+		return true;
+	}
+};
+
+typedef basic_mutex<> mutex;
+
+namespace detail {
+
+template <class Policy>
+inline skinny_mutex_t *handle(basic_mutex<Policy> &m) noexcept
+{
+	return m.native_handle();
+}
+
+template <class Mutex>
+inline skinny_mutex_t *handle(std::unique_lock<Mutex> &l) noexcept
+{
+	return handle(*l.mutex());
+}
+
+} /* namespace detail */
+
+/* A condition variable for use with skinny mutexes.  Locks can be a
+   skinny::basic_mutex, or a std::unique_lock of one. */
+class condition_variable_any {
+public:
+	condition_variable_any()
+	{
+		detail::throw_if(pthread_cond_init(&cond_, NULL));
+	}
+
+	~condition_variable_any()
+	{
+		pthread_cond_destroy(&cond_);
+	}
+
+	condition_variable_any(const condition_variable_any &) = delete;
+	condition_variable_any &
+	operator=(const condition_variable_any &) = delete;
+
+	void notify_one() noexcept
+	{
+		pthread_cond_signal(&cond_);
+	}
+
+	void notify_all() noexcept
+	{
+		pthread_cond_broadcast(&cond_);
+	}
+
+	template <class Lock>
+	void wait(Lock &lock)
+	{
+		detail::throw_if(skinny_mutex_cond_wait(&cond_,
+							detail::handle(lock)));
+	}
+
+	template <class Lock, class Predicate>
+	void wait(Lock &lock, Predicate pred)
+	{
+		while (!pred())
+			wait(lock);
+	}
+
+	template <class Lock, class Clock, class Duration>
+	std::cv_status
+	wait_until(Lock &lock,
+		   const std::chrono::time_point<Clock, Duration> &t)
+	{
+		/* The cond var uses the realtime clock, so deadlines on
+		   other clocks are converted, and whether the wait timed
+		   out is decided by the original clock. */
+		auto sys_t = std::chrono::system_clock::now()
+			+ std::chrono::duration_cast<
+				std::chrono::system_clock::duration>(
+					t - Clock::now());
+		struct timespec abstime = detail::to_timespec(
+			sys_t.time_since_epoch());
+		int res = skinny_mutex_cond_timedwait(&cond_,
+						      detail::handle(lock),
+						      &abstime);
+
+		if (res != ETIMEDOUT)
+			detail::throw_if(res);
+
+		return Clock::now() < t ? std::cv_status::no_timeout
+			: std::cv_status::timeout;
+	}
+
+	template <class Lock, class Clock, class Duration, class Predicate>
+	bool wait_until(Lock &lock,
+			const std::chrono::time_point<Clock, Duration> &t,
+			Predicate pred)
+	{
+		while (!pred())
+			if (wait_until(lock, t) == std::cv_status::timeout)
+				return pred();
+
+		return true;
+	}
+
+	template <class Lock, class Rep, class Period>
+	std::cv_status wait_for(Lock &lock,
+				const std::chrono::duration<Rep, Period> &d)
+	{
+		return wait_until(lock, std::chrono::steady_clock::now() + d);
+	}
+
+	template <class Lock, class Rep, class Period, class Predicate>
+	bool wait_for(Lock &lock, const std::chrono::duration<Rep, Period> &d,
+		      Predicate pred)
+	{
+		return wait_until(lock, std::chrono::steady_clock::now() + d,
+				  pred);
+	}
+
+	pthread_cond_t *native_handle() noexcept
+	{
+		return &cond_;
+	}
+
+private:
+	pthread_cond_t cond_;
+};
+
+} /* namespace skinny */
+
+#endif /* SKINNY_MUTEX_HPP */
@@ -0,0 +1,345 @@
+/* Stress test for skinny mutexes.
+ *
+ * Threads hammer a few mutexes with a random mix of lock, trylock,
+ * timed lock, skinny_mutex_run, and waiting on and signalling both
+ * pthreads condition variables and skinny_conds.  When built with
+ * SKINNY_MUTEX_FAULTS, the library meanwhile injects spurious CAS
+ * failures and yields the CPU at random (see skinny_mutex_set_faults),
+ * which drives the fat_mutex and peg lifetime code through paths
+ * that are rare otherwise.
+ *
+ * It checks that only one thread at a time is ever inside a critical
+ * section, that no updates made in critical sections are lost, and
+ * that every peg and fat_mutex allocated has been freed once the
+ * mutexes are destroyed.  Run with -h for the options.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "skinny_mutex.h"
+
+static struct {
+	int threads;
+	int mutexes;
+	long duration_ms;
+	unsigned int cas_failures;
+	unsigned int yields;
+	unsigned int seed;
+} opts;
+
+struct slot {
+	skinny_mutex_t mutex;
+	pthread_cond_t cond;
+	skinny_cond_t skinny_cond;
+	volatile int held;
+	unsigned long count;
+};
+
+struct stress_thread {
+	struct slot *slots;
+	unsigned int seed;
+	unsigned long count;
+	unsigned long ops;
+	pthread_t thread;
+};
+
+static volatile int stop;
+
+/* The critical section */
+static void enter(struct slot *s)
+{
+	assert(!s->held);
+	s->held = 1;
+	s->count++;
+}
+
+static void leave(struct slot *s)
+{
+	assert(s->held);
+	s->held = 0;
+}
+
+struct run_arg {
+	struct slot *slot;
+	struct stress_thread *t;
+};
+
+static void run_cs(void *v_ra)
+{
+	struct run_arg *ra = v_ra;
+
+	enter(ra->slot);
+	ra->t->count++;
+	leave(ra->slot);
+}
+
+/* A deadline a millisecond from now, so that waiters come back even
+   if nobody signals them */
+static struct timespec deadline(void)
+{
+	struct timespec t;
+
+	assert(!clock_gettime(CLOCK_REALTIME, &t));
+	t.tv_nsec += 1000000;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_nsec -= 1000000000;
+		t.tv_sec++;
+	}
+
+	return t;
+}
+
+static void one_op(struct stress_thread *t, struct slot *s, int op)
+{
+	struct timespec ts;
+	struct run_arg ra;
+	int res;
+
+	switch (op) {
+	case 0:
+		assert(!skinny_mutex_lock(&s->mutex));
+		break;
+
+	case 1:
+		res = skinny_mutex_trylock(&s->mutex);
+		if (res) {
+			assert(res == EBUSY);
+			return;
+		}
+
+		break;
+
+	case 2:
+		ts.tv_sec = 0;
+		ts.tv_nsec = 100000;
+		res = skinny_mutex_reltimedlock(&s->mutex, &ts);
+		if (res) {
+			assert(res == ETIMEDOUT);
+			return;
+		}
+
+		break;
+
+	case 3:
+		ra.slot = s;
+		ra.t = t;
+		assert(!skinny_mutex_run(&s->mutex, run_cs, &ra));
+		return;
+
+	case 4:
+		assert(!skinny_mutex_lock(&s->mutex));
+		enter(s);
+		t->count++;
+		leave(s);
+		ts = deadline();
+		res = skinny_mutex_cond_timedwait(&s->cond, &s->mutex, &ts);
+		assert(!res || res == ETIMEDOUT);
+		break;
+
+	case 5:
+		assert(!skinny_mutex_lock(&s->mutex));
+		enter(s);
+		t->count++;
+		leave(s);
+		ts = deadline();
+		res = skinny_cond_timedwait(&s->skinny_cond, &s->mutex, &ts);
+		assert(!res || res == ETIMEDOUT);
+		break;
+
+	default:
+		assert(!skinny_mutex_lock(&s->mutex));
+		if (op & 1) {
+			assert(!pthread_cond_signal(&s->cond));
+			assert(!skinny_cond_signal(&s->skinny_cond));
+		}
+		else {
+			assert(!pthread_cond_broadcast(&s->cond));
+			assert(!skinny_cond_broadcast(&s->skinny_cond));
+		}
+
+		break;
+	}
+
+	enter(s);
+	t->count++;
+	leave(s);
+	assert(!skinny_mutex_unlock(&s->mutex));
+}
+
+static void *stress_thread(void *v_t)
+{
+	struct stress_thread *t = v_t;
+
+	while (!stop) {
+		int r = rand_r(&t->seed);
+		one_op(t, &t->slots[(r >> 4) % opts.mutexes], r & 7);
+		t->ops++;
+	}
+
+	return NULL;
+}
+
+/* Check that the pool has had everything allocated from it
+   returned. */
+static unsigned long check_pool(int pool, const char *name)
+{
+	struct skinny_mutex_pool_stats stats;
+
+	assert(!skinny_mutex_pool_stats(pool, &stats));
+	if (stats.allocs != stats.frees) {
+		fprintf(stderr, "%lu %ss allocated but only %lu freed\n",
+			stats.allocs, name, stats.frees);
+		exit(1);
+	}
+
+	return stats.allocs;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -t N          threads (default %d)\n"
+		"  -m N          mutexes (default %d)\n"
+		"  -d MS         duration (default %ld)\n"
+		"  -c N          CAS failures per million (default %u)\n"
+		"  -y N          yields per million atomic operations\n"
+		"                (default %u)\n"
+		"  -s N          random seed (default from the time)\n",
+		prog, opts.threads, opts.mutexes, opts.duration_ms,
+		opts.cas_failures, opts.yields);
+	exit(1);
+}
+
+static long parse_num(const char *arg, long max, const char *prog)
+{
+	char *end;
+	long val = strtol(arg, &end, 0);
+
+	if (*end || val < 0 || val > max)
+		usage(prog);
+
+	return val;
+}
+
+int main(int argc, char **argv)
+{
+	struct stress_thread *threads;
+	struct slot *slots;
+	struct timespec ts;
+	unsigned long count = 0, ops = 0, fats, pegs;
+	int i, opt, res;
+
+	opts.threads = 8;
+	opts.mutexes = 2;
+	opts.duration_ms = 1000;
+	opts.cas_failures = 100000;
+	opts.yields = 1000;
+	opts.seed = time(NULL);
+
+	while ((opt = getopt(argc, argv, "t:m:d:c:y:s:h")) != -1) {
+		switch (opt) {
+		case 't':
+			opts.threads = parse_num(optarg, 1024, argv[0]);
+			break;
+
+		case 'm':
+			opts.mutexes = parse_num(optarg, 1024, argv[0]);
+			break;
+
+		case 'd':
+			opts.duration_ms = parse_num(optarg, 1L << 30, argv[0]);
+			break;
+
+		case 'c':
+			opts.cas_failures = parse_num(optarg, 1000000, argv[0]);
+			break;
+
+		case 'y':
+			opts.yields = parse_num(optarg, 1000000, argv[0]);
+			break;
+
+		case 's':
+			opts.seed = parse_num(optarg, 0xffffffffL, argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc || !opts.threads || !opts.mutexes)
+		usage(argv[0]);
+
+	res = skinny_mutex_set_faults(opts.cas_failures, opts.yields);
+	if (res == ENOSYS)
+		fprintf(stderr, "Built without SKINNY_MUTEX_FAULTS, "
+			"so no faults will be injected\n");
+	else
+		assert(!res);
+
+	printf("stress: %d threads, %d mutexes, %ldms, seed %u\n",
+	       opts.threads, opts.mutexes, opts.duration_ms, opts.seed);
+
+	slots = malloc(opts.mutexes * sizeof *slots);
+	threads = malloc(opts.threads * sizeof *threads);
+	assert(slots && threads);
+
+	for (i = 0; i < opts.mutexes; i++) {
+		assert(!skinny_mutex_init(&slots[i].mutex));
+		assert(!pthread_cond_init(&slots[i].cond, NULL));
+		assert(!skinny_cond_init(&slots[i].skinny_cond));
+		slots[i].held = 0;
+		slots[i].count = 0;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		threads[i].slots = slots;
+		threads[i].seed = opts.seed + i;
+		threads[i].count = threads[i].ops = 0;
+		assert(!pthread_create(&threads[i].thread, NULL,
+				       stress_thread, &threads[i]));
+	}
+
+	ts.tv_sec = opts.duration_ms / 1000;
+	ts.tv_nsec = opts.duration_ms % 1000 * 1000000;
+	while (nanosleep(&ts, &ts))
+		assert(errno == EINTR);
+
+	stop = 1;
+	for (i = 0; i < opts.threads; i++) {
+		assert(!pthread_join(threads[i].thread, NULL));
+		count += threads[i].count;
+		ops += threads[i].ops;
+	}
+
+	for (i = 0; i < opts.mutexes; i++) {
+		assert(!slots[i].held);
+		count -= slots[i].count;
+		assert(!skinny_mutex_destroy(&slots[i].mutex));
+		assert(!pthread_cond_destroy(&slots[i].cond));
+		assert(!skinny_cond_destroy(&slots[i].skinny_cond));
+	}
+
+	if (count) {
+		fprintf(stderr, "Critical sections were lost\n");
+		return 1;
+	}
+
+	fats = check_pool(SKINNY_MUTEX_POOL_FAT_MUTEX, "fat_mutex");
+	pegs = check_pool(SKINNY_MUTEX_POOL_PEG, "peg");
+	printf("%lu operations, %lu fat_mutexes and %lu pegs, all freed\n",
+	       ops, fats, pegs);
+
+	free(slots);
+	free(threads);
+	return 0;
+}
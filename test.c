@@ -2,6 +2,18 @@
 
 #include <time.h>
 #include <assert.h>
+#include <string.h>
+
+#ifdef SKINNY_MUTEX_PI
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(SKINNY_MUTEX_PSHARED) || defined(SKINNY_MUTEX_ROBUST)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 
 #include "skinny_mutex.h"
 
@@ -135,6 +147,106 @@ static void test_trylock(skinny_mutex_t *mutex)
 	assert(!pthread_join(thread1, NULL));
 }
 
+static void *timedlock_thread(void *v_mutex)
+{
+	skinny_mutex_t *mutex = v_mutex;
+	struct timespec t;
+
+	assert(!clock_gettime(CLOCK_REALTIME, &t));
+	t.tv_nsec += 1000000;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_nsec -= 1000000000;
+		t.tv_sec++;
+	}
+
+	assert(skinny_mutex_timedlock(mutex, &t) == ETIMEDOUT);
+
+	t.tv_sec = 0;
+	t.tv_nsec = 1000000;
+	assert(skinny_mutex_reltimedlock(mutex, &t) == ETIMEDOUT);
+
+	t.tv_nsec = 1000000000;
+	assert(skinny_mutex_reltimedlock(mutex, &t) == EINVAL);
+	return NULL;
+}
+
+static void test_timedlock(skinny_mutex_t *mutex)
+{
+	pthread_t thread;
+	struct timespec t;
+
+	/* Time out while the mutex is held by this thread. */
+	assert(!skinny_mutex_lock(mutex));
+	assert(!pthread_create(&thread, NULL, timedlock_thread, mutex));
+	assert(!pthread_join(thread, NULL));
+	assert(!skinny_mutex_unlock(mutex));
+
+	/* Acquire it before the deadline. */
+	assert(!pthread_create(&thread, NULL, trylock_contender_thread,
+			       mutex));
+	delay();
+	t.tv_sec = 10;
+	t.tv_nsec = 0;
+	assert(!skinny_mutex_reltimedlock(mutex, &t));
+	assert(!skinny_mutex_unlock(mutex));
+	assert(!pthread_join(thread, NULL));
+}
+
+struct test_run {
+	skinny_mutex_t *mutex;
+	int held;
+	int count;
+};
+
+static void run_bump(void *v_tr)
+{
+	struct test_run *tr = v_tr;
+
+	assert(!tr->held);
+	tr->held = 1;
+	tr->count++;
+	tr->held = 0;
+}
+
+static void *run_thread(void *v_tr)
+{
+	struct test_run *tr = v_tr;
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		assert(!skinny_mutex_run(tr->mutex, run_bump, tr));
+
+	return NULL;
+}
+
+static void test_run(skinny_mutex_t *mutex)
+{
+	struct test_run tr;
+	pthread_t threads[4];
+	int i;
+
+	tr.mutex = mutex;
+	tr.held = 0;
+	tr.count = 0;
+
+	/* Closures queued while the mutex is held by skinny_mutex_lock
+	   are run once it is released. */
+	assert(!skinny_mutex_lock(mutex));
+
+	for (i = 0; i < 4; i++)
+		assert(!pthread_create(&threads[i], NULL, run_thread, &tr));
+
+	delay();
+	assert(!skinny_mutex_unlock(mutex));
+
+	for (i = 0; i < 4; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	assert(!skinny_mutex_lock(mutex));
+	assert(tr.count == 4000);
+	assert(!skinny_mutex_unlock(mutex));
+}
+
 struct test_cond_wait {
 	skinny_mutex_t *mutex;
 	pthread_cond_t cond;
@@ -225,120 +337,1487 @@ static void test_cond_wait_cancellation(skinny_mutex_t *mutex)
 	assert(!pthread_cond_destroy(&tcw.cond));
 }
 
+struct test_skinny_cond {
+	skinny_mutex_t *mutex;
+	skinny_cond_t cond;
+	int items;
+	int consumed;
+	int done;
+};
+
+static void *skinny_cond_consumer(void *v_tsc)
+{
+	struct test_skinny_cond *tsc = v_tsc;
+
+	assert(!skinny_mutex_lock(tsc->mutex));
+
+	for (;;) {
+		while (!tsc->items && !tsc->done)
+			assert(!skinny_cond_wait(&tsc->cond, tsc->mutex));
+
+		if (!tsc->items)
+			break;
+
+		tsc->items--;
+		tsc->consumed++;
+	}
+
+	assert(!skinny_mutex_unlock(tsc->mutex));
+	return NULL;
+}
+
+static void test_skinny_cond(skinny_mutex_t *mutex)
+{
+	struct test_skinny_cond tsc;
+	pthread_t threads[4];
+	struct timespec t;
+	int i;
+
+	tsc.mutex = mutex;
+	assert(!skinny_cond_init(&tsc.cond));
+	tsc.items = tsc.consumed = tsc.done = 0;
+
+	for (i = 0; i < 4; i++)
+		assert(!pthread_create(&threads[i], NULL, skinny_cond_consumer,
+				       &tsc));
+
+	for (i = 0; i < 10000; i++) {
+		assert(!skinny_mutex_lock(mutex));
+		tsc.items++;
+		assert(!skinny_cond_signal(&tsc.cond));
+		assert(!skinny_mutex_unlock(mutex));
+	}
+
+	delay();
+	assert(!skinny_mutex_lock(mutex));
+	tsc.done = 1;
+	assert(!skinny_cond_broadcast(&tsc.cond));
+	assert(!skinny_mutex_unlock(mutex));
+
+	for (i = 0; i < 4; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	assert(tsc.consumed == 10000);
+
+	/* Signalling without holding the mutex */
+	tsc.done = 0;
+	assert(!pthread_create(&threads[0], NULL, skinny_cond_consumer, &tsc));
+	delay();
+	assert(!skinny_mutex_lock(mutex));
+	tsc.done = 1;
+	assert(!skinny_mutex_unlock(mutex));
+	assert(!skinny_cond_signal(&tsc.cond));
+	assert(!pthread_join(threads[0], NULL));
+
+	assert(!clock_gettime(CLOCK_REALTIME, &t));
+	t.tv_nsec += 1000000;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_nsec -= 1000000000;
+		t.tv_sec++;
+	}
+
+	assert(!skinny_mutex_lock(mutex));
+	assert(skinny_cond_timedwait(&tsc.cond, mutex, &t) == ETIMEDOUT);
+	assert(!skinny_mutex_unlock(mutex));
+
+	assert(!skinny_cond_destroy(&tsc.cond));
+}
+
 static void test_unlock_not_held(skinny_mutex_t *mutex)
 {
 	assert(skinny_mutex_unlock(mutex) == EPERM);
 }
 
-static void do_test_simple(void (*f)(skinny_mutex_t *m))
+static void test_rwlock_uncontended(void)
 {
-	skinny_mutex_t mutex;
+	static skinny_rwlock_t static_rwlock = SKINNY_RWLOCK_INITIALIZER;
+	skinny_rwlock_t rwlock;
+
+	assert(!skinny_rwlock_wrlock(&static_rwlock));
+	assert(!skinny_rwlock_unlock(&static_rwlock));
+	assert(!skinny_rwlock_destroy(&static_rwlock));
+
+	assert(!skinny_rwlock_init(&rwlock));
+	assert(!skinny_rwlock_rdlock(&rwlock));
+	assert(!skinny_rwlock_rdlock(&rwlock));
+	assert(!skinny_rwlock_tryrdlock(&rwlock));
+	assert(skinny_rwlock_trywrlock(&rwlock) == EBUSY);
+	assert(skinny_rwlock_destroy(&rwlock) == EBUSY);
+	assert(!skinny_rwlock_unlock(&rwlock));
+	assert(!skinny_rwlock_unlock(&rwlock));
+	assert(!skinny_rwlock_unlock(&rwlock));
+	assert(skinny_rwlock_unlock(&rwlock) == EPERM);
+
+	assert(!skinny_rwlock_wrlock(&rwlock));
+	assert(skinny_rwlock_tryrdlock(&rwlock) == EBUSY);
+	assert(skinny_rwlock_trywrlock(&rwlock) == EBUSY);
+	assert(!skinny_rwlock_unlock(&rwlock));
+	assert(!skinny_rwlock_trywrlock(&rwlock));
+	assert(!skinny_rwlock_unlock(&rwlock));
+	assert(!skinny_rwlock_destroy(&rwlock));
+}
 
-	assert(!skinny_mutex_init(&mutex));
-	f(&mutex);
-	assert(!skinny_mutex_destroy(&mutex));
+struct test_rwlock {
+	skinny_rwlock_t rwlock;
+	int readers;
+	int writer;
+	int writes;
+};
+
+static void *rwlock_reader(void *v_tr)
+{
+	struct test_rwlock *tr = v_tr;
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		assert(!skinny_rwlock_rdlock(&tr->rwlock));
+		__sync_fetch_and_add(&tr->readers, 1);
+		assert(!tr->writer);
+		if (!(i % 5))
+			delay();
+		__sync_fetch_and_sub(&tr->readers, 1);
+		assert(!skinny_rwlock_unlock(&tr->rwlock));
+	}
+
+	return NULL;
 }
 
-struct do_test_cond {
-	skinny_mutex_t mutex;
-	pthread_cond_t cond;
-	int phase;
+static void *rwlock_writer(void *v_tr)
+{
+	struct test_rwlock *tr = v_tr;
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		assert(!skinny_rwlock_wrlock(&tr->rwlock));
+		assert(!tr->writer);
+		assert(!tr->readers);
+		tr->writer = 1;
+		if (!(i % 3))
+			delay();
+		tr->writer = 0;
+		tr->writes++;
+		assert(!skinny_rwlock_unlock(&tr->rwlock));
+	}
+
+	return NULL;
+}
+
+static void test_rwlock_contention(void)
+{
+	struct test_rwlock tr;
+	pthread_t threads[8];
+	int i;
+
+	assert(!skinny_rwlock_init(&tr.rwlock));
+	tr.readers = tr.writer = tr.writes = 0;
+
+	assert(!skinny_rwlock_wrlock(&tr.rwlock));
+
+	for (i = 0; i < 8; i++)
+		assert(!pthread_create(&threads[i], NULL,
+				       (i & 1) ? rwlock_writer : rwlock_reader,
+				       &tr));
+
+	delay();
+	assert(!skinny_rwlock_unlock(&tr.rwlock));
+
+	for (i = 0; i < 8; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	assert(tr.writes == 40);
+	assert(!tr.readers);
+	assert(!skinny_rwlock_destroy(&tr.rwlock));
+}
+
+struct test_rwlock_handoff {
+	skinny_rwlock_t rwlock;
+	volatile int started;
+	int readers;
+	volatile int release;
 };
 
-static void *do_test_cond_thread(void *v_dt)
+static void *rwlock_handoff_reader(void *v_trh)
 {
-	struct do_test_cond *dt = v_dt;
+	struct test_rwlock_handoff *trh = v_trh;
 
-	assert(!skinny_mutex_lock(&dt->mutex));
-	dt->phase = 1;
-	assert(!pthread_cond_signal(&dt->cond));
+	__sync_fetch_and_add(&trh->started, 1);
+	assert(!skinny_rwlock_rdlock(&trh->rwlock));
+	__sync_fetch_and_add(&trh->readers, 1);
+	while (!trh->release)
+		delay();
 
-	do {
-		assert(!skinny_mutex_cond_wait(&dt->cond, &dt->mutex));
-	} while (dt->phase != 2);
+	assert(!skinny_rwlock_unlock(&trh->rwlock));
+	return NULL;
+}
 
-	assert(!skinny_mutex_unlock(&dt->mutex));
+/* Readers waiting when a writer releases the lock hold it from that
+   point, before they have even run, so a writer can't slip in ahead
+   of them.  (The readers keep the lock until told to release it, so
+   that it is read-held whether or not they have run yet.) */
+static void test_rwlock_handoff(void)
+{
+	struct test_rwlock_handoff trh;
+	pthread_t threads[2];
+	int i;
+
+	assert(!skinny_rwlock_init(&trh.rwlock));
+	trh.started = 0;
+	trh.readers = 0;
+	trh.release = 0;
+
+	assert(!skinny_rwlock_wrlock(&trh.rwlock));
+	for (i = 0; i < 2; i++)
+		assert(!pthread_create(&threads[i], NULL,
+				       rwlock_handoff_reader, &trh));
+
+	/* Give the readers time to block once they have started. */
+	while (trh.started < 2)
+		delay();
+
+	delay();
+
+	assert(!skinny_rwlock_unlock(&trh.rwlock));
+	assert(skinny_rwlock_trywrlock(&trh.rwlock) == EBUSY);
+
+	trh.release = 1;
+	for (i = 0; i < 2; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	assert(trh.readers == 2);
+	assert(!skinny_rwlock_trywrlock(&trh.rwlock));
+	assert(!skinny_rwlock_unlock(&trh.rwlock));
+	assert(!skinny_rwlock_destroy(&trh.rwlock));
+}
+
+struct test_rwlock_cond {
+	skinny_rwlock_t rwlock;
+	pthread_cond_t cond;
+	int flag;
+};
+
+static void *rwlock_cond_thread(void *v_trc)
+{
+	struct test_rwlock_cond *trc = v_trc;
+
+	assert(!skinny_rwlock_wrlock(&trc->rwlock));
+	while (!trc->flag)
+		assert(!skinny_rwlock_cond_wait(&trc->cond, &trc->rwlock));
+	assert(!skinny_rwlock_unlock(&trc->rwlock));
 
 	return NULL;
 }
 
-/* Run the test with a thread waiting on a cond var associated with the
-   mutex.  This ensures that the skinny mutex has a fat mutex during
-   the text. */
-static void do_test_cond_wait(void (*f)(skinny_mutex_t *m))
+static void test_rwlock_cond_wait(void)
 {
-	struct do_test_cond dt;
+	struct test_rwlock_cond trc;
 	pthread_t thread;
 
-	assert(!skinny_mutex_init(&dt.mutex));
-	assert(!pthread_cond_init(&dt.cond, NULL));
-	dt.phase = 0;
-	assert(!pthread_create(&thread, NULL, do_test_cond_thread, &dt));
+	assert(!skinny_rwlock_init(&trc.rwlock));
+	assert(!pthread_cond_init(&trc.cond, NULL));
+	trc.flag = 0;
 
-	assert(!skinny_mutex_lock(&dt.mutex));
-	while (dt.phase != 1) {
-		assert(!skinny_mutex_cond_wait(&dt.cond, &dt.mutex));
-	};
-	assert(!skinny_mutex_unlock(&dt.mutex));
+	assert(!pthread_create(&thread, NULL, rwlock_cond_thread, &trc));
 
-	f(&dt.mutex);
+	delay();
+	assert(!skinny_rwlock_rdlock(&trc.rwlock));
+	assert(skinny_rwlock_cond_wait(&trc.cond, &trc.rwlock) == EPERM);
+	assert(!skinny_rwlock_unlock(&trc.rwlock));
 
-	assert(!skinny_mutex_lock(&dt.mutex));
-	dt.phase = 2;
-	assert(!pthread_cond_signal(&dt.cond));
-	assert(!skinny_mutex_unlock(&dt.mutex));
+	assert(!skinny_rwlock_wrlock(&trc.rwlock));
+	trc.flag = 1;
+	assert(!pthread_cond_signal(&trc.cond));
+	assert(!skinny_rwlock_unlock(&trc.rwlock));
 
 	assert(!pthread_join(thread, NULL));
-	assert(!skinny_mutex_destroy(&dt.mutex));
-	assert(!pthread_cond_destroy(&dt.cond));
+	assert(!skinny_rwlock_destroy(&trc.rwlock));
+	assert(!pthread_cond_destroy(&trc.cond));
 }
 
-static void *do_test_hammer_thread(void *v_m)
+static void test_bitlock_uncontended(void)
 {
-	skinny_mutex_t *m = v_m;
+	uintptr_t word = 0x100;
+
+	assert(!skinny_bitlock_lock(&word));
+	assert(word == 0x101);
+	assert(skinny_bitlock_trylock(&word) == EBUSY);
+	assert(!skinny_bitlock_unlock(&word));
+	assert(word == 0x100);
+	assert(skinny_bitlock_unlock(&word) == EPERM);
+	assert(!skinny_bitlock_trylock(&word));
+	assert(!skinny_bitlock_unlock(&word));
+	assert(word == 0x100);
+}
 
-	for (;;) {
-		assert(!skinny_mutex_lock(m));
-		assert(!skinny_mutex_unlock(m));
-		pthread_testcancel();
+struct test_bitlock {
+	uintptr_t words[2];
+	int counts[2];
+};
+
+static void *bitlock_thread(void *v_tb)
+{
+	struct test_bitlock *tb = v_tb;
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		int j = i & 1;
+
+		assert(!skinny_bitlock_lock(&tb->words[j]));
+		/* The holder may modify the other bits. */
+		tb->words[j] += 2;
+		tb->counts[j]++;
+		assert(!skinny_bitlock_unlock(&tb->words[j]));
 	}
 
 	return NULL;
 }
 
-/* Run the test with a bunch of other threads hammering on the
-   mutex. */
-static void do_test_hammer(void (*f)(skinny_mutex_t *m))
+static void test_bitlock_contention(void)
 {
-	skinny_mutex_t mutex;
-	pthread_t threads[10];
+	struct test_bitlock tb;
+	pthread_t threads[4];
 	int i;
 
-	assert(!skinny_mutex_init(&mutex));
+	tb.words[0] = tb.words[1] = 0;
+	tb.counts[0] = tb.counts[1] = 0;
 
-	for (i = 0; i < 10; i++)
-		assert(!pthread_create(&threads[i], NULL,
-				       do_test_hammer_thread, &mutex));
+	assert(!skinny_bitlock_lock(&tb.words[0]));
+
+	for (i = 0; i < 4; i++)
+		assert(!pthread_create(&threads[i], NULL, bitlock_thread, &tb));
 
 	delay();
-	f(&mutex);
+	assert(!skinny_bitlock_unlock(&tb.words[0]));
 
-	for (i = 0; i < 10; i++) {
-		void *retval;
-		assert(!pthread_cancel(threads[i]));
-		assert(!pthread_join(threads[i], &retval));
-		assert(retval == PTHREAD_CANCELED);
+	for (i = 0; i < 4; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	assert(tb.counts[0] == 20000 && tb.counts[1] == 20000);
+	assert(tb.words[0] == 40000 && tb.words[1] == 40000);
+	assert(!*skinny_bitlock_waiting_(&tb.words[0]));
+	assert(!*skinny_bitlock_waiting_(&tb.words[1]));
+}
+
+static void *bitlock_handoff_thread(void *v_word)
+{
+	uintptr_t *word = v_word;
+
+	assert(!skinny_bitlock_lock(word));
+	delay();
+	assert(!skinny_bitlock_unlock(word));
+	return NULL;
+}
+
+static void test_bitlock_handoff(void)
+{
+	unsigned long old = skinny_mutex_set_starvation_threshold(0);
+	uintptr_t word = 0;
+	pthread_t thread;
+	int i;
+
+	/* A starving waiter is handed the bit lock, so the releasing
+	   thread can't re-acquire it. */
+	assert(!skinny_bitlock_lock(&word));
+	assert(!pthread_create(&thread, NULL, bitlock_handoff_thread, &word));
+	for (i = 0;; i++) {
+		/* Give the thread a chance to start waiting. */
+		assert(i < 1000);
+		delay();
+		assert(!skinny_bitlock_unlock(&word));
+		if (skinny_bitlock_trylock(&word) == EBUSY)
+			break;
 	}
 
-	assert(!skinny_mutex_destroy(&mutex));
+	assert(!pthread_join(thread, NULL));
+	assert(word == 0);
+	assert(!*skinny_bitlock_waiting_(&word));
+	skinny_mutex_set_starvation_threshold(old);
 }
 
-static void do_test(void (*f)(skinny_mutex_t *m), int hammer)
+static void test_seqlock_uncontended(void)
 {
-	do_test_simple(f);
-	do_test_cond_wait(f);
-	if (hammer)
-		do_test_hammer(f);
+	skinny_seqlock_t sl = SKINNY_SEQLOCK_INITIALIZER;
+	skinny_seqmutex_t sm = SKINNY_SEQMUTEX_INITIALIZER;
+	uintptr_t seq;
+
+	seq = skinny_seqlock_read_begin(&sl);
+	assert(!skinny_seqlock_read_retry(&sl, seq));
+	assert(skinny_seqlock_write_unlock(&sl) == EPERM);
+
+	assert(!skinny_seqlock_write_lock(&sl));
+	assert(skinny_seqlock_write_trylock(&sl) == EBUSY);
+	assert(skinny_seqlock_destroy(&sl) == EBUSY);
+	assert(!skinny_seqlock_write_unlock(&sl));
+	assert(skinny_seqlock_read_retry(&sl, seq));
+	assert(skinny_seqlock_read_begin(&sl) == seq + 2);
+
+	/* Readers that lock don't advance the sequence number. */
+	seq = skinny_seqlock_read_begin(&sl);
+	assert(!skinny_seqlock_read_lock(&sl));
+	assert(!skinny_seqlock_read_unlock(&sl));
+	assert(!skinny_seqlock_read_retry(&sl, seq));
+	assert(!skinny_seqlock_destroy(&sl));
+
+	seq = skinny_seqmutex_read_begin(&sm);
+	assert(skinny_seqmutex_write_unlock(&sm) == EPERM);
+	assert(!skinny_seqmutex_write_trylock(&sm));
+	assert(skinny_seqmutex_write_trylock(&sm) == EBUSY);
+	assert(!skinny_seqmutex_write_unlock(&sm));
+	assert(skinny_seqmutex_read_retry(&sm, seq));
+	assert(skinny_seqmutex_read_begin(&sm) == seq + 2);
+	assert(!skinny_seqmutex_destroy(&sm));
+}
+
+/* Writers keep the two values equal, and readers check that they
+   never see them differ. */
+struct test_seqlock {
+	skinny_seqlock_t sl;
+	skinny_seqmutex_t sm;
+	volatile unsigned long a[2], b[2];
+};
+
+static void *seqlock_writer(void *v_ts)
+{
+	struct test_seqlock *ts = v_ts;
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		assert(!skinny_seqlock_write_lock(&ts->sl));
+		ts->a[0]++;
+		ts->b[0]++;
+		assert(!skinny_seqlock_write_unlock(&ts->sl));
+
+		assert(!skinny_seqmutex_write_lock(&ts->sm));
+		ts->a[1]++;
+		ts->b[1]++;
+		assert(!skinny_seqmutex_write_unlock(&ts->sm));
+	}
+
+	return NULL;
+}
+
+static void *seqlock_reader(void *v_ts)
+{
+	struct test_seqlock *ts = v_ts;
+	unsigned long a, b;
+	uintptr_t seq;
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		do {
+			seq = skinny_seqlock_read_begin(&ts->sl);
+			a = ts->a[0];
+			b = ts->b[0];
+		} while (skinny_seqlock_read_retry(&ts->sl, seq));
+
+		assert(a == b);
+
+		do {
+			seq = skinny_seqmutex_read_begin(&ts->sm);
+			a = ts->a[1];
+			b = ts->b[1];
+		} while (skinny_seqmutex_read_retry(&ts->sm, seq));
+
+		assert(a == b);
+	}
+
+	return NULL;
+}
+
+static void test_seqlock_contention(void)
+{
+	struct test_seqlock ts;
+	pthread_t threads[6];
+	int i;
+
+	assert(!skinny_seqlock_init(&ts.sl));
+	assert(!skinny_seqmutex_init(&ts.sm));
+	ts.a[0] = ts.b[0] = ts.a[1] = ts.b[1] = 0;
+
+	for (i = 0; i < 6; i++)
+		assert(!pthread_create(&threads[i], NULL,
+				       i < 2 ? seqlock_writer : seqlock_reader,
+				       &ts));
+
+	for (i = 0; i < 6; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	assert(ts.a[0] == 20000 && ts.b[0] == 20000);
+	assert(ts.a[1] == 20000 && ts.b[1] == 20000);
+	assert(skinny_seqlock_read_begin(&ts.sl) == 40000);
+	assert(skinny_seqmutex_read_begin(&ts.sm) == 40000);
+	assert(!skinny_seqlock_destroy(&ts.sl));
+	assert(!skinny_seqmutex_destroy(&ts.sm));
+}
+
+struct lock_many_holder {
+	skinny_mutex_t *mutex;
+	volatile int held;
+	volatile int release;
+};
+
+static void *lock_many_holder(void *v_h)
+{
+	struct lock_many_holder *h = v_h;
+
+	assert(!skinny_mutex_lock(h->mutex));
+	h->held = 1;
+	while (!h->release)
+		delay();
+
+	delay();
+	assert(!skinny_mutex_unlock(h->mutex));
+	return NULL;
+}
+
+static void test_lock_many(void)
+{
+	skinny_mutex_t m[3];
+	skinny_mutex_t *ms[4], *many[12];
+	struct lock_many_holder h;
+	pthread_t thread;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		assert(!skinny_mutex_init(&m[i]));
+
+	/* Duplicates are only locked once. */
+	ms[0] = &m[2];
+	ms[1] = &m[0];
+	ms[2] = &m[2];
+	ms[3] = &m[1];
+	assert(!skinny_mutex_lock_many(ms, 4, NULL));
+	assert(ms[0] == &m[2] && ms[1] == &m[0] && ms[2] == &m[2]
+	       && ms[3] == &m[1]);
+	for (i = 0; i < 3; i++)
+		assert(skinny_mutex_trylock(&m[i]) == EBUSY);
+	assert(!skinny_mutex_unlock_many(ms, 4));
+
+	/* If one is held, trylock_many fails holding none of them, and
+	   lock_many waits for it. */
+	h.mutex = &m[1];
+	h.held = h.release = 0;
+	assert(!pthread_create(&thread, NULL, lock_many_holder, &h));
+	while (!h.held)
+		delay();
+
+	assert(skinny_mutex_trylock_many(ms, 4, NULL) == EBUSY);
+	assert(!skinny_mutex_trylock(&m[0]));
+	assert(!skinny_mutex_unlock(&m[0]));
+	h.release = 1;
+	assert(!skinny_mutex_lock_many(ms, 4, NULL));
+	assert(!pthread_join(thread, NULL));
+	assert(!skinny_mutex_unlock_many(ms, 4));
+
+	/* More than fit in the local copy. */
+	for (i = 0; i < 12; i++)
+		many[i] = &m[2 - i % 3];
+	assert(!skinny_mutex_lock_many(many, 12, NULL));
+	assert(many[0] == &m[2]);
+	for (i = 0; i < 3; i++)
+		assert(skinny_mutex_trylock(&m[i]) == EBUSY);
+	assert(!skinny_mutex_unlock_many(many, 12));
+
+	for (i = 0; i < 3; i++)
+		assert(!skinny_mutex_destroy(&m[i]));
+}
+
+struct test_lock_many {
+	skinny_mutex_t mutexes[4];
+	int held[4];
+};
+
+static void *lock_many_thread(void *v_tlm)
+{
+	struct test_lock_many *tlm = v_tlm;
+	unsigned int seed = (unsigned int)(uintptr_t)&seed;
+	int i, j, k;
+
+	for (i = 0; i < 10000; i++) {
+		skinny_mutex_t *ms[3];
+
+		for (j = 0; j < 3; j++) {
+			seed = seed * 1103515245 + 12345;
+			ms[j] = &tlm->mutexes[(seed >> 16) % 4];
+		}
+
+		assert(!skinny_mutex_lock_many(ms, 3, NULL));
+
+		for (j = 0; j < 3; j++) {
+			for (k = 0; k < j && ms[k] != ms[j]; k++)
+				;
+
+			if (k == j) {
+				assert(!tlm->held[ms[j] - tlm->mutexes]);
+				tlm->held[ms[j] - tlm->mutexes] = 1;
+			}
+		}
+
+		for (j = 0; j < 3; j++)
+			tlm->held[ms[j] - tlm->mutexes] = 0;
+
+		assert(!skinny_mutex_unlock_many(ms, 3));
+	}
+
+	return NULL;
+}
+
+static void test_lock_many_contention(void)
+{
+	struct test_lock_many tlm;
+	pthread_t threads[4];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		assert(!skinny_mutex_init(&tlm.mutexes[i]));
+		tlm.held[i] = 0;
+	}
+
+	for (i = 0; i < 4; i++)
+		assert(!pthread_create(&threads[i], NULL, lock_many_thread,
+				       &tlm));
+
+	for (i = 0; i < 4; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	for (i = 0; i < 4; i++)
+		assert(!skinny_mutex_destroy(&tlm.mutexes[i]));
+}
+
+static void test_mutex_array_layout(void)
+{
+	skinny_mutex_array_t a;
+	size_t hashes[5] = { 1, 2, 3, 1, 2 };
+	size_t many[12];
+	size_t i, locked = 0;
+
+	assert(skinny_mutex_array_init(&a, 1000, 0) == EINVAL);
+	assert(skinny_mutex_array_init(&a, 1024, 2) == EINVAL);
+
+	assert(!skinny_mutex_array_init(&a, 1024, 0));
+	assert((char *)skinny_mutex_array_get(&a, 1)
+	       - (char *)skinny_mutex_array_get(&a, 0)
+	       == sizeof(skinny_mutex_t));
+	assert(!skinny_mutex_array_destroy(&a));
+
+	assert(!skinny_mutex_array_init(&a, 1024, SKINNY_MUTEX_ARRAY_PADDED));
+	assert((char *)skinny_mutex_array_get(&a, 1)
+	       - (char *)skinny_mutex_array_get(&a, 0)
+	       == SKINNY_MUTEX_CACHE_LINE);
+
+	/* Duplicate keys are only locked once. */
+	assert(!skinny_mutex_array_lock_keys(&a, 5, hashes));
+	for (i = 0; i < a.count; i++) {
+		skinny_mutex_t *m = skinny_mutex_array_get(&a, i);
+		if (skinny_mutex_trylock(m) == EBUSY)
+			locked++;
+		else
+			assert(!skinny_mutex_unlock(m));
+	}
+
+	/* The caller's hashes are left as they were. */
+	assert(locked == 3);
+	assert(hashes[0] == 1 && hashes[1] == 2 && hashes[2] == 3
+	       && hashes[3] == 1 && hashes[4] == 2);
+	assert(skinny_mutex_array_destroy(&a) == EBUSY);
+	assert(!skinny_mutex_array_unlock_keys(&a, 5, hashes));
+	assert(!skinny_mutex_array_destroy(&a));
+
+	/* More keys than can be sorted without calling malloc. */
+	assert(!skinny_mutex_array_init(&a, 16, 0));
+	for (i = 0; i < 12; i++)
+		many[i] = 12 - i;
+
+	assert(!skinny_mutex_array_lock_keys(&a, 12, many));
+	for (i = 0; i < 12; i++)
+		assert(skinny_mutex_trylock(skinny_mutex_array_for_key(&a,
+							many[i])) == EBUSY);
+
+	assert(!skinny_mutex_array_unlock_keys(&a, 12, many));
+	assert(!skinny_mutex_array_destroy(&a));
+
+	/* Every key maps to the only mutex in an array of one. */
+	assert(!skinny_mutex_array_init(&a, 1, 0));
+	assert(skinny_mutex_array_for_key(&a, 12345)
+	       == skinny_mutex_array_get(&a, 0));
+	assert(!skinny_mutex_array_lock_keys(&a, 5, hashes));
+	assert(!skinny_mutex_array_unlock_keys(&a, 5, hashes));
+	assert(!skinny_mutex_array_destroy(&a));
+}
+
+struct test_mutex_array {
+	skinny_mutex_array_t a;
+	int counts[4];
+	int total;
+};
+
+static void *mutex_array_thread(void *v_tma)
+{
+	struct test_mutex_array *tma = v_tma;
+	unsigned int seed = (unsigned int)(uintptr_t)&seed;
+	int i, j, total = 0;
+
+	for (i = 0; i < 10000; i++) {
+		size_t hashes[3];
+
+		for (j = 0; j < 3; j++)
+			hashes[j] = (seed = seed * 1103515245 + 12345) >> 16;
+
+		/* Overlapping sets of keys, locked in arbitrary order,
+		   would deadlock without sorting.  A mutex shared by
+		   several of the keys is counted once for each. */
+		assert(!skinny_mutex_array_lock_keys(&tma->a, 3, hashes));
+		for (j = 0; j < 3; j++) {
+			skinny_mutex_t *m
+				= skinny_mutex_array_for_key(&tma->a,
+							     hashes[j]);
+			tma->counts[m - skinny_mutex_array_get(&tma->a, 0)]++;
+			total++;
+		}
+		assert(!skinny_mutex_array_unlock_keys(&tma->a, 3, hashes));
+	}
+
+	__sync_fetch_and_add(&tma->total, total);
+	return NULL;
+}
+
+static void test_mutex_array_contention(void)
+{
+	struct test_mutex_array tma;
+	pthread_t threads[4];
+	int i;
+
+	assert(!skinny_mutex_array_init(&tma.a, 4, 0));
+	for (i = 0; i < 4; i++)
+		tma.counts[i] = 0;
+	tma.total = 0;
+
+	for (i = 0; i < 4; i++)
+		assert(!pthread_create(&threads[i], NULL, mutex_array_thread,
+				       &tma));
+
+	for (i = 0; i < 4; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	assert(tma.counts[0] + tma.counts[1] + tma.counts[2] + tma.counts[3]
+	       == tma.total);
+	assert(!skinny_mutex_array_destroy(&tma.a));
+}
+
+/* All pooled structures should have been returned once the mutexes
+   are quiescent. */
+static void test_pool_stats(void)
+{
+	struct skinny_mutex_pool_stats stats;
+	int pool;
+
+	for (pool = SKINNY_MUTEX_POOL_PEG;
+	     pool <= SKINNY_MUTEX_POOL_FAT_RWLOCK; pool++) {
+		assert(!skinny_mutex_pool_stats(pool, &stats));
+		assert(stats.allocs == stats.frees);
+		assert(stats.mallocs >= stats.releases);
+		assert(stats.mallocs <= stats.allocs);
+
+#if defined(SKINNY_MUTEX_FUTEX) || defined(SKINNY_MUTEX_PARKING_LOT)
+		if (pool != SKINNY_MUTEX_POOL_FAT_MUTEX)
+#endif
+			assert(stats.allocs);
+	}
+
+	assert(skinny_mutex_pool_stats(-1, &stats) == EINVAL);
+}
+
+static void do_test_simple(void (*f)(skinny_mutex_t *m))
+{
+	skinny_mutex_t mutex;
+
+	assert(!skinny_mutex_init(&mutex));
+	f(&mutex);
+	assert(!skinny_mutex_destroy(&mutex));
+}
+
+struct do_test_cond {
+	skinny_mutex_t mutex;
+	pthread_cond_t cond;
+	int phase;
+};
+
+static void *do_test_cond_thread(void *v_dt)
+{
+	struct do_test_cond *dt = v_dt;
+
+	assert(!skinny_mutex_lock(&dt->mutex));
+	dt->phase = 1;
+	assert(!pthread_cond_signal(&dt->cond));
+
+	do {
+		assert(!skinny_mutex_cond_wait(&dt->cond, &dt->mutex));
+	} while (dt->phase != 2);
+
+	assert(!skinny_mutex_unlock(&dt->mutex));
+
+	return NULL;
+}
+
+/* Run the test with a thread waiting on a cond var associated with the
+   mutex.  This ensures that the skinny mutex has a fat mutex during
+   the text. */
+static void do_test_cond_wait(void (*f)(skinny_mutex_t *m))
+{
+	struct do_test_cond dt;
+	pthread_t thread;
+
+	assert(!skinny_mutex_init(&dt.mutex));
+	assert(!pthread_cond_init(&dt.cond, NULL));
+	dt.phase = 0;
+	assert(!pthread_create(&thread, NULL, do_test_cond_thread, &dt));
+
+	assert(!skinny_mutex_lock(&dt.mutex));
+	while (dt.phase != 1) {
+		assert(!skinny_mutex_cond_wait(&dt.cond, &dt.mutex));
+	};
+	assert(!skinny_mutex_unlock(&dt.mutex));
+
+	f(&dt.mutex);
+
+	assert(!skinny_mutex_lock(&dt.mutex));
+	dt.phase = 2;
+	assert(!pthread_cond_signal(&dt.cond));
+	assert(!skinny_mutex_unlock(&dt.mutex));
+
+	assert(!pthread_join(thread, NULL));
+	assert(!skinny_mutex_destroy(&dt.mutex));
+	assert(!pthread_cond_destroy(&dt.cond));
+}
+
+static void *do_test_hammer_thread(void *v_m)
+{
+	skinny_mutex_t *m = v_m;
+
+	for (;;) {
+		assert(!skinny_mutex_lock(m));
+		assert(!skinny_mutex_unlock(m));
+		pthread_testcancel();
+	}
+
+	return NULL;
+}
+
+/* Run the test with a bunch of other threads hammering on the
+   mutex. */
+static void do_test_hammer(void (*f)(skinny_mutex_t *m))
+{
+	skinny_mutex_t mutex;
+	pthread_t threads[10];
+	int i;
+
+	assert(!skinny_mutex_init(&mutex));
+
+	for (i = 0; i < 10; i++)
+		assert(!pthread_create(&threads[i], NULL,
+				       do_test_hammer_thread, &mutex));
+
+	delay();
+	f(&mutex);
+
+	for (i = 0; i < 10; i++) {
+		void *retval;
+		assert(!pthread_cancel(threads[i]));
+		assert(!pthread_join(threads[i], &retval));
+		assert(retval == PTHREAD_CANCELED);
+	}
+
+	assert(!skinny_mutex_destroy(&mutex));
+}
+
+static void do_test(void (*f)(skinny_mutex_t *m), int hammer)
+{
+	do_test_simple(f);
+	do_test_cond_wait(f);
+	if (hammer)
+		do_test_hammer(f);
+}
+
+static void test_spin_limit(void)
+{
+	unsigned int old = skinny_mutex_set_spin_limit(0);
+
+	do_test(test_contention, 1);
+	assert(skinny_mutex_set_spin_limit(100000) == 0);
+	do_test(test_contention, 1);
+	assert(skinny_mutex_set_spin_limit(old) == 100000);
+}
+
+static void test_elision(void)
+{
+	int old = skinny_mutex_set_elision(0);
+
+	/* Elision can only be enabled where the CPU supports it. */
+	assert(!skinny_mutex_set_elision(1));
+	assert(skinny_mutex_set_elision(old) == old);
+#ifndef SKINNY_MUTEX_ELISION
+	assert(!old);
+#endif
+	do_test(test_contention, 1);
+	do_test(test_cond_wait, 1);
+}
+
+#if !defined(SKINNY_MUTEX_FUTEX) && !defined(SKINNY_MUTEX_PARKING_LOT)
+struct test_handoff {
+	skinny_mutex_t *mutex;
+	int acquired;
+	int hold;
+};
+
+static void *handoff_thread(void *v_th)
+{
+	struct test_handoff *th = v_th;
+	assert(!skinny_mutex_lock(th->mutex));
+	th->acquired = 1;
+	if (th->hold)
+		delay();
+	assert(!skinny_mutex_unlock(th->mutex));
+	return NULL;
+}
+
+#define RUN_LIMIT_THREADS 100
+
+struct test_run_limit {
+	skinny_mutex_t mutex;
+	pthread_t runners[RUN_LIMIT_THREADS + 1];
+	int count;
+};
+
+static void run_record(void *v_trl)
+{
+	struct test_run_limit *trl = v_trl;
+	trl->runners[trl->count++] = pthread_self();
+}
+
+static void *run_limit_thread(void *v_trl)
+{
+	struct test_run_limit *trl = v_trl;
+	assert(!skinny_mutex_run(&trl->mutex, run_record, trl));
+	return NULL;
+}
+
+/* One thread runs at most SKINNY_MUTEX_COMBINE_LIMIT (by default 64)
+   queued closures besides its own. */
+static void test_run_limit(void)
+{
+	struct test_run_limit trl;
+	pthread_t threads[RUN_LIMIT_THREADS];
+	int i, run = 1;
+
+	assert(!skinny_mutex_init(&trl.mutex));
+	trl.count = 0;
+
+	assert(!skinny_mutex_lock(&trl.mutex));
+	for (i = 0; i < RUN_LIMIT_THREADS; i++)
+		assert(!pthread_create(&threads[i], NULL, run_limit_thread,
+				       &trl));
+
+	for (i = 0; i < 10; i++)
+		delay();
+
+	assert(!skinny_mutex_unlock(&trl.mutex));
+	for (i = 0; i < RUN_LIMIT_THREADS; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	assert(trl.count == RUN_LIMIT_THREADS);
+	for (i = 1; i < trl.count; i++) {
+		run = pthread_equal(trl.runners[i], trl.runners[i - 1])
+			? run + 1 : 1;
+		assert(run <= 65);
+	}
+
+	assert(!skinny_mutex_destroy(&trl.mutex));
+}
+
+#ifdef SKINNY_MUTEX_NUMA
+struct numa_waiter {
+	skinny_mutex_t *mutex;
+	int node;
+	int *next;
+	int order;
+};
+
+static void *numa_waiter_thread(void *v_nw)
+{
+	struct numa_waiter *nw = v_nw;
+
+	assert(!skinny_mutex_set_numa_node(nw->node));
+	assert(!skinny_mutex_lock(nw->mutex));
+	nw->order = (*nw->next)++;
+	assert(!skinny_mutex_unlock(nw->mutex));
+	return NULL;
+}
+
+/* A starving waiter at the head of the queue gets the mutex ahead of
+   a waiter on the releasing thread's node. */
+static void test_numa_starving(skinny_mutex_t *mutex)
+{
+	unsigned long old = skinny_mutex_set_starvation_threshold(0);
+	struct numa_waiter remote, local;
+	pthread_t threads[2];
+	int i, next = 0;
+
+	remote.mutex = local.mutex = mutex;
+	remote.next = local.next = &next;
+	remote.node = 1;
+	local.node = 0;
+	assert(!skinny_mutex_set_numa_node(0));
+
+	assert(!skinny_mutex_lock(mutex));
+	assert(!pthread_create(&threads[0], NULL, numa_waiter_thread,
+			       &remote));
+	for (i = 0; i < 10; i++)
+		delay();
+
+	assert(!pthread_create(&threads[1], NULL, numa_waiter_thread,
+			       &local));
+	for (i = 0; i < 10; i++)
+		delay();
+
+	assert(!skinny_mutex_unlock(mutex));
+	for (i = 0; i < 2; i++)
+		assert(!pthread_join(threads[i], NULL));
+
+	assert(remote.order == 0 && local.order == 1);
+	assert(!skinny_mutex_set_numa_node(-1));
+	skinny_mutex_set_starvation_threshold(old);
+}
+#endif
+
+static void test_handoff(skinny_mutex_t *mutex)
+{
+	unsigned long old = skinny_mutex_set_starvation_threshold(0);
+	struct test_handoff th;
+	pthread_t thread;
+	int i;
+
+	th.mutex = mutex;
+	th.acquired = 0;
+	th.hold = 1;
+
+	/* When mutexes are FIFO, unlocking hands the mutex to the
+	   waiter, so the releasing thread can't re-acquire it. */
+	assert(!skinny_mutex_lock(mutex));
+	assert(!pthread_create(&thread, NULL, handoff_thread, &th));
+	for (i = 0;; i++) {
+		/* Give the thread a chance to start waiting. */
+		assert(i < 1000);
+		delay();
+		assert(!skinny_mutex_unlock(mutex));
+		if (skinny_mutex_trylock(mutex) == EBUSY)
+			break;
+	}
+	assert(!pthread_join(thread, NULL));
+	assert(th.acquired);
+
+	/* A waiter that keeps losing out becomes starving, and so
+	   eventually acquires the mutex. */
+	assert(!skinny_mutex_set_starvation_threshold(1000));
+	th.acquired = 0;
+	th.hold = 0;
+	assert(!skinny_mutex_lock(mutex));
+	assert(!pthread_create(&thread, NULL, handoff_thread, &th));
+	delay();
+
+	for (i = 0; i < 1000000 && !th.acquired; i++) {
+		assert(!skinny_mutex_unlock(mutex));
+		assert(!skinny_mutex_lock(mutex));
+	}
+
+	assert(th.acquired);
+	assert(!skinny_mutex_unlock(mutex));
+	assert(!pthread_join(thread, NULL));
+
+	assert(skinny_mutex_set_starvation_threshold(old) == 1000);
+}
+
+struct test_async {
+	struct skinny_mutex_async node;
+	skinny_mutex_t *mutex;
+	int *granted;
+	int order;
+};
+
+static void async_granted(struct skinny_mutex_async *node)
+{
+	struct test_async *ta = (struct test_async *)node;
+
+	ta->order = ++*ta->granted;
+	assert(!skinny_mutex_unlock(ta->mutex));
+}
+
+static void test_lock_async(skinny_mutex_t *mutex)
+{
+	struct test_async ta[3];
+	pthread_cond_t cond;
+	skinny_cond_t scond;
+	struct timespec t;
+	int granted = 0;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		ta[i].mutex = mutex;
+		ta[i].granted = &granted;
+		ta[i].order = 0;
+	}
+
+	/* A free mutex is acquired immediately. */
+	assert(!skinny_mutex_lock_async(mutex, &ta[0].node, async_granted));
+	assert(!skinny_mutex_unlock(mutex));
+
+	/* Nodes are handed the mutex in order as each callback
+	   releases it. */
+	assert(!skinny_mutex_lock(mutex));
+	for (i = 0; i < 3; i++)
+		assert(skinny_mutex_lock_async(mutex, &ta[i].node,
+					       async_granted) == EINPROGRESS);
+
+	delay();
+	assert(!granted);
+	assert(!skinny_mutex_unlock(mutex));
+	for (i = 0; i < 3; i++)
+		assert(ta[i].order == i + 1);
+
+	/* Releasing the mutex by waiting on a condition variable also
+	   hands it to a node. */
+	assert(!pthread_cond_init(&cond, NULL));
+	assert(!skinny_cond_init(&scond));
+	assert(!clock_gettime(CLOCK_REALTIME, &t));
+	t.tv_nsec += 1000000;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_nsec -= 1000000000;
+		t.tv_sec++;
+	}
+
+	assert(!skinny_mutex_lock(mutex));
+	assert(skinny_mutex_lock_async(mutex, &ta[0].node,
+				       async_granted) == EINPROGRESS);
+	assert(skinny_mutex_cond_timedwait(&cond, mutex, &t) == ETIMEDOUT);
+	assert(ta[0].order == 4);
+	assert(skinny_mutex_lock_async(mutex, &ta[1].node,
+				       async_granted) == EINPROGRESS);
+	assert(skinny_cond_timedwait(&scond, mutex, &t) == ETIMEDOUT);
+	assert(ta[1].order == 5);
+	assert(!skinny_mutex_unlock(mutex));
+
+	/* Deferred nodes are handed the mutex in order too, but their
+	   callbacks run on the helper thread rather than in unlock,
+	   and this thread only gets the mutex back after them. */
+	assert(!skinny_mutex_lock(mutex));
+	for (i = 0; i < 3; i++)
+		assert(skinny_mutex_lock_async_deferred(mutex, &ta[i].node,
+							async_granted)
+		       == EINPROGRESS);
+
+	assert(!skinny_mutex_unlock(mutex));
+	assert(!skinny_mutex_lock(mutex));
+	for (i = 0; i < 3; i++)
+		assert(ta[i].order == i + 6);
+
+	assert(!skinny_mutex_unlock(mutex));
+
+	assert(!skinny_cond_destroy(&scond));
+	assert(!pthread_cond_destroy(&cond));
+}
+
+#else
+static void test_lock_async_unsupported(skinny_mutex_t *mutex)
+{
+	struct skinny_mutex_async node;
+
+	assert(skinny_mutex_lock_async(mutex, &node, NULL) == ENOSYS);
+	assert(skinny_mutex_lock_async_deferred(mutex, &node, NULL)
+	       == ENOSYS);
+}
+#endif
+
+#if !defined(SKINNY_MUTEX_FUTEX) && !defined(SKINNY_MUTEX_PARKING_LOT)
+/* Waiting on a condition variable does not inflate an uncontended
+   mutex. */
+static void test_cond_wait_uninflated(void)
+{
+	struct skinny_mutex_pool_stats before, after;
+	skinny_mutex_t mutex;
+
+	assert(!skinny_mutex_init(&mutex));
+	assert(!skinny_mutex_pool_stats(SKINNY_MUTEX_POOL_FAT_MUTEX, &before));
+	test_cond_timedwait(&mutex);
+	assert(!skinny_mutex_pool_stats(SKINNY_MUTEX_POOL_FAT_MUTEX, &after));
+	assert(after.allocs == before.allocs);
+	assert(!mutex.val);
+	assert(!skinny_mutex_destroy(&mutex));
+}
+#endif
+
+static int find_test_stats(const struct skinny_mutex_stats *stats,
+			   void *v_found)
+{
+	struct skinny_mutex_stats *found = v_found;
+
+	if (!stats->name || strcmp(stats->name, "test_stats"))
+		return 0;
+
+	*found = *stats;
+	return 1;
+}
+
+static void test_stats(void)
+{
+#ifdef SKINNY_MUTEX_STATS
+	skinny_mutex_t mutex;
+	struct skinny_mutex_stats found;
+	unsigned long holds = 0;
+	int i;
+
+	assert(!skinny_mutex_stats_reset());
+	assert(!skinny_mutex_init(&mutex));
+	assert(!skinny_mutex_stats_name(&mutex, "test_stats"));
+
+	test_contention(&mutex);
+	assert(!skinny_mutex_lock(&mutex));
+	assert(skinny_mutex_trylock(&mutex) == EBUSY);
+	assert(!skinny_mutex_unlock(&mutex));
+
+	assert(skinny_mutex_stats_iterate(find_test_stats, &found) == 1);
+	assert(found.slow_locks && found.waits);
+	assert(found.trylock_failures == 1);
+	for (i = 0; i < SKINNY_MUTEX_STATS_BUCKETS; i++)
+		holds += found.hold_ns[i];
+#if !defined(SKINNY_MUTEX_FUTEX) && !defined(SKINNY_MUTEX_PARKING_LOT)
+	assert(found.promotions && holds);
+#endif
+
+	assert(!skinny_mutex_stats_reset());
+	assert(!skinny_mutex_stats_iterate(find_test_stats, &found));
+	assert(!skinny_mutex_stats_name(&mutex, NULL));
+	assert(!skinny_mutex_destroy(&mutex));
+#else
+	assert(skinny_mutex_stats_iterate(find_test_stats, NULL) == ENOSYS);
+#endif
+}
+
+/* The kernel finds the holder of a PI mutex from its word. */
+static void test_pi_owner(void)
+{
+#ifdef SKINNY_MUTEX_PI
+	skinny_mutex_t mutex;
+
+	assert(!skinny_mutex_init(&mutex));
+	assert(!skinny_mutex_lock(&mutex));
+	assert((uint32_t)(uintptr_t)mutex.val
+	       == (uint32_t)syscall(SYS_gettid));
+	assert(skinny_mutex_lock(&mutex) == EDEADLK);
+	assert(!skinny_mutex_unlock(&mutex));
+	assert(!skinny_mutex_destroy(&mutex));
+#endif
+}
+
+struct test_pshared {
+	skinny_mutex_t mutex;
+	skinny_cond_t cond;
+	int count;
+};
+
+/* Mutexes and skinny_conds in shared memory work between
+   processes. */
+static void test_pshared(void)
+{
+#ifdef SKINNY_MUTEX_PSHARED
+	struct test_pshared *tp;
+	pid_t pids[4];
+	int i, j, status;
+
+	tp = mmap(NULL, sizeof *tp, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(tp != MAP_FAILED);
+	assert(!skinny_mutex_init(&tp->mutex));
+	assert(!skinny_cond_init(&tp->cond));
+	tp->count = 0;
+
+	for (i = 0; i < 4; i++) {
+		pids[i] = fork();
+		assert(pids[i] >= 0);
+		if (pids[i])
+			continue;
+
+		for (j = 0; j < 10000; j++) {
+			assert(!skinny_mutex_lock(&tp->mutex));
+			tp->count++;
+			assert(!skinny_mutex_unlock(&tp->mutex));
+		}
+
+		assert(!skinny_mutex_lock(&tp->mutex));
+		assert(!skinny_cond_broadcast(&tp->cond));
+		assert(!skinny_mutex_unlock(&tp->mutex));
+		_exit(0);
+	}
+
+	assert(!skinny_mutex_lock(&tp->mutex));
+	while (tp->count != 40000)
+		assert(!skinny_cond_wait(&tp->cond, &tp->mutex));
+	assert(!skinny_mutex_unlock(&tp->mutex));
+
+	for (i = 0; i < 4; i++) {
+		assert(waitpid(pids[i], &status, 0) == pids[i]);
+		assert(WIFEXITED(status) && !WEXITSTATUS(status));
+	}
+
+	assert(!skinny_cond_destroy(&tp->cond));
+	assert(!skinny_mutex_destroy(&tp->mutex));
+	assert(!munmap(tp, sizeof *tp));
+#endif
+}
+
+#ifdef SKINNY_MUTEX_ROBUST
+
+static void *test_robust_thread(void *v_m)
+{
+	skinny_mutex_t *m = v_m;
+
+	/* Exit while holding the mutex */
+	assert(!skinny_mutex_lock(m));
+	return NULL;
+}
+
+struct test_robust {
+	skinny_mutex_t mutex;
+	pthread_mutex_t pmutex;
+};
+
+/* Exit holding both a skinny_mutex and a robust pthreads mutex. */
+static void *test_robust_both_thread(void *v_tr)
+{
+	struct test_robust *tr = v_tr;
+
+	assert(!skinny_mutex_lock(&tr->mutex));
+	assert(!pthread_mutex_lock(&tr->pmutex));
+	return NULL;
+}
+
+static void *test_robust_waiter(void *v_m)
+{
+	skinny_mutex_t *m = v_m;
+
+	assert(skinny_mutex_lock(m) == EOWNERDEAD);
+	assert(skinny_mutex_unlock(m) == 0);
+	return NULL;
+}
+
+#endif
+
+/* The next thread to acquire a robust mutex after its holder dies
+   gets EOWNERDEAD. */
+static void test_robust(void)
+{
+#ifdef SKINNY_MUTEX_ROBUST
+	skinny_mutex_t *m, others[2], *ms[3];
+	struct test_robust tr;
+	pthread_mutexattr_t attr;
+	pthread_t thread, waiter;
+	size_t dead;
+	pid_t pid;
+	int status, i;
+
+	m = mmap(NULL, sizeof *m, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(m != MAP_FAILED);
+
+	/* Made consistent, it can be used as normal. */
+	assert(!skinny_mutex_init(m));
+	assert(skinny_mutex_consistent(m) == EINVAL);
+	assert(!pthread_create(&thread, NULL, test_robust_thread, m));
+	assert(!pthread_join(thread, NULL));
+	assert(skinny_mutex_lock(m) == EOWNERDEAD);
+	assert(!skinny_mutex_consistent(m));
+	assert(skinny_mutex_consistent(m) == EINVAL);
+	assert(!skinny_mutex_unlock(m));
+	assert(!skinny_mutex_trylock(m));
+	assert(!skinny_mutex_unlock(m));
+
+	/* Also when acquiring it with trylock. */
+	assert(!pthread_create(&thread, NULL, test_robust_thread, m));
+	assert(!pthread_join(thread, NULL));
+	assert(skinny_mutex_trylock(m) == EOWNERDEAD);
+	assert(!skinny_mutex_consistent(m));
+	assert(!skinny_mutex_unlock(m));
+
+	/* Locking several mutexes returns holding only the inconsistent
+	   one, and says which it is. */
+	for (i = 0; i < 2; i++)
+		assert(!skinny_mutex_init(&others[i]));
+
+	ms[0] = &others[0];
+	ms[1] = m;
+	ms[2] = &others[1];
+	assert(!pthread_create(&thread, NULL, test_robust_thread, m));
+	assert(!pthread_join(thread, NULL));
+	dead = 0;
+	assert(skinny_mutex_lock_many(ms, 3, &dead) == EOWNERDEAD);
+	assert(dead == 1);
+	for (i = 0; i < 2; i++) {
+		assert(!skinny_mutex_trylock(&others[i]));
+		assert(!skinny_mutex_unlock(&others[i]));
+	}
+
+	assert(!skinny_mutex_consistent(m));
+	assert(!skinny_mutex_unlock(m));
+	assert(!skinny_mutex_lock_many(ms, 3, &dead));
+	assert(!skinny_mutex_unlock_many(ms, 3));
+
+	assert(!pthread_create(&thread, NULL, test_robust_thread, m));
+	assert(!pthread_join(thread, NULL));
+	dead = 0;
+	assert(skinny_mutex_trylock_many(ms, 3, &dead) == EOWNERDEAD);
+	assert(dead == 1);
+	assert(!skinny_mutex_consistent(m));
+	assert(!skinny_mutex_unlock(m));
+	for (i = 0; i < 2; i++)
+		assert(!skinny_mutex_destroy(&others[i]));
+
+	/* Robust pthreads mutexes still work alongside. */
+	assert(!skinny_mutex_init(&tr.mutex));
+	assert(!pthread_mutexattr_init(&attr));
+	assert(!pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST));
+	assert(!pthread_mutex_init(&tr.pmutex, &attr));
+	assert(!pthread_mutexattr_destroy(&attr));
+	assert(!pthread_create(&thread, NULL, test_robust_both_thread, &tr));
+	assert(!pthread_join(thread, NULL));
+	assert(pthread_mutex_lock(&tr.pmutex) == EOWNERDEAD);
+	assert(!pthread_mutex_consistent(&tr.pmutex));
+	assert(!pthread_mutex_unlock(&tr.pmutex));
+	assert(!pthread_mutex_destroy(&tr.pmutex));
+	assert(skinny_mutex_lock(&tr.mutex) == EOWNERDEAD);
+	assert(!skinny_mutex_consistent(&tr.mutex));
+	assert(!skinny_mutex_unlock(&tr.mutex));
+	assert(!skinny_mutex_destroy(&tr.mutex));
+
+	/* Also when the holder is another process, and a thread is
+	   blocked waiting for the mutex.  The waiter releases it without
+	   making it consistent, so it becomes unusable. */
+	pid = fork();
+	assert(pid >= 0);
+	if (!pid) {
+		assert(!skinny_mutex_lock(m));
+		delay();
+		_exit(0);
+	}
+
+	while (!m->val)
+		delay();
+
+	assert(!pthread_create(&waiter, NULL, test_robust_waiter, m));
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && !WEXITSTATUS(status));
+	assert(!pthread_join(waiter, NULL));
+	assert(skinny_mutex_lock(m) == ENOTRECOVERABLE);
+	assert(skinny_mutex_trylock(m) == ENOTRECOVERABLE);
+
+	assert(!munmap(m, sizeof *m));
+#endif
 }
 
 int main(void)
@@ -349,10 +1828,53 @@ int main(void)
 	do_test(test_contention, 1);
 	do_test(test_lock_cancellation, 1);
 	do_test(test_trylock, 0);
+	do_test(test_timedlock, 1);
+	do_test(test_run, 1);
 	do_test(test_cond_wait, 1);
 	do_test(test_cond_timedwait, 1);
 	do_test(test_cond_wait_cancellation, 1);
 	do_test(test_unlock_not_held, 0);
+	do_test(test_skinny_cond, 1);
+
+#if !defined(SKINNY_MUTEX_FUTEX) && !defined(SKINNY_MUTEX_PARKING_LOT)
+	do_test(test_handoff, 1);
+	test_run_limit();
+#ifdef SKINNY_MUTEX_NUMA
+	do_test(test_numa_starving, 0);
+#else
+	assert(skinny_mutex_set_numa_node(0) == ENOSYS);
+#endif
+	do_test(test_lock_async, 0);
+	test_cond_wait_uninflated();
+#else
+	do_test(test_lock_async_unsupported, 0);
+#endif
+	test_spin_limit();
+	test_elision();
+	test_pi_owner();
+	test_pshared();
+	test_robust();
+
+	test_rwlock_uncontended();
+	test_rwlock_contention();
+	test_rwlock_handoff();
+	test_rwlock_cond_wait();
+
+	test_bitlock_uncontended();
+	test_bitlock_contention();
+	test_bitlock_handoff();
+
+	test_seqlock_uncontended();
+	test_seqlock_contention();
+
+	test_lock_many();
+	test_lock_many_contention();
+
+	test_mutex_array_layout();
+	test_mutex_array_contention();
+
+	test_pool_stats();
+	test_stats();
 
 	return 0;
 }
@@ -0,0 +1,280 @@
+/* Tests for the C++ wrappers in skinny_mutex.hpp. */
+
+#include <assert.h>
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "skinny_mutex.hpp"
+
+/* Constant-initialized, so it can be used by other static
+   initializers. */
+static skinny::mutex static_mutex;
+
+static void delay()
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+}
+
+static void test_static_mutex()
+{
+	std::lock_guard<skinny::mutex> guard(static_mutex);
+	assert(static_mutex.native_handle()->val);
+}
+
+template <class Mutex>
+static void test_contention()
+{
+	Mutex mutex;
+	std::thread threads[4];
+	long count = 0;
+
+	for (auto &t : threads)
+		t = std::thread([&] {
+			for (int i = 0; i < 10000; i++) {
+				std::lock_guard<Mutex> guard(mutex);
+				count++;
+			}
+		});
+
+	for (auto &t : threads)
+		t.join();
+
+	assert(count == 40000);
+}
+
+static void test_scoped_lock()
+{
+	skinny::mutex a, b;
+
+	{
+		std::scoped_lock lock(a, b);
+		assert(!a.try_lock());
+		assert(!b.try_lock());
+	}
+
+	assert(a.try_lock());
+	a.unlock();
+}
+
+static void test_timed()
+{
+	skinny::mutex mutex;
+	std::unique_lock<skinny::mutex> lock(mutex);
+	std::atomic<bool> timed_out(false);
+
+	std::thread thread([&] {
+		using namespace std::chrono;
+
+		assert(!mutex.try_lock_for(milliseconds(1)));
+		assert(!mutex.try_lock_until(steady_clock::now()
+					     + milliseconds(1)));
+		assert(!mutex.try_lock_until(system_clock::now()
+					     + milliseconds(1)));
+		timed_out = true;
+		assert(mutex.try_lock_for(seconds(10)));
+		mutex.unlock();
+	});
+
+	while (!timed_out)
+		delay();
+
+	lock.unlock();
+	thread.join();
+}
+
+static void test_condition_variable()
+{
+	skinny::mutex mutex;
+	skinny::condition_variable_any cond;
+	int phase = 0;
+
+	std::thread thread([&] {
+		std::unique_lock<skinny::mutex> lock(mutex);
+		phase = 1;
+		cond.notify_all();
+		cond.wait(lock, [&] { return phase == 2; });
+	});
+
+	{
+		std::unique_lock<skinny::mutex> lock(mutex);
+		cond.wait(lock, [&] { return phase == 1; });
+		assert(!cond.wait_for(lock, std::chrono::milliseconds(1),
+				      [] { return false; }));
+		phase = 2;
+		cond.notify_all();
+	}
+
+	thread.join();
+
+	/* A bare mutex works as the lock too. */
+	mutex.lock();
+	assert(cond.wait_for(mutex, std::chrono::milliseconds(1))
+	       == std::cv_status::timeout);
+	mutex.unlock();
+}
+
+static void test_stats_policy()
+{
+	skinny::basic_mutex<skinny::policy<0, false, true> > mutex;
+
+#ifdef SKINNY_MUTEX_STATS
+	mutex.name("test_stats_policy");
+#else
+	try {
+		mutex.name("test_stats_policy");
+		assert(0);
+	}
+	catch (const std::system_error &e) {
+		assert(e.code().value() == ENOSYS);
+	}
+#endif
+
+	std::lock_guard<decltype(mutex)> guard(mutex);
+}
+
+#ifdef __cpp_impl_coroutine
+/* A coroutine that starts immediately and frees itself when done. */
+struct detached {
+	struct promise_type {
+		detached get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+static detached bump(skinny::mutex &mutex, long &count,
+		     std::atomic<bool> &done)
+{
+	co_await mutex.lock_async();
+	count++;
+	mutex.unlock();
+	done = true;
+}
+
+static void test_lock_async()
+{
+	skinny::mutex mutex;
+	std::atomic<bool> done[4];
+	std::thread threads[4];
+	long count = 0;
+
+	/* When the mutex is held, the coroutine is resumed once it is
+	   unlocked. */
+	{
+		std::unique_lock<skinny::mutex> lock(mutex);
+		done[0] = false;
+		bump(mutex, count, done[0]);
+		delay();
+		assert(!done[0] && !count);
+	}
+
+	while (!done[0])
+		std::this_thread::yield();
+
+	assert(count == 1);
+
+	/* Coroutines and blocking threads sharing the mutex. */
+	for (int i = 0; i < 4; i++)
+		threads[i] = std::thread([&, i] {
+			for (int j = 0; j < 10000; j++) {
+				if (j % 2) {
+					std::lock_guard<skinny::mutex> guard(
+						mutex);
+					count++;
+					continue;
+				}
+
+				done[i] = false;
+				bump(mutex, count, done[i]);
+				while (!done[i])
+					std::this_thread::yield();
+			}
+		});
+
+	for (auto &t : threads)
+		t.join();
+
+	assert(count == 40001);
+}
+
+static detached bump_counted(skinny::mutex &mutex, long &count,
+			     std::atomic<long> &finished)
+{
+	co_await mutex.lock_async();
+	count++;
+	mutex.unlock();
+	finished++;
+}
+
+static detached bump_posted(skinny::mutex &mutex, long &count,
+			    std::vector<std::coroutine_handle<> > &posted)
+{
+	co_await mutex.lock_async([&posted](std::coroutine_handle<> h) {
+		posted.push_back(h);
+	});
+	count++;
+	mutex.unlock();
+}
+
+/* Coroutines queued behind each other are not resumed on the stack
+   of the one that releases the mutex to them. */
+static void test_lock_async_depth()
+{
+	const long n = 100000;
+	skinny::mutex mutex;
+	std::atomic<long> finished(0);
+	std::vector<std::coroutine_handle<> > posted;
+	long count = 0;
+
+	mutex.lock();
+	for (long i = 0; i < n; i++)
+		bump_counted(mutex, count, finished);
+
+	mutex.unlock();
+	while (finished != n)
+		std::this_thread::yield();
+
+	assert(count == n);
+
+	/* With a post function, the releasing thread hands the
+	   coroutine to it rather than resuming it. */
+	count = 0;
+	mutex.lock();
+	for (long i = 0; i < n; i++)
+		bump_posted(mutex, count, posted);
+
+	mutex.unlock();
+	assert(posted.size() == 1 && !count);
+	while (!posted.empty()) {
+		std::coroutine_handle<> h = posted.back();
+		posted.pop_back();
+		h.resume();
+	}
+
+	assert(count == n);
+}
+#endif
+
+int main()
+{
+	test_static_mutex();
+	test_contention<skinny::mutex>();
+	test_contention<skinny::basic_mutex<skinny::policy<100> > >();
+	test_contention<skinny::basic_mutex<skinny::policy<0, true> > >();
+	test_scoped_lock();
+	test_timed();
+	test_condition_variable();
+	test_stats_policy();
+#ifdef __cpp_impl_coroutine
+	test_lock_async();
+	test_lock_async_depth();
+#endif
+	return 0;
+}